@@ -0,0 +1,220 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "channel.h"
+#include "memory.h"
+#include "object.h"
+
+typedef enum {
+    MSG_VALUE,   // nil, a boolean or a number, which mean the same in any VM
+    MSG_STRING,  // the characters follow
+    MSG_CHANNEL, // holds a reference to the channel
+} MessageKind;
+
+typedef struct Message {
+    _Atomic(struct Message *) next;
+    MessageKind kind;
+    Value value;
+    Channel *channel;
+    int len;
+    char chars[];
+} Message;
+
+/* An intrusive MPSC queue after Dmitry Vyukov's. Senders swap their message
+ * in as the new `head` and then link the old head to it; the receiver walks
+ * from `tail`, which always points at a message already taken (initially a
+ * stub). A sender between the two steps makes the queue look empty up to
+ * its message until it links it in. */
+struct Channel {
+    atomic_int refs;
+    _Atomic(Message *) head;
+    Message *tail;
+
+    // receivers hold `lock` while taking messages and sleep on `ready`
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    atomic_int sleepers;
+};
+
+// A named channel, kept for the rest of the process.
+typedef struct Name {
+    struct Name *next;
+    Channel *channel;
+    int len;
+    char chars[];
+} Name;
+
+static pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+static Name *names = NULL;
+
+// Channels and their messages are not any VM's to account for or collect.
+static void *allocate(size_t size) {
+    void *ret = malloc(size);
+    if (!ret) {
+        perror("malloc: ");
+        exit(1);
+    }
+
+    return ret;
+}
+
+static Message *new_message(MessageKind kind, int len) {
+    Message *msg = allocate(sizeof(Message) + len);
+    atomic_init(&msg->next, NULL);
+    msg->kind = kind;
+    msg->value = NIL_VAL;
+    msg->channel = NULL;
+    msg->len = len;
+    return msg;
+}
+
+Channel *channelNew() {
+    Channel *channel = allocate(sizeof(Channel));
+    Message *stub = new_message(MSG_VALUE, 0);
+    atomic_init(&channel->refs, 1);
+    atomic_init(&channel->head, stub);
+    channel->tail = stub;
+    pthread_mutex_init(&channel->lock, NULL);
+    pthread_cond_init(&channel->ready, NULL);
+    atomic_init(&channel->sleepers, 0);
+    return channel;
+}
+
+Channel *channelNamed(const char *chars, int len) {
+    pthread_mutex_lock(&names_lock);
+    Name *name = names;
+    while (name != NULL &&
+           (name->len != len || memcmp(name->chars, chars, len) != 0)) {
+        name = name->next;
+    }
+
+    if (name == NULL) {
+        name = allocate(sizeof(Name) + len);
+        name->channel = channelNew();
+        name->len = len;
+        memcpy(name->chars, chars, len);
+        name->next = names;
+        names = name;
+    }
+
+    channelRetain(name->channel);
+    pthread_mutex_unlock(&names_lock);
+    return name->channel;
+}
+
+void channelRetain(Channel *channel) { atomic_fetch_add(&channel->refs, 1); }
+
+void channelRelease(Channel *channel) {
+    if (atomic_fetch_sub(&channel->refs, 1) != 1) {
+        return;
+    }
+
+    // Nobody can send any more. Messages past the tail were never taken and
+    // still own what they carry.
+    Message *msg = channel->tail;
+    Message *next = atomic_load(&msg->next);
+    free(msg);
+    while (next != NULL) {
+        msg = next;
+        next = atomic_load(&msg->next);
+        if (msg->kind == MSG_CHANNEL) {
+            channelRelease(msg->channel);
+        }
+        free(msg);
+    }
+
+    pthread_mutex_destroy(&channel->lock);
+    pthread_cond_destroy(&channel->ready);
+    free(channel);
+}
+
+bool channelSend(Channel *channel, Value val) {
+    Message *msg;
+    if (IS_NIL(val) || IS_BOOL(val) || IS_NUMBER(val)) {
+        msg = new_message(MSG_VALUE, 0);
+        msg->value = val;
+    } else if (IS_STRING(val)) {
+        ObjString *str = AS_STRING(val);
+        msg = new_message(MSG_STRING, str->len);
+        memcpy(msg->chars, str->chars, str->len);
+    } else if (IS_CHANNEL(val)) {
+        msg = new_message(MSG_CHANNEL, 0);
+        msg->channel = AS_CHANNEL(val)->channel;
+        channelRetain(msg->channel);
+    } else {
+        return false;
+    }
+
+    Message *prev = atomic_exchange(&channel->head, msg);
+    atomic_store(&prev->next, msg);
+
+    // A receiver counts itself in `sleepers` before it looks at the queue a
+    // last time, so either it sees the message or this sees it.
+    if (atomic_load(&channel->sleepers) > 0) {
+        pthread_mutex_lock(&channel->lock);
+        pthread_cond_broadcast(&channel->ready);
+        pthread_mutex_unlock(&channel->lock);
+    }
+    return true;
+}
+
+// the next message, which becomes the new tail, or NULL; under `lock`
+static Message *take(Channel *channel) {
+    Message *tail = channel->tail;
+    Message *next = atomic_load(&tail->next);
+    if (next == NULL) {
+        return NULL;
+    }
+
+    channel->tail = next;
+    free(tail);
+    return next;
+}
+
+Value channelReceive(Channel *channel) {
+    pthread_mutex_lock(&channel->lock);
+    Message *msg = take(channel);
+    while (msg == NULL) {
+        atomic_fetch_add(&channel->sleepers, 1);
+        msg = take(channel);
+        if (msg == NULL) {
+            pthread_cond_wait(&channel->ready, &channel->lock);
+            msg = take(channel);
+        }
+        atomic_fetch_sub(&channel->sleepers, 1);
+    }
+
+    // Copy out what the message carries while it cannot be freed: it stays
+    // behind as the tail, and the next receiver may free it once `lock` is
+    // released. The characters go straight into the buffer the string takes,
+    // which the VM only accounts for past the lock, as that may collect.
+    MessageKind kind = msg->kind;
+    Value val = msg->value;
+    Channel *carried = msg->channel;
+    int len = msg->len;
+    char *chars = NULL;
+    if (kind == MSG_STRING) {
+        chars = allocate(sizeof(char) * (len + 1));
+        memcpy(chars, msg->chars, len);
+        chars[len] = '\0';
+    }
+    pthread_mutex_unlock(&channel->lock);
+
+    switch (kind) {
+    case MSG_STRING:
+        // realloc() leaves a buffer of the same size where it is
+        chars = mem_reallocate(chars, 0, sizeof(char) * (len + 1));
+        val = OBJ_VAL(takeString(chars, len));
+        break;
+    case MSG_CHANNEL:
+        // the message's reference goes to the new object
+        val = OBJ_VAL(newChannel(carried));
+        break;
+    case MSG_VALUE:
+        break;
+    }
+    return val;
+}
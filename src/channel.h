@@ -0,0 +1,31 @@
+#ifndef CLOX_CHANNEL_H
+#define CLOX_CHANNEL_H
+
+#include "common.h"
+#include "value.h"
+
+/* A queue of messages between VMs, possibly on different threads. Senders
+ * never block or lock: a message is linked in with a single atomic exchange.
+ * Receivers take turns under a lock and sleep while the channel is empty.
+ * Messages carry copies of what crosses, i.e. nil, booleans, numbers,
+ * strings and other channels, so no object is ever shared between heaps.
+ *
+ * Channels live outside of any VM's heap and are reference counted: every
+ * ObjChannel and every message carrying the channel holds a reference, and
+ * named channels stay around for the rest of the process. */
+typedef struct Channel Channel;
+
+// a fresh channel, with one reference for the caller
+Channel *channelNew();
+// The channel called `chars`, shared by every VM of the process, with a new
+// reference for the caller.
+Channel *channelNamed(const char *chars, int len);
+void channelRetain(Channel *channel);
+void channelRelease(Channel *channel);
+
+// Queues a copy of `val`. Returns false for values that cannot be sent.
+bool channelSend(Channel *channel, Value val);
+// Waits for the next message and rebuilds its value in the current VM.
+Value channelReceive(Channel *channel);
+
+#endif
@@ -12,12 +12,16 @@ void initChunk(Chunk *chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
 }
 
 void freeChunk(Chunk *chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
     freeValueArray(&chunk->constants);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
     initChunk(chunk);
 }
 
@@ -41,3 +45,210 @@ int addConstant(Chunk *chunk, Value val) {
     pop();
     return chunk->constants.len - 1;
 }
+
+int addInlineCache(Chunk *chunk, ObjString *name) {
+    gcLockHeap();
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int old_cap = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(old_cap);
+
+        push(OBJ_VAL(name));
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, old_cap,
+                                   chunk->cacheCapacity);
+        pop();
+    }
+
+    InlineCache *cache = &chunk->caches[chunk->cacheCount];
+    cache->name = name;
+    cache->count = 0;
+    int index = chunk->cacheCount++;
+    gcUnlockHeap();
+    return index;
+}
+
+int instructionLen(Chunk *chunk, int offset) {
+    switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_DEFINE_GLOBAL:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_SET_LOCAL_POP:
+        return 2;
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+    case OP_GET_UPVALUE_LONG:
+    case OP_SET_UPVALUE_LONG:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_GET_LOCAL_GET_LOCAL:
+    case OP_GET_LOCAL_CONSTANT:
+    case OP_LESS_JUMP_IF_FALSE:
+        return 3;
+    case OP_CONSTANT_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_CLASS_LONG:
+    case OP_METHOD_LONG:
+    case OP_INVOKE:
+    case OP_GET_LOCAL_PROPERTY:
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RR:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RR:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RR:
+    case OP_DIVIDE_RK:
+        return 4;
+    case OP_LESS_RR_JUMP:
+    case OP_LESS_RK_JUMP:
+        return 5;
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG: {
+        // each captured variable adds an isLocal byte and its index, of two
+        // bytes in the long form
+        bool wide = chunk->code[offset] == OP_CLOSURE_LONG;
+        uint32_t constant = chunk->code[offset + 1];
+        if (wide) {
+            constant = (constant << 16) | (chunk->code[offset + 2] << 8) |
+                       chunk->code[offset + 3];
+        }
+
+        ObjFunction *func = AS_FUNC(chunk->constants.values[constant]);
+        return (wide ? 4 : 2) + (wide ? 3 : 2) * func->upvalueCount;
+    }
+    default:
+        return 1;
+    }
+}
+
+// values the instruction at `offset` pushes, negative when it pops
+static int stack_effect(Chunk *chunk, int offset) {
+    uint8_t *code = chunk->code + offset;
+    switch (code[0]) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+    case OP_GET_UPVALUE:
+    case OP_GET_UPVALUE_LONG:
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+    case OP_CLASS:
+    case OP_CLASS_LONG:
+    case OP_GET_LOCAL_PROPERTY:
+        return 1;
+    case OP_GET_LOCAL_GET_LOCAL:
+    case OP_GET_LOCAL_CONSTANT:
+        return 2;
+    case OP_POP:
+    case OP_SET_PROPERTY:
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_PRINT:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_CLOSE_UPVALUE:
+    case OP_METHOD:
+    case OP_METHOD_LONG:
+    case OP_RETURN:
+    case OP_SET_LOCAL_POP:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_EQUAL_NUM:
+    case OP_NOT_EQUAL_NUM:
+    case OP_ADD_ANY:
+    case OP_EQUAL_ANY:
+    case OP_NOT_EQUAL_ANY:
+        return -1;
+    case OP_LESS_JUMP_IF_FALSE:
+        return -2;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+        return -code[1];
+    case OP_INVOKE:
+        return -code[3];
+    default:
+        return 0;
+    }
+}
+
+// where the forward jump at `offset` goes, -1 if it is not one
+static int jump_target(Chunk *chunk, int offset) {
+    uint8_t *code = chunk->code + offset;
+    switch (code[0]) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_LESS_JUMP_IF_FALSE:
+        return offset + 3 + ((code[1] << 8) | code[2]);
+    case OP_LESS_RR_JUMP:
+    case OP_LESS_RK_JUMP:
+        return offset + 5 + ((code[3] << 8) | code[4]);
+    default:
+        return -1;
+    }
+}
+
+int stackSize(Chunk *chunk, int base) {
+    // The compiler emits structured code, so every instruction that does not
+    // follow on from the one before it is the target of a forward jump seen
+    // earlier, which tells the height there.
+    int *heights = GROW_ARRAY(int, NULL, 0, chunk->len + 1);
+    for (size_t i = 0; i <= chunk->len; i++) {
+        heights[i] = -1;
+    }
+
+    int height = base;
+    int size = base;
+    for (int offset = 0; offset < (int)chunk->len;
+         offset += instructionLen(chunk, offset)) {
+        if (heights[offset] >= 0) {
+            height = heights[offset];
+        }
+
+        uint8_t op = chunk->code[offset];
+        if (op == OP_ADD_RR || op == OP_ADD_RK) {
+            // strings are concatenated on the stack
+            size = height + 2 > size ? height + 2 : size;
+        }
+
+        height += stack_effect(chunk, offset);
+        size = height > size ? height : size;
+
+        int target = jump_target(chunk, offset);
+        if (target >= 0 && target <= (int)chunk->len) {
+            heights[target] = height;
+        }
+    }
+
+    FREE_ARRAY(int, heights, chunk->len + 1);
+    return size;
+}
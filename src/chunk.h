@@ -4,24 +4,45 @@
 #include "common.h"
 #include "value.h"
 
+// largest operand of the _LONG constant and global instructions
+#define UINT24_MAX 0xffffff
+
+/* Instructions that index constants, globals, locals or upvalues take a one
+ * byte operand. Each has a _LONG variant for indices that do not fit: 24-bit
+ * for constants and globals, 16-bit for locals and upvalues, all stored
+ * big-endian like jump offsets. OP_CLOSURE is followed by an is-local byte
+ * and a one-byte index for each upvalue it captures. OP_CLOSURE_LONG, used
+ * when either the constant or one of those indices does not fit a byte,
+ * takes 16-bit indices. */
 typedef enum {
     OP_CONSTANT,
+    OP_CONSTANT_LONG,
     OP_NIL,
     OP_TRUE,
     OP_FALSE,
     OP_POP,
     OP_GET_LOCAL,
+    OP_GET_LOCAL_LONG,
     OP_SET_LOCAL,
+    OP_SET_LOCAL_LONG,
     OP_GET_GLOBAL,
+    OP_GET_GLOBAL_LONG,
     OP_SET_GLOBAL,
+    OP_SET_GLOBAL_LONG,
     OP_GET_UPVALUE,
+    OP_GET_UPVALUE_LONG,
     OP_SET_UPVALUE,
+    OP_SET_UPVALUE_LONG,
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
     OP_DEFINE_GLOBAL,
+    OP_DEFINE_GLOBAL_LONG,
     OP_EQUAL,
+    OP_NOT_EQUAL,
     OP_GREATER,
+    OP_GREATER_EQUAL,
     OP_LESS,
+    OP_LESS_EQUAL,
     OP_ADD,
     OP_SUBTRACT,
     OP_MULTIPLY,
@@ -31,27 +52,102 @@ typedef enum {
     OP_PRINT,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
+    OP_POP_JUMP_IF_FALSE, // only emitted by the optimizer
     OP_LOOP,
     OP_CALL,
+    OP_TAIL_CALL, // a call whose result is returned, followed by OP_RETURN
     OP_CLOSURE,
+    OP_CLOSURE_LONG,
     OP_CLOSE_UPVALUE,
     OP_CLASS,
+    OP_CLASS_LONG,
     OP_METHOD,
+    OP_METHOD_LONG,
     OP_INVOKE,
     OP_RETURN,
+
+    // Superinstructions, only emitted by the optimizer. Each one's operands
+    // are those of the pair it replaces, in order.
+    OP_GET_LOCAL_GET_LOCAL,
+    OP_GET_LOCAL_CONSTANT,
+    OP_GET_LOCAL_PROPERTY,
+    OP_SET_LOCAL_POP,
+    OP_LESS_JUMP_IF_FALSE,
+
+    // Quickened forms that run() rewrites a generic instruction into once it
+    // has seen the operand types. When their guard fails, the site becomes
+    // the _ANY form for good, which handles every type and never quickens,
+    // so a site seeing several types does not keep rewriting itself.
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_EQUAL_NUM,
+    OP_NOT_EQUAL_NUM,
+    OP_ADD_ANY,
+    OP_EQUAL_ANY,
+    OP_NOT_EQUAL_ANY,
+
+    // Three-address superinstructions emitted by the optimizer for
+    // --registers, over the frame's slots and inside the stack code. The
+    // arithmetic ones take destination, left and right operands: R operands
+    // are slots of the frame, K operands constants. The jumps branch when
+    // the comparison is false.
+    OP_ADD_RR,
+    OP_ADD_RK,
+    OP_SUBTRACT_RR,
+    OP_SUBTRACT_RK,
+    OP_MULTIPLY_RR,
+    OP_MULTIPLY_RK,
+    OP_DIVIDE_RR,
+    OP_DIVIDE_RK,
+    OP_LESS_RR_JUMP,
+    OP_LESS_RK_JUMP,
 } Opcode;
 
+struct ObjShape;
+
+#define IC_ENTRIES 4
+
+// One receiver layout seen at a property site. Field entries hold the slot
+// of the field in that layout; when a set site adds the field, `transition`
+// is the layout the instance moves to. Method entries have a slot of -1 and
+// hold the closure found in the class.
+typedef struct {
+    struct ObjShape *shape;
+    struct ObjShape *transition;
+    int slot;
+    Value method;
+} CacheEntry;
+
+/* Inline cache for a single OP_GET_PROPERTY/OP_SET_PROPERTY/OP_INVOKE site.
+ * It starts monomorphic and grows to IC_ENTRIES shapes before the last
+ * entry starts getting recycled. */
+typedef struct {
+    ObjString *name;
+    int count;
+    CacheEntry entries[IC_ENTRIES];
+} InlineCache;
+
 typedef struct {
     size_t len;
     size_t capacity;
     uint8_t *code;
     int *lines;
     ValueArray constants;
+
+    int cacheCount;
+    int cacheCapacity;
+    InlineCache *caches;
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 int addConstant(Chunk *chunk, Value val);
+int addInlineCache(Chunk *chunk, ObjString *name);
+// size in bytes of the instruction at `offset`, operands included
+int instructionLen(Chunk *chunk, int offset);
+// Most values the code of `chunk` keeps on the stack at once, counting the
+// `base` values it starts with: the callee and its arguments.
+int stackSize(Chunk *chunk, int base);
 
 #endif
@@ -5,13 +5,30 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Threaded dispatch in run() relies on the GNU labels-as-values extension;
+// define NO_COMPUTED_GOTO to force the portable switch
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// The baseline JIT emits x86-64 code into mmap'd memory; define NO_JIT to
+// interpret everything
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__)) &&      \
+    !defined(NO_JIT)
+#define JIT
+#endif
+
 #ifndef NDEBUG
 #define DEBUG_TRACE_EXEC
 #define DEBUG_PRINT_CODE
 
 // This flags allows the GC to run as often as possible
 //#define DEBUG_STRESS_GC
+// Compiles every function on its first call
+//#define DEBUG_STRESS_JIT
 //#define DEBUG_LOG_GC
+// Counts what the collector does for the tests to check, see GcStats
+#define DEBUG_GC_STATS
 
 #endif
 
@@ -9,18 +9,15 @@
 #include "log.h"
 #include "memory.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
-typedef struct {
-    Token current;
-    Token previous;
-    bool hadErr;
-    bool panicMode;
-} Parser;
+typedef struct Parser Parser;
 
 typedef enum {
     PREC_NONE,
@@ -36,7 +33,7 @@ typedef enum {
     PREC_PRIMARY,
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser *parser, bool canAssign);
 
 typedef struct {
     ParseFn prefix;
@@ -51,7 +48,7 @@ typedef struct {
 } Local;
 
 typedef struct {
-    uint8_t index;
+    uint16_t index;
     bool isLocal;
 } Upvalue;
 
@@ -67,39 +64,88 @@ typedef struct Compiler {
     ObjFunction *function;
     FuncType type;
 
-    Local locals[UINT8_MAX + 1];
-    Upvalue upvalues[UINT8_MAX + 1];
+    Local *locals;
     int localCount;
+    int localCapacity;
+    Upvalue *upvalues;
+    int upvalueCapacity;
     int scopeDepth;
+
+    // Constant folding: the last instruction that pushed a constant spans
+    // [constStart, constEnd) and loads `constValue` from constant table slot
+    // `constIndex` (-1 for nil/true/false). operandStart is where the left
+    // operand of the infix operator being compiled begins. Code before
+    // lastJumpTarget may be the target of a jump and is never rewritten.
+    int constStart;
+    int constEnd;
+    int constIndex;
+    Value constValue;
+    int operandStart;
+    int lastJumpTarget;
+
+    // end of the last OP_CALL, which is a tail call if a return follows it
+    int callEnd;
 } Compiler;
 
 typedef struct ClassCompiler {
     struct ClassCompiler *enclosing;
 } ClassCompiler;
 
-Parser parser;
-Compiler *current = NULL;
-ClassCompiler *current_class = NULL;
-Chunk *compiling_chunk = NULL;
+// A compilation in progress, which every function below is handed: the
+// scanner, the tokens around it, and the functions and classes being
+// compiled, innermost first. The VM it compiles for keeps it in vm->parser
+// for its collector to mark through mark_compiler_roots().
+struct Parser {
+    Scanner scanner;
+    Token current;
+    Token previous;
+    bool hadErr;
+    bool panicMode;
+    Compiler *compiler;
+    ClassCompiler *classCompiler;
+};
 
-static Chunk *current_chunk() { return &current->function->chunk; }
+static Chunk *current_chunk(Parser *parser) {
+    return &parser->compiler->function->chunk;
+}
 
-static void error_at_current(const char *msg);
-static void error(const char *msg);
-static void error_at(Token *token, const char *msg);
-static void synchronize();
+static void error_at_current(Parser *parser, const char *msg);
+static void error(Parser *parser, const char *msg);
+static void error_at(Parser *parser, Token *token, const char *msg);
+static void synchronize(Parser *parser);
 
-static void advance();
-static void must_advance(TokenType type, const char *msg);
-static bool check(TokenType type) { return parser.current.type == type; }
-static bool check_advance(TokenType type);
+static void advance(Parser *parser);
+static void must_advance(Parser *parser, TokenType type, const char *msg);
+static bool check(Parser *parser, TokenType type) {
+    return parser->current.type == type;
+}
+static bool check_advance(Parser *parser, TokenType type);
 
-static inline void emit_byte(uint8_t byte) {
-    writeChunk(current_chunk(), byte, parser.previous.line);
+static inline void emit_byte(Parser *parser, uint8_t byte) {
+    writeChunk(current_chunk(parser), byte, parser->previous.line);
+}
+static inline void emit_bytes(Parser *parser, uint8_t byte1, uint8_t byte2) {
+    emit_byte(parser, byte1);
+    emit_byte(parser, byte2);
 }
-static inline void emit_bytes(uint8_t byte1, uint8_t byte2) {
-    emit_byte(byte1);
-    emit_byte(byte2);
+static inline void emit_short(Parser *parser, uint16_t val) {
+    // higher byte stored first, same as jump offsets
+    emit_byte(parser, (val >> 8) & 0xff);
+    emit_byte(parser, val & 0xff);
+}
+// emits `op` with a byte operand, or `long_op` with a `width` byte operand
+// when the index does not fit
+static void emit_indexed(Parser *parser, uint8_t op, uint8_t long_op, int width,
+                         uint32_t index) {
+    if (index <= UINT8_MAX) {
+        emit_bytes(parser, op, (uint8_t)index);
+        return;
+    }
+
+    emit_byte(parser, long_op);
+    for (int shift = 8 * (width - 1); shift >= 0; shift -= 8) {
+        emit_byte(parser, (index >> shift) & 0xff);
+    }
 }
 static bool identifiers_equal(Token *a, Token *b) {
     if (a->len != b->len)
@@ -107,162 +153,193 @@ static bool identifiers_equal(Token *a, Token *b) {
 
     return memcmp(a->start, b->start, a->len) == 0;
 }
-static int emit_jump(uint8_t inst);
-static void patch_jump(int offset);
+static int emit_jump(Parser *parser, uint8_t inst);
+static void patch_jump(Parser *parser, int offset);
 
-static int resolve_local(Compiler *compiler, Token *name);
-static int resolve_upvalue(Compiler *compiler, Token *name);
+static int resolve_local(Parser *parser, Compiler *compiler, Token *name);
+static int resolve_upvalue(Parser *parser, Compiler *compiler, Token *name);
 
 // token parsing functions
-static void expression();
-static void number(bool);
-static void grouping(bool);
-static void unary(bool);
-static void binary(bool);
-static void literal(bool);
-static void string(bool);
-static void variable(bool);
-static void logical_and(bool);
-static void logical_or(bool);
-static void call(bool);
-static void dot(bool);
-static void this_(bool);
+static void expression(Parser *parser);
+static void number(Parser *parser, bool);
+static void grouping(Parser *parser, bool);
+static void unary(Parser *parser, bool);
+static void binary(Parser *parser, bool);
+static void literal(Parser *parser, bool);
+static void string(Parser *parser, bool);
+static void variable(Parser *parser, bool);
+static void logical_and(Parser *parser, bool);
+static void logical_or(Parser *parser, bool);
+static void call(Parser *parser, bool);
+static void dot(Parser *parser, bool);
+static void this_(Parser *parser, bool);
 
 // statement parsing
-static void declaration();
-static void varDeclaration();
-static void funDeclaration();
-static void classDeclaration();
-static void statement();
-static void printStatement();
-static void expressionStatement();
-static void block();
-static void ifStatement();
-static void whileStatement();
-static void forStatement();
-static void returnStatement();
-
-static void function(FuncType type);
+static void declaration(Parser *parser);
+static void varDeclaration(Parser *parser);
+static void funDeclaration(Parser *parser);
+static void classDeclaration(Parser *parser);
+static void statement(Parser *parser);
+static void printStatement(Parser *parser);
+static void expressionStatement(Parser *parser);
+static void block(Parser *parser);
+static void ifStatement(Parser *parser);
+static void whileStatement(Parser *parser);
+static void forStatement(Parser *parser);
+static void returnStatement(Parser *parser);
+
+static void function(Parser *parser, FuncType type);
 
 static ParseRule *getRule(TokenType type);
-static void parse_precedence(Precedence prec);
+static void parse_precedence(Parser *parser, Precedence prec);
 
-static void initCompiler(Compiler *c, FuncType type);
-static ObjFunction *endCompiler();
+static void initCompiler(Parser *parser, Compiler *c, FuncType type);
+static ObjFunction *endCompiler(Parser *parser);
+static void free_compiler(Compiler *c);
+static void add_local(Parser *parser, Token name);
 
 ObjFunction *compile(const char *src) {
-    initScanner(src);
-    Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
-
+    Parser parser;
+    initScanner(&parser.scanner, src);
     parser.hadErr = false;
     parser.panicMode = false;
+    parser.compiler = NULL;
+    parser.classCompiler = NULL;
+    vm->parser = &parser;
 
-    advance();
-    while (!check_advance(TKN_EOF)) {
-        declaration();
+    Compiler compiler;
+    initCompiler(&parser, &compiler, TYPE_SCRIPT);
+
+    advance(&parser);
+    while (!check_advance(&parser, TKN_EOF)) {
+        declaration(&parser);
     }
 
-    ObjFunction *func = endCompiler();
+    ObjFunction *func = endCompiler(&parser);
+    free_compiler(&compiler);
+    vm->parser = NULL;
     return parser.hadErr ? NULL : func;
 }
 
 void mark_compiler_roots() {
-    Compiler *compiler = current;
+    if (vm->parser == NULL)
+        return;
+
+    Compiler *compiler = vm->parser->compiler;
     while (compiler != NULL) {
         mark_object((Obj *)compiler->function);
         compiler = compiler->enclosing;
     }
 }
 
-static void initCompiler(Compiler *c, FuncType type) {
-    c->enclosing = current;
+static void initCompiler(Parser *parser, Compiler *c, FuncType type) {
+    c->enclosing = parser->compiler;
     c->function = NULL;
     c->type = type;
+    c->locals = NULL;
     c->localCount = 0;
+    c->localCapacity = 0;
+    c->upvalues = NULL;
+    c->upvalueCapacity = 0;
     c->scopeDepth = 0;
+    c->constStart = -1;
+    c->constEnd = -1;
+    c->constIndex = -1;
+    c->constValue = NIL_VAL;
+    c->operandStart = 0;
+    c->lastJumpTarget = 0;
+    c->callEnd = -1;
     c->function = newFunction();
-    current = c;
+    parser->compiler = c;
 
     if (type != TYPE_SCRIPT) {
-        current->function->name =
-            copyString(parser.previous.start, parser.previous.len);
+        gcStore(&c->function->name,
+                copyString(parser->previous.start, parser->previous.len));
+        writeBarrier(&c->function->obj, OBJ_VAL(c->function->name));
     }
 
-    Local *local = &current->locals[current->localCount++];
+    add_local(parser, (Token){.start = "", .len = 0});
+    Local *local = &c->locals[0];
     local->depth = 0;
-    local->isCaptured = false;
     if (type != TYPE_FUNC) {
         local->name.start = "this";
         local->name.len = 4;
-    } else {
-        local->name.start = "";
-        local->name.len = 0;
     }
 }
+static void free_compiler(Compiler *c) {
+    FREE_ARRAY(Local, c->locals, c->localCapacity);
+    FREE_ARRAY(Upvalue, c->upvalues, c->upvalueCapacity);
+}
 
-static ObjFunction *endCompiler() {
+static ObjFunction *endCompiler(Parser *parser) {
+    Compiler *current = parser->compiler;
     if (current->type == TYPE_INIT) {
-        emit_bytes(OP_GET_LOCAL, 0);
+        emit_bytes(parser, OP_GET_LOCAL, 0);
     } else {
-        emit_byte(OP_NIL);
+        emit_byte(parser, OP_NIL);
     }
 
-    emit_byte(OP_RETURN);
+    emit_byte(parser, OP_RETURN);
     ObjFunction *func = current->function;
+    if (!parser->hadErr) {
+        optimizeChunk(current_chunk(parser), vm->registerOps);
+        func->maxSlots = stackSize(current_chunk(parser), func->arity + 1);
+    }
 
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadErr) {
-        disassembleChunk(current_chunk(),
+    if (!parser->hadErr) {
+        disassembleChunk(current_chunk(parser),
                          func->name != NULL ? func->name->chars : "<script>");
     }
 #endif
 
-    current = current->enclosing;
+    parser->compiler = current->enclosing;
     return func;
 }
 
-static void advance() {
-    parser.previous = parser.current;
+static void advance(Parser *parser) {
+    parser->previous = parser->current;
 
     while (true) {
-        parser.current = scanToken();
-        if (parser.current.type != TKN_Err)
+        parser->current = scanToken(&parser->scanner);
+        if (parser->current.type != TKN_Err)
             break;
 
-        error_at_current(parser.current.start);
+        error_at_current(parser, parser->current.start);
     }
 }
 
-static void must_advance(TokenType type, const char *msg) {
-    if (check(type)) {
-        advance();
+static void must_advance(Parser *parser, TokenType type, const char *msg) {
+    if (check(parser, type)) {
+        advance(parser);
         return;
     }
 
-    error_at_current(msg);
+    error_at_current(parser, msg);
 }
 
-static bool check_advance(TokenType type) {
-    if (!check(type))
+static bool check_advance(Parser *parser, TokenType type) {
+    if (!check(parser, type))
         return false;
 
-    advance();
+    advance(parser);
     return true;
 }
 
-static void error_at_current(const char *msg) {
-    error_at(&parser.current, msg);
+static void error_at_current(Parser *parser, const char *msg) {
+    error_at(parser, &parser->current, msg);
+}
+static void error(Parser *parser, const char *msg) {
+    error_at(parser, &parser->previous, msg);
 }
-static void error(const char *msg) { error_at(&parser.previous, msg); }
 
 #define MAX_LEN 1024
-static void error_at(Token *token, const char *msg) {
+static void error_at(Parser *parser, Token *token, const char *msg) {
     // suppress errors if we are already panicking
-    if (parser.panicMode)
+    if (parser->panicMode)
         return;
 
-    parser.panicMode = true;
+    parser->panicMode = true;
     char buf[MAX_LEN];
     if (token->type != TKN_Err) {
         snprintf(buf, MAX_LEN, "[Line %d] at '%.*s': %s\n", token->line,
@@ -270,7 +347,7 @@ static void error_at(Token *token, const char *msg) {
     }
 
     log_error(buf);
-    parser.hadErr = true;
+    parser->hadErr = true;
 }
 
 #undef MAX_LEN
@@ -318,576 +395,794 @@ ParseRule rules[] = {
     [TKN_EOF] = {NULL, NULL, PREC_NONE},
 };
 
-static inline void expression() { parse_precedence(PREC_ASSIGNMENT); }
+static inline void expression(Parser *parser) {
+    parse_precedence(parser, PREC_ASSIGNMENT);
+}
 
-static uint8_t make_constant(Value val) {
-    int constant = addConstant(current_chunk(), val);
-    if (constant > UINT8_MAX) {
-        error("Too many constants in one chunk");
+static uint32_t make_constant(Parser *parser, Value val) {
+    Compiler *current = parser->compiler;
+    int constant = addConstant(current_chunk(parser), val);
+    writeBarrier(&current->function->obj, val);
+    if (constant > UINT24_MAX) {
+        error(parser, "Too many constants in one chunk");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return (uint32_t)constant;
+}
+static void note_constant(Parser *parser, int start, int index, Value val) {
+    Compiler *current = parser->compiler;
+    current->constStart = start;
+    current->constEnd = current_chunk(parser)->len;
+    current->constIndex = index;
+    current->constValue = val;
+}
+static inline void emit_constant(Parser *parser, Value val) {
+    int start = current_chunk(parser)->len;
+    uint32_t index = make_constant(parser, val);
+    emit_indexed(parser, OP_CONSTANT, OP_CONSTANT_LONG, 3, index);
+    note_constant(parser, start, (int)index, val);
+}
+// like emit_constant, but nil and booleans get their own opcodes
+static void emit_value(Parser *parser, Value val) {
+    int start = current_chunk(parser)->len;
+    if (IS_NIL(val)) {
+        emit_byte(parser, OP_NIL);
+    } else if (IS_BOOL(val)) {
+        emit_byte(parser, AS_BOOL(val) ? OP_TRUE : OP_FALSE);
+    } else {
+        emit_constant(parser, val);
+        return;
+    }
+    note_constant(parser, start, -1, val);
+}
+
+// true if everything emitted since `start` is a single constant load
+static bool constant_since(Parser *parser, int start, Value *val) {
+    Compiler *current = parser->compiler;
+    if (current->constStart != start ||
+        current->constEnd != (int)current_chunk(parser)->len ||
+        current->lastJumpTarget > start)
+        return false;
+
+    *val = current->constValue;
+    return true;
 }
-static inline void emit_constant(Value val) {
-    emit_bytes(OP_CONSTANT, make_constant(val));
+// Replaces the code from `start` on, which loads the constants in table
+// slots `a` and `b`, with a load of `val`. The operands' constants are only
+// dropped when nothing was added after them.
+static void fold(Parser *parser, int start, int a, int b, Value val) {
+    ValueArray *constants = &current_chunk(parser)->constants;
+    if (b >= 0 && b == (int)constants->len - 1)
+        constants->len--;
+    if (a >= 0 && a == (int)constants->len - 1)
+        constants->len--;
+
+    current_chunk(parser)->len = start;
+    emit_value(parser, val);
 }
 
-static void number(bool canAssign __attribute__((unused))) {
-    double val = strtod(parser.previous.start, NULL);
-    emit_constant(NUMBER_VAL(val));
+static void number(Parser *parser, bool canAssign __attribute__((unused))) {
+    double val = strtod(parser->previous.start, NULL);
+    emit_constant(parser, NUMBER_VAL(val));
 }
 
-static void grouping(bool canAssign __attribute__((unused))) {
-    expression();
-    must_advance(TKN_RParen, "Expect ')' after expression");
+static void grouping(Parser *parser, bool canAssign __attribute__((unused))) {
+    expression(parser);
+    must_advance(parser, TKN_RParen, "Expect ')' after expression");
 }
 
-static void unary(bool canAssign __attribute__((unused))) {
-    TokenType op_type = parser.previous.type;
+static void unary(Parser *parser, bool canAssign __attribute__((unused))) {
+    Compiler *current = parser->compiler;
+    TokenType op_type = parser->previous.type;
+    int start = current_chunk(parser)->len;
 
     // Compile the operand
     parse_precedence(
+        parser,
         PREC_UNARY); // same precedence to parse nested unary exprs: (!! false)
 
+    Value val;
+    if (constant_since(parser, start, &val)) {
+        if (op_type == TKN_Bang) {
+            fold(parser, start, -1, current->constIndex,
+                 BOOL_VAL(is_falsey(val)));
+            return;
+        }
+        if (op_type == TKN_Minus && IS_NUMBER(val)) {
+            fold(parser, start, -1, current->constIndex,
+                 NUMBER_VAL(-AS_NUMBER(val)));
+            return;
+        }
+    }
+
     switch (op_type) {
     case TKN_Bang:
-        emit_byte(OP_NOT);
+        emit_byte(parser, OP_NOT);
         break;
     case TKN_Minus:
-        emit_byte(OP_NEGATE);
+        emit_byte(parser, OP_NEGATE);
         break;
     default:
         return;
     }
 }
 
-static void binary(bool canAssign __attribute__((unused))) {
-    TokenType op_type = parser.previous.type;
+// Evaluates `a op b` at compile time. Only operand types the VM accepts are
+// folded, so a type error is still reported at runtime.
+static bool fold_binary(TokenType op, Value a, Value b, Value *ret) {
+    if (op == TKN_EqEq || op == TKN_BangEq) {
+        *ret = BOOL_VAL(values_equal(a, b) == (op == TKN_EqEq));
+        return true;
+    }
+
+    if (op == TKN_Plus && IS_STRING(a) && IS_STRING(b)) {
+        // both strings sit in the constant table, rooted by the function
+        ObjString *sa = AS_STRING(a);
+        ObjString *sb = AS_STRING(b);
+        int len = sa->len + sb->len;
+        char *chars = mem_reallocate(NULL, 0, sizeof(char) * (len + 1));
+        memcpy(chars, sa->chars, sa->len);
+        memcpy(chars + sa->len, sb->chars, sb->len);
+        chars[len] = '\0';
+
+        *ret = OBJ_VAL(takeString(chars, len));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+        return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (op) {
+    case TKN_Greater:
+        *ret = BOOL_VAL(x > y);
+        break;
+    case TKN_GreaterEq: // see NOT_BOOL_VAL in vm.c
+        *ret = BOOL_VAL(!(x < y));
+        break;
+    case TKN_Less:
+        *ret = BOOL_VAL(x < y);
+        break;
+    case TKN_LessEq:
+        *ret = BOOL_VAL(!(x > y));
+        break;
+    case TKN_Plus:
+        *ret = NUMBER_VAL(x + y);
+        break;
+    case TKN_Minus:
+        *ret = NUMBER_VAL(x - y);
+        break;
+    case TKN_Star:
+        *ret = NUMBER_VAL(x * y);
+        break;
+    case TKN_Slash:
+        *ret = NUMBER_VAL(x / y);
+        break;
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+static void binary(Parser *parser, bool canAssign __attribute__((unused))) {
+    Compiler *current = parser->compiler;
+    TokenType op_type = parser->previous.type;
+    int start = current->operandStart;
+    Value a, b, ret;
+    bool left_const = constant_since(parser, start, &a);
+    int a_index = current->constIndex;
+
     ParseRule *rule = getRule(op_type);
-    parse_precedence((Precedence)(rule->precedence + 1));
+    int right = current_chunk(parser)->len;
+    parse_precedence(parser, (Precedence)(rule->precedence + 1));
+
+    if (left_const && constant_since(parser, right, &b) &&
+        current->lastJumpTarget <= start && fold_binary(op_type, a, b, &ret)) {
+        fold(parser, start, a_index, current->constIndex, ret);
+        return;
+    }
 
     switch (op_type) {
     case TKN_BangEq:
-        emit_bytes(OP_EQUAL, OP_NOT);
+        emit_byte(parser, OP_NOT_EQUAL);
         break;
     case TKN_EqEq:
-        emit_byte(OP_EQUAL);
+        emit_byte(parser, OP_EQUAL);
         break;
     case TKN_Greater:
-        emit_byte(OP_GREATER);
+        emit_byte(parser, OP_GREATER);
         break;
     case TKN_GreaterEq:
-        emit_bytes(OP_LESS, OP_NOT);
+        emit_byte(parser, OP_GREATER_EQUAL);
         break;
     case TKN_Less:
-        emit_byte(OP_LESS);
+        emit_byte(parser, OP_LESS);
         break;
     case TKN_LessEq:
-        emit_bytes(OP_GREATER, OP_NOT);
+        emit_byte(parser, OP_LESS_EQUAL);
         break;
     case TKN_Plus:
-        emit_byte(OP_ADD);
+        emit_byte(parser, OP_ADD);
         break;
     case TKN_Minus:
-        emit_byte(OP_SUBTRACT);
+        emit_byte(parser, OP_SUBTRACT);
         break;
     case TKN_Slash:
-        emit_byte(OP_DIVIDE);
+        emit_byte(parser, OP_DIVIDE);
         break;
     case TKN_Star:
-        emit_byte(OP_MULTIPLY);
+        emit_byte(parser, OP_MULTIPLY);
         break;
     default:
         return;
     }
 }
 
-static void literal(bool canAssign __attribute__((unused))) {
-    switch (parser.previous.type) {
+static void literal(Parser *parser, bool canAssign __attribute__((unused))) {
+    switch (parser->previous.type) {
     case TKN_False:
-        emit_byte(OP_FALSE);
+        emit_value(parser, BOOL_VAL(false));
         break;
     case TKN_Nil:
-        emit_byte(OP_NIL);
+        emit_value(parser, NIL_VAL);
         break;
     case TKN_True:
-        emit_byte(OP_TRUE);
+        emit_value(parser, BOOL_VAL(true));
         break;
     default:
         return;
     }
 }
 
-static void string(bool canAssign __attribute__((unused))) {
+static void string(Parser *parser, bool canAssign __attribute__((unused))) {
     // trim the quotation marks
-    emit_constant(OBJ_VAL(
-        copyString(parser.previous.start + 1, parser.previous.len - 2)));
+    emit_constant(parser, OBJ_VAL(
+        copyString(parser->previous.start + 1, parser->previous.len - 2)));
 }
 
-static void logical_and(bool canAssign __attribute__((unused))) {
-    int end_jump = emit_jump(OP_JUMP_IF_FALSE);
+static void logical_and(Parser *parser,
+                        bool canAssign __attribute__((unused))) {
+    int end_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
 
-    emit_byte(OP_POP);
-    parse_precedence(PREC_AND);
+    emit_byte(parser, OP_POP);
+    parse_precedence(parser, PREC_AND);
 
-    patch_jump(end_jump);
+    patch_jump(parser, end_jump);
 }
-static void logical_or(bool canAssign __attribute__((unused))) {
-    int else_jump = emit_jump(OP_JUMP_IF_FALSE);
-    int end_jump = emit_jump(OP_JUMP);
+static void logical_or(Parser *parser, bool canAssign __attribute__((unused))) {
+    int else_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+    int end_jump = emit_jump(parser, OP_JUMP);
 
-    patch_jump(else_jump);
-    emit_byte(OP_POP);
+    patch_jump(parser, else_jump);
+    emit_byte(parser, OP_POP);
 
-    parse_precedence(PREC_OR);
-    patch_jump(end_jump);
+    parse_precedence(parser, PREC_OR);
+    patch_jump(parser, end_jump);
 }
 
-static uint8_t arg_list() {
+static uint8_t arg_list(Parser *parser) {
     uint8_t arg_count = 0;
-    if (!check(TKN_RParen)) {
+    if (!check(parser, TKN_RParen)) {
         do {
-            expression();
+            expression(parser);
             if (arg_count == 255) {
-                error("Cannot have more than 255 arguments");
+                error(parser, "Cannot have more than 255 arguments");
             }
             arg_count++;
-        } while (check_advance(TKN_Comma));
+        } while (check_advance(parser, TKN_Comma));
     }
 
-    must_advance(TKN_RParen, "Expect ')' after arguments");
+    must_advance(parser, TKN_RParen, "Expect ')' after arguments");
     return arg_count;
 }
-static void call(bool canAssign __attribute__((unused))) {
-    uint8_t arg_count = arg_list();
-    emit_bytes(OP_CALL, arg_count);
+static void call(Parser *parser, bool canAssign __attribute__((unused))) {
+    Compiler *current = parser->compiler;
+    uint8_t arg_count = arg_list(parser);
+    emit_bytes(parser, OP_CALL, arg_count);
+    current->callEnd = current_chunk(parser)->len;
 }
 
-static uint8_t identifier_constant(Token *name) {
-    return make_constant(OBJ_VAL(copyString(name->start, name->len)));
+static uint32_t identifier_constant(Parser *parser, Token *name) {
+    return make_constant(parser, OBJ_VAL(copyString(name->start, name->len)));
 }
-static void add_local(Token name) {
-    if (current->localCount == UINT8_MAX + 1) {
-        error("Too many local variables in function");
+static uint32_t global_slot(Parser *parser, Token *name) {
+    int slot = globalSlot(copyString(name->start, name->len));
+    if (slot > UINT24_MAX) {
+        error(parser, "Too many global variables");
+        return 0;
+    }
+
+    return (uint32_t)slot;
+}
+static uint16_t make_cache(Parser *parser, Token *name) {
+    Compiler *current = parser->compiler;
+    ObjString *str = copyString(name->start, name->len);
+    int cache = addInlineCache(current_chunk(parser), str);
+    writeBarrier(&current->function->obj, OBJ_VAL(str));
+    if (cache > UINT16_MAX) {
+        error(parser, "Too many property accesses in one chunk");
+        return 0;
+    }
+
+    return (uint16_t)cache;
+}
+static void add_local(Parser *parser, Token name) {
+    Compiler *current = parser->compiler;
+    if (current->localCount == UINT16_MAX + 1) {
+        error(parser, "Too many local variables in function");
         return;
     }
 
+    if (current->localCount == current->localCapacity) {
+        int old_cap = current->localCapacity;
+        current->localCapacity = GROW_CAPACITY(old_cap);
+        current->locals = GROW_ARRAY(Local, current->locals, old_cap,
+                                     current->localCapacity);
+    }
+
     Local *local = &current->locals[current->localCount++];
     local->name = name;
     local->depth = -1; // sentinel for uninitialized state
     local->isCaptured = false;
 }
-static void declare_variable() {
+static void declare_variable(Parser *parser) {
+    Compiler *current = parser->compiler;
     if (current->scopeDepth == 0)
         return;
 
-    Token *name = &parser.previous;
-    for (int i = current->localCount; i >= 0; i--) {
+    Token *name = &parser->previous;
+    for (int i = current->localCount - 1; i >= 0; i--) {
         Local *local = &current->locals[i];
         if (local->depth != -1 && local->depth < current->scopeDepth)
             break;
 
         if (identifiers_equal(name, &local->name)) {
-            error("Variable already defined with this name in this scope");
+            error(parser,
+                  "Variable already defined with this name in this scope");
         }
     }
 
-    add_local(*name);
+    add_local(parser, *name);
 }
-static void named_variable(Token name, bool canAssign) {
+static void named_variable(Parser *parser, Token name, bool canAssign) {
+    Compiler *current = parser->compiler;
     uint8_t getOp, setOp;
-    int arg = resolve_local(current, &name);
+    int width = 2;
+    int arg = resolve_local(parser, current, &name);
     if (arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
-    } else if ((arg = resolve_upvalue(current, &name)) != -1) {
+    } else if ((arg = resolve_upvalue(parser, current, &name)) != -1) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifier_constant(&name);
+        arg = (int)global_slot(parser, &name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
+        width = 3;
     }
 
-    if (canAssign && check_advance(TKN_Eq)) {
-        expression();
-        emit_bytes(setOp, arg);
+    // every _LONG opcode directly follows its short form
+    if (canAssign && check_advance(parser, TKN_Eq)) {
+        expression(parser);
+        emit_indexed(parser, setOp, setOp + 1, width, (uint32_t)arg);
     } else {
-        emit_bytes(getOp, arg);
+        emit_indexed(parser, getOp, getOp + 1, width, (uint32_t)arg);
     }
 }
-static void variable(bool canAssign) {
-    named_variable(parser.previous, canAssign);
+static void variable(Parser *parser, bool canAssign) {
+    named_variable(parser, parser->previous, canAssign);
 }
 
-static void this_(bool canAssign __attribute__((unused))) {
-    if (current_class == NULL) {
-        error("Cannot use 'this' outside of a class");
+static void this_(Parser *parser, bool canAssign __attribute__((unused))) {
+    if (parser->classCompiler == NULL) {
+        error(parser, "Cannot use 'this' outside of a class");
         return;
     }
-    variable(false);
+    variable(parser, false);
 }
 
 // parses get and set expressions on instances
-static void dot(bool canAssign) {
-    must_advance(TKN_Ident, "Expect property name after '.'");
-    uint8_t name = identifier_constant(&parser.previous);
-
-    if (canAssign && check_advance(TKN_Eq)) {
-        expression();
-        emit_bytes(OP_SET_PROPERTY, name);
-    } else if (check_advance(TKN_LParen)) {
-        uint8_t arg_count = arg_list();
-        emit_bytes(OP_INVOKE, name);
-        emit_byte(arg_count);
+static void dot(Parser *parser, bool canAssign) {
+    must_advance(parser, TKN_Ident, "Expect property name after '.'");
+    uint16_t cache = make_cache(parser, &parser->previous);
+
+    if (canAssign && check_advance(parser, TKN_Eq)) {
+        expression(parser);
+        emit_byte(parser, OP_SET_PROPERTY);
+        emit_short(parser, cache);
+    } else if (check_advance(parser, TKN_LParen)) {
+        uint8_t arg_count = arg_list(parser);
+        emit_byte(parser, OP_INVOKE);
+        emit_short(parser, cache);
+        emit_byte(parser, arg_count);
     } else {
-        emit_bytes(OP_GET_PROPERTY, name);
+        emit_byte(parser, OP_GET_PROPERTY);
+        emit_short(parser, cache);
     }
 }
 
 static ParseRule *getRule(TokenType type) { return &rules[type]; }
-static void parse_precedence(Precedence prec) {
-    advance();
-    ParseFn prefix_rule = getRule(parser.previous.type)->prefix;
+static void parse_precedence(Parser *parser, Precedence prec) {
+    Compiler *current = parser->compiler;
+    advance(parser);
+    ParseFn prefix_rule = getRule(parser->previous.type)->prefix;
     if (!prefix_rule) {
-        error("Expect expression");
+        error(parser, "Expect expression");
         return;
     }
 
+    int start = current_chunk(parser)->len;
     bool canAssign = prec <= PREC_ASSIGNMENT;
-    prefix_rule(canAssign);
+    prefix_rule(parser, canAssign);
 
-    while (prec <= getRule(parser.current.type)->precedence) {
-        advance();
-        ParseFn infix_rule = getRule(parser.previous.type)->infix;
-        infix_rule(canAssign);
+    while (prec <= getRule(parser->current.type)->precedence) {
+        advance(parser);
+        ParseFn infix_rule = getRule(parser->previous.type)->infix;
+        current->operandStart = start;
+        infix_rule(parser, canAssign);
     }
 
-    if (canAssign && check_advance(TKN_Eq)) {
-        error("Invalid assignment target");
+    if (canAssign && check_advance(parser, TKN_Eq)) {
+        error(parser, "Invalid assignment target");
     }
 }
 
-static uint8_t parse_variable(const char *msg) {
-    must_advance(TKN_Ident, msg);
+static uint32_t parse_variable(Parser *parser, const char *msg) {
+    Compiler *current = parser->compiler;
+    must_advance(parser, TKN_Ident, msg);
 
-    declare_variable();
+    declare_variable(parser);
     if (current->scopeDepth > 0)
         return 0;
 
-    return identifier_constant(&parser.previous);
+    return global_slot(parser, &parser->previous);
 }
 
-static void mark_init() {
+static void mark_init(Parser *parser) {
+    Compiler *current = parser->compiler;
     if (current->scopeDepth == 0)
         return;
 
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
-static void define_variable(uint8_t global) {
+static void define_variable(Parser *parser, uint32_t global) {
+    Compiler *current = parser->compiler;
     if (current->scopeDepth > 0) {
-        mark_init();
+        mark_init(parser);
         return;
     }
 
-    emit_bytes(OP_DEFINE_GLOBAL, global);
+    emit_indexed(parser, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, 3, global);
 }
 
-static void declaration() {
-    if (check_advance(TKN_Var)) {
-        varDeclaration();
-    } else if (check_advance(TKN_Class)) {
-        classDeclaration();
-    } else if (check_advance(TKN_Fun)) {
-        funDeclaration();
+static void declaration(Parser *parser) {
+    if (check_advance(parser, TKN_Var)) {
+        varDeclaration(parser);
+    } else if (check_advance(parser, TKN_Class)) {
+        classDeclaration(parser);
+    } else if (check_advance(parser, TKN_Fun)) {
+        funDeclaration(parser);
     } else {
-        statement();
+        statement(parser);
     }
 
-    if (parser.panicMode)
-        synchronize();
+    if (parser->panicMode)
+        synchronize(parser);
 }
 
-static void varDeclaration() {
-    uint8_t global = parse_variable("Expect variable name");
+static void varDeclaration(Parser *parser) {
+    uint32_t global = parse_variable(parser, "Expect variable name");
 
-    if (check_advance(TKN_Eq)) {
-        expression();
+    if (check_advance(parser, TKN_Eq)) {
+        expression(parser);
     } else {
-        emit_byte(OP_NIL);
+        emit_byte(parser, OP_NIL);
     }
 
-    must_advance(TKN_Semicolon, "Expect ';' after variable declaration");
-    define_variable(global);
+    must_advance(parser, TKN_Semicolon,
+                 "Expect ';' after variable declaration");
+    define_variable(parser, global);
 }
 
-static void funDeclaration() {
-    uint8_t global = parse_variable("Expect function name");
-    mark_init();
-    function(TYPE_FUNC);
-    define_variable(global);
+static void funDeclaration(Parser *parser) {
+    uint32_t global = parse_variable(parser, "Expect function name");
+    mark_init(parser);
+    function(parser, TYPE_FUNC);
+    define_variable(parser, global);
 }
 
-static void method() {
-    must_advance(TKN_Ident, "Expect method name");
-    uint8_t constant = identifier_constant(&parser.previous);
+static void method(Parser *parser) {
+    must_advance(parser, TKN_Ident, "Expect method name");
+    uint32_t constant = identifier_constant(parser, &parser->previous);
 
     FuncType type = TYPE_METHOD;
-    if (parser.previous.len == 4 &&
-        (memcmp(parser.previous.start, "init", 4) == 0)) {
+    if (parser->previous.len == 4 &&
+        (memcmp(parser->previous.start, "init", 4) == 0)) {
         type = TYPE_INIT;
     }
 
-    function(type);
-    emit_bytes(OP_METHOD, constant);
+    function(parser, type);
+    emit_indexed(parser, OP_METHOD, OP_METHOD_LONG, 3, constant);
 }
 
-static void classDeclaration() {
-    must_advance(TKN_Ident, "Expect class name");
-    Token class_name = parser.previous;
-    uint8_t nameConstant = identifier_constant(&parser.previous);
-    declare_variable();
+static void classDeclaration(Parser *parser) {
+    Compiler *current = parser->compiler;
+    must_advance(parser, TKN_Ident, "Expect class name");
+    Token class_name = parser->previous;
+    uint32_t nameConstant = identifier_constant(parser, &parser->previous);
+    declare_variable(parser);
+    uint32_t global =
+        current->scopeDepth > 0 ? 0 : global_slot(parser, &class_name);
 
-    emit_bytes(OP_CLASS, nameConstant);
-    define_variable(nameConstant);
+    emit_indexed(parser, OP_CLASS, OP_CLASS_LONG, 3, nameConstant);
+    define_variable(parser, global);
 
     ClassCompiler class_compiler;
-    class_compiler.enclosing = current_class;
-    current_class = &class_compiler;
+    class_compiler.enclosing = parser->classCompiler;
+    parser->classCompiler = &class_compiler;
 
-    named_variable(class_name, false);
+    named_variable(parser, class_name, false);
 
-    must_advance(TKN_LBrace, "Expect '{' before class body");
-    while (!check(TKN_RBrace) && !check(TKN_EOF)) {
-        method();
+    must_advance(parser, TKN_LBrace, "Expect '{' before class body");
+    while (!check(parser, TKN_RBrace) && !check(parser, TKN_EOF)) {
+        method(parser);
     }
 
-    must_advance(TKN_RBrace, "Expect '}' after class body");
-    emit_byte(OP_POP);
+    must_advance(parser, TKN_RBrace, "Expect '}' after class body");
+    emit_byte(parser, OP_POP);
 
-    current_class = current_class->enclosing;
+    parser->classCompiler = parser->classCompiler->enclosing;
 }
 
-static void begin_scope() { current->scopeDepth++; }
-static void end_scope() {
+static void begin_scope(Parser *parser) { parser->compiler->scopeDepth++; }
+static void end_scope(Parser *parser) {
+    Compiler *current = parser->compiler;
     current->scopeDepth--;
 
     while (current->localCount > 0 &&
            current->locals[current->localCount - 1].depth >
                current->scopeDepth) {
         if (current->locals[current->localCount - 1].isCaptured) {
-            emit_byte(OP_CLOSE_UPVALUE);
+            emit_byte(parser, OP_CLOSE_UPVALUE);
         } else {
-            emit_byte(OP_POP);
+            emit_byte(parser, OP_POP);
         }
         current->localCount--;
     }
 }
 
-static void function(FuncType type) {
+static void function(Parser *parser, FuncType type) {
     Compiler compiler;
-    initCompiler(&compiler, type);
-    begin_scope();
+    initCompiler(parser, &compiler, type);
+    begin_scope(parser);
 
-    must_advance(TKN_LParen, "Expect '(' after function name");
-    if (!check(TKN_RParen)) {
+    must_advance(parser, TKN_LParen, "Expect '(' after function name");
+    if (!check(parser, TKN_RParen)) {
         do {
-            current->function->arity++;
-            if (current->function->arity > 255) {
-                error("Cannot have more than 255 parameters");
+            compiler.function->arity++;
+            if (compiler.function->arity > 255) {
+                error(parser, "Cannot have more than 255 parameters");
             }
 
-            uint8_t constant = parse_variable("Expect parameter name");
-            define_variable(constant);
-        } while (check_advance(TKN_Comma));
+            uint32_t constant = parse_variable(parser, "Expect parameter name");
+            define_variable(parser, constant);
+        } while (check_advance(parser, TKN_Comma));
     }
-    must_advance(TKN_RParen, "Expect ')' after parameters");
-    must_advance(TKN_LBrace, "Expect '{' before function body");
-    block();
+    must_advance(parser, TKN_RParen, "Expect ')' after parameters");
+    must_advance(parser, TKN_LBrace, "Expect '{' before function body");
+    block(parser);
+
+    ObjFunction *func = endCompiler(parser);
+    uint32_t constant = make_constant(parser, OBJ_VAL(func));
 
-    ObjFunction *func = endCompiler();
-    emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(func)));
+    // the indices only take two bytes each when one of them needs it
+    bool wide = constant > UINT8_MAX;
+    for (int i = 0; i < func->upvalueCount; i++) {
+        wide = wide || compiler.upvalues[i].index > UINT8_MAX;
+    }
+    if (wide) {
+        emit_byte(parser, OP_CLOSURE_LONG);
+        emit_byte(parser, (constant >> 16) & 0xff);
+        emit_short(parser, constant & 0xffff);
+    } else {
+        emit_bytes(parser, OP_CLOSURE, (uint8_t)constant);
+    }
 
     for (int i = 0; i < func->upvalueCount; i++) {
-        emit_byte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emit_byte(compiler.upvalues[i].index);
-    }
-}
-
-static void statement() {
-    if (check_advance(TKN_Print)) {
-        printStatement();
-    } else if (check_advance(TKN_Return)) {
-        returnStatement();
-    } else if (check_advance(TKN_While)) {
-        whileStatement();
-    } else if (check_advance(TKN_For)) {
-        forStatement();
-    } else if (check_advance(TKN_If)) {
-        ifStatement();
-    } else if (check_advance(TKN_LBrace)) {
-        begin_scope();
-        block();
-        end_scope();
+        emit_byte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
+        if (wide) {
+            emit_short(parser, compiler.upvalues[i].index);
+        } else {
+            emit_byte(parser, (uint8_t)compiler.upvalues[i].index);
+        }
+    }
+    free_compiler(&compiler);
+}
+
+static void statement(Parser *parser) {
+    if (check_advance(parser, TKN_Print)) {
+        printStatement(parser);
+    } else if (check_advance(parser, TKN_Return)) {
+        returnStatement(parser);
+    } else if (check_advance(parser, TKN_While)) {
+        whileStatement(parser);
+    } else if (check_advance(parser, TKN_For)) {
+        forStatement(parser);
+    } else if (check_advance(parser, TKN_If)) {
+        ifStatement(parser);
+    } else if (check_advance(parser, TKN_LBrace)) {
+        begin_scope(parser);
+        block(parser);
+        end_scope(parser);
     } else {
-        expressionStatement();
+        expressionStatement(parser);
     }
 }
 
-static void printStatement() {
-    expression();
-    must_advance(TKN_Semicolon, "Expect ';' after value");
-    emit_byte(OP_PRINT);
+static void printStatement(Parser *parser) {
+    expression(parser);
+    must_advance(parser, TKN_Semicolon, "Expect ';' after value");
+    emit_byte(parser, OP_PRINT);
 }
 
-static void expressionStatement() {
-    expression();
-    must_advance(TKN_Semicolon, "Expect ';' after value");
-    emit_byte(OP_POP);
+static void expressionStatement(Parser *parser) {
+    expression(parser);
+    must_advance(parser, TKN_Semicolon, "Expect ';' after value");
+    emit_byte(parser, OP_POP);
 }
 
-static void block() {
-    while (!check(TKN_RBrace) && !check(TKN_EOF)) {
-        declaration();
+static void block(Parser *parser) {
+    while (!check(parser, TKN_RBrace) && !check(parser, TKN_EOF)) {
+        declaration(parser);
     }
 
-    must_advance(TKN_RBrace, "Expect '}' after block");
+    must_advance(parser, TKN_RBrace, "Expect '}' after block");
 }
 
-static int emit_jump(uint8_t inst) {
-    emit_byte(inst);
+static int emit_jump(Parser *parser, uint8_t inst) {
+    emit_byte(parser, inst);
     // two byte jump offset
-    emit_byte(0xff);
-    emit_byte(0xff);
+    emit_byte(parser, 0xff);
+    emit_byte(parser, 0xff);
 
-    return current_chunk()->len - 2;
+    return current_chunk(parser)->len - 2;
 }
-static void patch_jump(int offset) {
+static void patch_jump(Parser *parser, int offset) {
+    Compiler *current = parser->compiler;
     // -2 to compensate for the two byte offset itself
-    int jump = current_chunk()->len - offset - 2;
+    int jump = current_chunk(parser)->len - offset - 2;
 
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over");
+        error(parser, "Too much code to jump over");
     }
 
     // higher byte stored first
-    current_chunk()->code[offset] = (jump >> 8) & 0xff;
-    current_chunk()->code[offset + 1] = jump & 0xff;
+    current_chunk(parser)->code[offset] = (jump >> 8) & 0xff;
+    current_chunk(parser)->code[offset + 1] = jump & 0xff;
+    current->lastJumpTarget = current_chunk(parser)->len;
 }
-static void ifStatement() {
-    must_advance(TKN_LParen, "Expect '(' after 'if'");
-    expression();
-    must_advance(TKN_RParen, "EXpect ')' after condition");
+static void ifStatement(Parser *parser) {
+    must_advance(parser, TKN_LParen, "Expect '(' after 'if'");
+    expression(parser);
+    must_advance(parser, TKN_RParen, "EXpect ')' after condition");
 
-    int then_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
-    statement();
+    int then_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+    emit_byte(parser, OP_POP);
+    statement(parser);
 
-    int else_jump = emit_jump(OP_JUMP);
+    int else_jump = emit_jump(parser, OP_JUMP);
 
-    patch_jump(then_jump);
-    emit_byte(OP_POP);
+    patch_jump(parser, then_jump);
+    emit_byte(parser, OP_POP);
 
-    if (check_advance(TKN_Else))
-        statement();
+    if (check_advance(parser, TKN_Else))
+        statement(parser);
 
-    patch_jump(else_jump);
+    patch_jump(parser, else_jump);
 }
 
-static void emit_loop(int loopStart) {
-    emit_byte(OP_LOOP);
+static void emit_loop(Parser *parser, int loopStart) {
+    emit_byte(parser, OP_LOOP);
 
     // calculating jump
-    int jump = current_chunk()->len - loopStart + 2;
+    int jump = current_chunk(parser)->len - loopStart + 2;
     if (jump > UINT16_MAX)
-        error("Loop body too large");
+        error(parser, "Loop body too large");
 
-    emit_bytes((jump >> 8) & 0xff, jump & 0xff);
+    emit_bytes(parser, (jump >> 8) & 0xff, jump & 0xff);
 }
-static void whileStatement() {
-    int loopStart = current_chunk()->len;
-    must_advance(TKN_LParen, "Expect '(' after 'while'");
-    expression();
-    must_advance(TKN_RParen, "Expect ')' after condition");
+static void whileStatement(Parser *parser) {
+    int loopStart = current_chunk(parser)->len;
+    must_advance(parser, TKN_LParen, "Expect '(' after 'while'");
+    expression(parser);
+    must_advance(parser, TKN_RParen, "Expect ')' after condition");
 
-    int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
+    int exit_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
 
-    emit_byte(OP_POP);
-    statement();
+    emit_byte(parser, OP_POP);
+    statement(parser);
 
-    emit_loop(loopStart);
+    emit_loop(parser, loopStart);
 
-    patch_jump(exit_jump);
-    emit_byte(OP_POP);
+    patch_jump(parser, exit_jump);
+    emit_byte(parser, OP_POP);
 }
 
-static void forStatement() {
-    begin_scope();
+static void forStatement(Parser *parser) {
+    begin_scope(parser);
 
-    must_advance(TKN_LParen, "Expect '(' after 'for'");
-    if (check_advance(TKN_Semicolon)) {
+    must_advance(parser, TKN_LParen, "Expect '(' after 'for'");
+    if (check_advance(parser, TKN_Semicolon)) {
         // No initializer
-    } else if (check_advance(TKN_Var)) {
-        varDeclaration();
+    } else if (check_advance(parser, TKN_Var)) {
+        varDeclaration(parser);
     } else {
-        expressionStatement();
+        expressionStatement(parser);
     }
 
-    int loopStart = current_chunk()->len;
+    int loopStart = current_chunk(parser)->len;
 
     int exit_jump = -1;
-    if (!check_advance(TKN_Semicolon)) {
+    if (!check_advance(parser, TKN_Semicolon)) {
         // optional condition
-        expression();
-        must_advance(TKN_Semicolon, "Expect ';' after loop condition");
+        expression(parser);
+        must_advance(parser, TKN_Semicolon, "Expect ';' after loop condition");
 
         // jump out of the loop if false
-        exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-        emit_byte(OP_POP);
+        exit_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+        emit_byte(parser, OP_POP);
     }
 
-    if (!check_advance(TKN_RParen)) {
+    if (!check_advance(parser, TKN_RParen)) {
         // optional increment
-        int body_jump = emit_jump(OP_JUMP);
+        int body_jump = emit_jump(parser, OP_JUMP);
 
-        int inc_expr_start = current_chunk()->len;
-        expression();
-        emit_byte(OP_POP);
-        must_advance(TKN_RParen, "Expect ')' after for clauses");
+        int inc_expr_start = current_chunk(parser)->len;
+        expression(parser);
+        emit_byte(parser, OP_POP);
+        must_advance(parser, TKN_RParen, "Expect ')' after for clauses");
 
-        emit_loop(loopStart);
+        emit_loop(parser, loopStart);
         loopStart = inc_expr_start;
-        patch_jump(body_jump);
+        patch_jump(parser, body_jump);
     }
 
-    statement();
+    statement(parser);
 
-    emit_loop(loopStart);
+    emit_loop(parser, loopStart);
 
     if (exit_jump != -1) {
-        patch_jump(exit_jump);
-        emit_byte(OP_POP);
+        patch_jump(parser, exit_jump);
+        emit_byte(parser, OP_POP);
     }
 
-    end_scope();
+    end_scope(parser);
 }
 
-static void returnStatement() {
+static void returnStatement(Parser *parser) {
+    Compiler *current = parser->compiler;
     if (current->type == TYPE_SCRIPT) {
-        error("Cannot return from top-level code");
+        error(parser, "Cannot return from top-level code");
     }
-    if (check_advance(TKN_Semicolon)) {
-        emit_byte(OP_NIL);
-        emit_byte(OP_RETURN);
+    if (check_advance(parser, TKN_Semicolon)) {
+        emit_byte(parser, OP_NIL);
+        emit_byte(parser, OP_RETURN);
     } else {
         if (current->type == TYPE_INIT) {
-            error("Cannot return a value from an initializer");
+            error(parser, "Cannot return a value from an initializer");
         }
 
-        expression();
-        must_advance(TKN_Semicolon, "Expect ';' after return value");
-        emit_byte(OP_RETURN);
+        expression(parser);
+        must_advance(parser, TKN_Semicolon, "Expect ';' after return value");
+        if (current->callEnd == (int)current_chunk(parser)->len) {
+            // `return f(...)`: the callee can take over this frame
+            current_chunk(parser)->code[current->callEnd - 2] = OP_TAIL_CALL;
+        }
+        emit_byte(parser, OP_RETURN);
     }
 }
 
@@ -895,14 +1190,14 @@ static void returnStatement() {
  * until we reach the boundary of the next statement.
  * We find the boundary if the previous token was a semicolon
  * or if the current token is one used to start a statement.*/
-static void synchronize() {
-    parser.panicMode = false;
+static void synchronize(Parser *parser) {
+    parser->panicMode = false;
 
-    while (!check(TKN_EOF)) {
-        if (parser.previous.type == TKN_Semicolon)
+    while (!check(parser, TKN_EOF)) {
+        if (parser->previous.type == TKN_Semicolon)
             return;
 
-        switch (parser.current.type) {
+        switch (parser->current.type) {
         case TKN_Class:
         case TKN_Fun:
         case TKN_Var:
@@ -915,16 +1210,16 @@ static void synchronize() {
         default:;
         }
 
-        advance();
+        advance(parser);
     }
 }
 
-static int resolve_local(Compiler *compiler, Token *name) {
+static int resolve_local(Parser *parser, Compiler *compiler, Token *name) {
     for (int i = compiler->localCount - 1; i >= 0; i--) {
         Local *local = &compiler->locals[i];
         if (identifiers_equal(name, &local->name)) {
             if (local->depth == -1) {
-                error("Cannot read variable in its own initializer");
+                error(parser, "Cannot read variable in its own initializer");
             }
             return i;
         }
@@ -933,7 +1228,8 @@ static int resolve_local(Compiler *compiler, Token *name) {
     return -1;
 }
 
-static int add_upvalue(Compiler *compiler, uint8_t index, bool isLocal) {
+static int add_upvalue(Parser *parser, Compiler *compiler, uint16_t index,
+                       bool isLocal) {
     int upvalue_count = compiler->function->upvalueCount;
 
     for (int i = 0; i < upvalue_count; i++) {
@@ -944,32 +1240,39 @@ static int add_upvalue(Compiler *compiler, uint8_t index, bool isLocal) {
         }
     }
 
-    if (upvalue_count == UINT8_MAX + 1) {
-        error("Too many closure variables in function");
+    if (upvalue_count == UINT16_MAX + 1) {
+        error(parser, "Too many closure variables in function");
         return 0;
     }
 
+    if (upvalue_count == compiler->upvalueCapacity) {
+        int old_cap = compiler->upvalueCapacity;
+        compiler->upvalueCapacity = GROW_CAPACITY(old_cap);
+        compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues, old_cap,
+                                        compiler->upvalueCapacity);
+    }
+
     compiler->upvalues[upvalue_count].index = index;
     compiler->upvalues[upvalue_count].isLocal = isLocal;
 
     return compiler->function->upvalueCount++;
 }
 
-static int resolve_upvalue(Compiler *compiler, Token *name) {
+static int resolve_upvalue(Parser *parser, Compiler *compiler, Token *name) {
     if (compiler->enclosing == NULL) {
         // outermost function; not found
         return -1;
     }
 
-    int local = resolve_local(compiler->enclosing, name);
+    int local = resolve_local(parser, compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
-        return add_upvalue(compiler, (uint8_t)local, true);
+        return add_upvalue(parser, compiler, (uint16_t)local, true);
     }
 
-    int upvalue = resolve_upvalue(compiler->enclosing, name);
+    int upvalue = resolve_upvalue(parser, compiler->enclosing, name);
     if (upvalue != -1) {
-        return add_upvalue(compiler, upvalue, false);
+        return add_upvalue(parser, compiler, (uint16_t)upvalue, false);
     }
 
     return -1;
@@ -978,7 +1281,7 @@ static int resolve_upvalue(Compiler *compiler, Token *name) {
 /* maybe put it in a function to print the tokens?
     int line = -1;
     while (true) {
-        Token token = scanToken();
+        Token token = scanToken(&parser->scanner);
         if (token.line != line) {
             printf("%4d ", token.line);
             line = token.line;
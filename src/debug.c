@@ -4,6 +4,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk *chunk, const char *name) {
     printf("== %s ==\n", name);
@@ -13,13 +14,23 @@ void disassembleChunk(Chunk *chunk, const char *name) {
     }
 }
 
-static int constInst(const char *name, Chunk *chunk, int offset) {
-    uint8_t i = chunk->code[offset + 1];
-    printf("%-16s %4d '", name, i);
+// big-endian operand of `width` bytes following the opcode
+static uint32_t read_operand(Chunk *chunk, int offset, int width) {
+    uint32_t operand = 0;
+    for (int i = 1; i <= width; i++) {
+        operand = (operand << 8) | chunk->code[offset + i];
+    }
+
+    return operand;
+}
+
+static int constInst(const char *name, int width, Chunk *chunk, int offset) {
+    uint32_t i = read_operand(chunk, offset, width);
+    printf("%-16s %4u '", name, i);
     printValue(chunk->constants.values[i]);
     printf("'\n");
 
-    return offset + 2;
+    return offset + 1 + width;
 }
 static int simpleInst(const char *name, int offset) {
     puts(name);
@@ -30,6 +41,11 @@ static int byteInst(const char *name, Chunk *chunk, int offset) {
     printf("%-16s %d\n", name, slot);
     return offset + 2;
 }
+static int shortInst(const char *name, Chunk *chunk, int offset) {
+    uint32_t slot = read_operand(chunk, offset, 2);
+    printf("%-16s %u\n", name, slot);
+    return offset + 3;
+}
 static int jumpInst(const char *name, int sign, Chunk *chunk, int offset) {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2];
@@ -37,15 +53,99 @@ static int jumpInst(const char *name, int sign, Chunk *chunk, int offset) {
     printf("%-16s %4d -> %4d\n", name, offset, offset + 3 + sign * jump);
     return offset + 3;
 }
-static int invokeInst(const char *name, Chunk *chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 1];
-    uint8_t arg_count = chunk->code[offset + 2];
+static int globalInst(const char *name, int width, Chunk *chunk, int offset) {
+    uint32_t slot = read_operand(chunk, offset, width);
+    printf("%-16s %4u '%s'\n", name, slot, vm->globals.names[slot]->chars);
+    return offset + 1 + width;
+}
+static int closureInst(const char *name, int width, Chunk *chunk,
+                       int offset) {
+    uint32_t constant = read_operand(chunk, offset, width);
+    offset += 1 + width;
+    printf("%-16s %4u ", name, constant);
+    printValue(chunk->constants.values[constant]);
+    fputs("\n", stdout);
+
+    // the long form has 16-bit upvalue indices too
+    int index_width = width == 1 ? 1 : 2;
+    ObjFunction *func = AS_FUNC(chunk->constants.values[constant]);
+    for (int i = 0; i < func->upvalueCount; i++) {
+        int isLocal = chunk->code[offset];
+        uint32_t index = read_operand(chunk, offset, index_width);
+        printf("%04d      |                     %s %u\n", offset,
+               isLocal ? "local" : "upvalue", index);
+        offset += 1 + index_width;
+    }
+
+    return offset;
+}
+static int cacheInst(const char *name, Chunk *chunk, int offset) {
+    uint16_t cache = (uint16_t)(chunk->code[offset + 1] << 8);
+    cache |= chunk->code[offset + 2];
 
-    printf("%-16s (%d args) %4d '", name, arg_count, constant);
+    printf("%-16s %4d '%s'\n", name, cache, chunk->caches[cache].name->chars);
+    return offset + 3;
+}
+static int localPairInst(const char *name, Chunk *chunk, int offset) {
+    printf("%-16s %d %d\n", name, chunk->code[offset + 1],
+           chunk->code[offset + 2]);
+    return offset + 3;
+}
+static int localConstInst(const char *name, Chunk *chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %d %4d '", name, slot, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
+
     return offset + 3;
 }
+static int localCacheInst(const char *name, Chunk *chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint32_t cache = read_operand(chunk, offset + 1, 2);
+    printf("%-16s %d %4u '%s'\n", name, slot, cache,
+           chunk->caches[cache].name->chars);
+    return offset + 4;
+}
+static int registerInst(const char *name, bool constant, Chunk *chunk,
+                        int offset) {
+    uint8_t *operands = &chunk->code[offset + 1];
+    printf("%-16s %d <- %d ", name, operands[0], operands[1]);
+    if (constant) {
+        printf("'");
+        printValue(chunk->constants.values[operands[2]]);
+        printf("'\n");
+    } else {
+        printf("%d\n", operands[2]);
+    }
+
+    return offset + 4;
+}
+static int registerJumpInst(const char *name, bool constant, Chunk *chunk,
+                            int offset) {
+    uint8_t *operands = &chunk->code[offset + 1];
+    uint16_t jump = (uint16_t)(operands[2] << 8) | operands[3];
+    printf("%-16s %d ", name, operands[0]);
+    if (constant) {
+        printf("'");
+        printValue(chunk->constants.values[operands[1]]);
+        printf("'");
+    } else {
+        printf("%d", operands[1]);
+    }
+    printf(" %4d -> %4d\n", offset, offset + 5 + jump);
+
+    return offset + 5;
+}
+static int invokeInst(const char *name, Chunk *chunk, int offset) {
+    uint16_t cache = (uint16_t)(chunk->code[offset + 1] << 8);
+    cache |= chunk->code[offset + 2];
+    uint8_t arg_count = chunk->code[offset + 3];
+
+    printf("%-16s (%d args) %4d '%s'\n", name, arg_count, cache,
+           chunk->caches[cache].name->chars);
+    return offset + 4;
+}
 
 int disassembleInstruction(Chunk *chunk, int offset) {
     printf("%04d ", offset);
@@ -58,7 +158,9 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     uint8_t inst = chunk->code[offset];
     switch (inst) {
     case OP_CONSTANT:
-        return constInst("OP_CONSTANT", chunk, offset);
+        return constInst("OP_CONSTANT", 1, chunk, offset);
+    case OP_CONSTANT_LONG:
+        return constInst("OP_CONSTANT_LONG", 3, chunk, offset);
     case OP_NIL:
         return simpleInst("OP_NIL", offset);
     case OP_TRUE:
@@ -68,29 +170,49 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     case OP_POP:
         return simpleInst("OP_POP", offset);
     case OP_GET_LOCAL:
-        return byteInst("OP_GET_GLOBAL", chunk, offset);
+        return byteInst("OP_GET_LOCAL", chunk, offset);
+    case OP_GET_LOCAL_LONG:
+        return shortInst("OP_GET_LOCAL_LONG", chunk, offset);
     case OP_SET_LOCAL:
-        return byteInst("OP_SET_GLOBAL", chunk, offset);
+        return byteInst("OP_SET_LOCAL", chunk, offset);
+    case OP_SET_LOCAL_LONG:
+        return shortInst("OP_SET_LOCAL_LONG", chunk, offset);
     case OP_GET_GLOBAL:
-        return constInst("OP_GET_GLOBAL", chunk, offset);
+        return globalInst("OP_GET_GLOBAL", 1, chunk, offset);
+    case OP_GET_GLOBAL_LONG:
+        return globalInst("OP_GET_GLOBAL_LONG", 3, chunk, offset);
     case OP_SET_GLOBAL:
-        return constInst("OP_SET_GLOBAL", chunk, offset);
+        return globalInst("OP_SET_GLOBAL", 1, chunk, offset);
+    case OP_SET_GLOBAL_LONG:
+        return globalInst("OP_SET_GLOBAL_LONG", 3, chunk, offset);
     case OP_GET_UPVALUE:
         return byteInst("OP_GET_UPVALUE", chunk, offset);
+    case OP_GET_UPVALUE_LONG:
+        return shortInst("OP_GET_UPVALUE_LONG", chunk, offset);
     case OP_SET_UPVALUE:
         return byteInst("OP_SET_UPVALUE", chunk, offset);
+    case OP_SET_UPVALUE_LONG:
+        return shortInst("OP_SET_UPVALUE_LONG", chunk, offset);
     case OP_GET_PROPERTY:
-        return constInst("OP_GET_PROPERTY", chunk, offset);
+        return cacheInst("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
-        return constInst("OP_SET_PROPERTY", chunk, offset);
+        return cacheInst("OP_SET_PROPERTY", chunk, offset);
     case OP_DEFINE_GLOBAL:
-        return constInst("OP_DEFINE_GLOBAL", chunk, offset);
+        return globalInst("OP_DEFINE_GLOBAL", 1, chunk, offset);
+    case OP_DEFINE_GLOBAL_LONG:
+        return globalInst("OP_DEFINE_GLOBAL_LONG", 3, chunk, offset);
     case OP_EQUAL:
         return simpleInst("OP_EQUAL", offset);
+    case OP_NOT_EQUAL:
+        return simpleInst("OP_NOT_EQUAL", offset);
     case OP_GREATER:
         return simpleInst("OP_GREATER", offset);
+    case OP_GREATER_EQUAL:
+        return simpleInst("OP_GREATER_EQUAL", offset);
     case OP_LESS:
         return simpleInst("OP_LESS", offset);
+    case OP_LESS_EQUAL:
+        return simpleInst("OP_LESS_EQUAL", offset);
     case OP_ADD:
         return simpleInst("OP_ADD", offset);
     case OP_SUBTRACT:
@@ -109,36 +231,76 @@ int disassembleInstruction(Chunk *chunk, int offset) {
         return jumpInst("OP_JUMP", 1, chunk, offset);
     case OP_JUMP_IF_FALSE:
         return jumpInst("OP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_POP_JUMP_IF_FALSE:
+        return jumpInst("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
     case OP_LOOP:
         return jumpInst("OP_LOOP", -1, chunk, offset);
     case OP_CALL:
         return byteInst("OP_CALL", chunk, offset);
-    case OP_CLOSURE: {
-        offset++;
-        uint8_t constant = chunk->code[offset++];
-        printf("%-16s %4d ", "OP_CLOSURE", constant);
-        printValue(chunk->constants.values[constant]);
-        fputs("\n", stdout);
-
-        ObjFunction *func = AS_FUNC(chunk->constants.values[constant]);
-        for (int i = 0; i < func->upvalueCount; i++) {
-            int isLocal = chunk->code[offset++];
-            int index = chunk->code[offset++];
-            printf("%04d      |                     %s %d\n", offset - 2,
-                   isLocal ? "local" : "upvalue", index);
-        }
-        return offset;
-    }
+    case OP_TAIL_CALL:
+        return byteInst("OP_TAIL_CALL", chunk, offset);
+    case OP_CLOSURE:
+        return closureInst("OP_CLOSURE", 1, chunk, offset);
+    case OP_CLOSURE_LONG:
+        return closureInst("OP_CLOSURE_LONG", 3, chunk, offset);
     case OP_CLOSE_UPVALUE:
         return simpleInst("OP_CLOSE_UPVALUE", offset);
     case OP_CLASS:
-        return constInst("OP_CLASS", chunk, offset);
+        return constInst("OP_CLASS", 1, chunk, offset);
+    case OP_CLASS_LONG:
+        return constInst("OP_CLASS_LONG", 3, chunk, offset);
     case OP_METHOD:
-        return constInst("OP_METHOD", chunk, offset);
+        return constInst("OP_METHOD", 1, chunk, offset);
+    case OP_METHOD_LONG:
+        return constInst("OP_METHOD_LONG", 3, chunk, offset);
     case OP_INVOKE:
         return invokeInst("OP_INVOKE", chunk, offset);
     case OP_RETURN:
         return simpleInst("OP_RETURN", offset);
+    case OP_GET_LOCAL_GET_LOCAL:
+        return localPairInst("OP_GET_LOCAL_GET_LOCAL", chunk, offset);
+    case OP_GET_LOCAL_CONSTANT:
+        return localConstInst("OP_GET_LOCAL_CONSTANT", chunk, offset);
+    case OP_GET_LOCAL_PROPERTY:
+        return localCacheInst("OP_GET_LOCAL_PROPERTY", chunk, offset);
+    case OP_SET_LOCAL_POP:
+        return byteInst("OP_SET_LOCAL_POP", chunk, offset);
+    case OP_LESS_JUMP_IF_FALSE:
+        return jumpInst("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_ADD_NUM:
+        return simpleInst("OP_ADD_NUM", offset);
+    case OP_ADD_STR:
+        return simpleInst("OP_ADD_STR", offset);
+    case OP_EQUAL_NUM:
+        return simpleInst("OP_EQUAL_NUM", offset);
+    case OP_NOT_EQUAL_NUM:
+        return simpleInst("OP_NOT_EQUAL_NUM", offset);
+    case OP_ADD_ANY:
+        return simpleInst("OP_ADD_ANY", offset);
+    case OP_EQUAL_ANY:
+        return simpleInst("OP_EQUAL_ANY", offset);
+    case OP_NOT_EQUAL_ANY:
+        return simpleInst("OP_NOT_EQUAL_ANY", offset);
+    case OP_ADD_RR:
+        return registerInst("OP_ADD_RR", false, chunk, offset);
+    case OP_ADD_RK:
+        return registerInst("OP_ADD_RK", true, chunk, offset);
+    case OP_SUBTRACT_RR:
+        return registerInst("OP_SUBTRACT_RR", false, chunk, offset);
+    case OP_SUBTRACT_RK:
+        return registerInst("OP_SUBTRACT_RK", true, chunk, offset);
+    case OP_MULTIPLY_RR:
+        return registerInst("OP_MULTIPLY_RR", false, chunk, offset);
+    case OP_MULTIPLY_RK:
+        return registerInst("OP_MULTIPLY_RK", true, chunk, offset);
+    case OP_DIVIDE_RR:
+        return registerInst("OP_DIVIDE_RR", false, chunk, offset);
+    case OP_DIVIDE_RK:
+        return registerInst("OP_DIVIDE_RK", true, chunk, offset);
+    case OP_LESS_RR_JUMP:
+        return registerJumpInst("OP_LESS_RR_JUMP", false, chunk, offset);
+    case OP_LESS_RK_JUMP:
+        return registerJumpInst("OP_LESS_RK_JUMP", true, chunk, offset);
     default:
         printf("Unknown opcode %d\n", inst);
         return offset + 1;
@@ -0,0 +1,236 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "executor.h"
+
+typedef struct {
+    const char *src;
+    JobDone done;
+    void *arg;
+} Job;
+
+// The jobs of a worker, in a ring buffer. Its worker pushes and pops at the
+// back, the others steal from the front.
+typedef struct {
+    pthread_mutex_t lock;
+    Job *jobs;
+    int front;
+    int count;
+    int capacity;
+} Deque;
+
+typedef struct {
+    Executor *ex;
+    int index;
+    pthread_t thread;
+} Worker;
+
+struct Executor {
+    Worker *workers;
+    Deque *deques;
+    int workerCount;
+    VMOptions options;
+
+    atomic_int queued;  // jobs in the deques, counted before they get there
+    atomic_int pending; // jobs submitted and not done yet
+    atomic_uint next;   // deque the next job goes to
+
+    // idle workers and executorWait() sleep on these
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    bool stopping;
+};
+
+// The executor's memory is not any VM's to account for, so it does not go
+// through mem_reallocate().
+static void *allocate(void *ptr, size_t size) {
+    void *ret = realloc(ptr, size);
+    if (!ret) {
+        perror("realloc: ");
+        exit(1);
+    }
+
+    return ret;
+}
+
+static void push_back(Deque *deque, Job job) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        int capacity = deque->capacity < 8 ? 8 : deque->capacity * 2;
+        Job *jobs = allocate(NULL, sizeof(Job) * capacity);
+        for (int i = 0; i < deque->count; i++) {
+            jobs[i] = deque->jobs[(deque->front + i) % deque->capacity];
+        }
+
+        free(deque->jobs);
+        deque->jobs = jobs;
+        deque->front = 0;
+        deque->capacity = capacity;
+    }
+
+    deque->jobs[(deque->front + deque->count) % deque->capacity] = job;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static bool pop_back(Deque *deque, Job *job) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->count > 0;
+    if (found) {
+        deque->count--;
+        *job = deque->jobs[(deque->front + deque->count) % deque->capacity];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool pop_front(Deque *deque, Job *job) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->count > 0;
+    if (found) {
+        *job = deque->jobs[deque->front];
+        deque->front = (deque->front + 1) % deque->capacity;
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// the newest job of the worker's own, or else the oldest one of another
+static bool take(Executor *ex, int index, Job *job) {
+    if (pop_back(&ex->deques[index], job)) {
+        return true;
+    }
+
+    for (int i = 1; i < ex->workerCount; i++) {
+        if (pop_front(&ex->deques[(index + i) % ex->workerCount], job)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void run_job(Executor *ex, Job *job) {
+    VM *machine = vmNew();
+    vmConfigure(machine, &ex->options);
+    InterpretResult result = vmInterpret(machine, job->src);
+    vmFree(machine);
+
+    if (job->done != NULL) {
+        job->done(job->arg, result);
+    }
+
+    if (atomic_fetch_sub(&ex->pending, 1) == 1) {
+        pthread_mutex_lock(&ex->lock);
+        pthread_cond_broadcast(&ex->idle);
+        pthread_mutex_unlock(&ex->lock);
+    }
+}
+
+static void *work(void *arg) {
+    Worker *worker = arg;
+    Executor *ex = worker->ex;
+
+    while (true) {
+        Job job;
+        if (take(ex, worker->index, &job)) {
+            atomic_fetch_sub(&ex->queued, 1);
+            run_job(ex, &job);
+            continue;
+        }
+
+        // A job counted in `queued` may not be in its deque yet, in which
+        // case this goes around again instead of sleeping.
+        pthread_mutex_lock(&ex->lock);
+        while (atomic_load(&ex->queued) == 0 && !ex->stopping) {
+            pthread_cond_wait(&ex->work, &ex->lock);
+        }
+        bool stop = ex->stopping && atomic_load(&ex->queued) == 0;
+        pthread_mutex_unlock(&ex->lock);
+
+        if (stop) {
+            return NULL;
+        }
+    }
+}
+
+Executor *executorNew(int workers, const VMOptions *options) {
+    Executor *ex = allocate(NULL, sizeof(Executor));
+    ex->workers = allocate(NULL, sizeof(Worker) * workers);
+    ex->deques = allocate(NULL, sizeof(Deque) * workers);
+    ex->workerCount = workers;
+    ex->options = options != NULL ? *options : vmDefaultOptions();
+    atomic_init(&ex->queued, 0);
+    atomic_init(&ex->pending, 0);
+    atomic_init(&ex->next, 0);
+    pthread_mutex_init(&ex->lock, NULL);
+    pthread_cond_init(&ex->work, NULL);
+    pthread_cond_init(&ex->idle, NULL);
+    ex->stopping = false;
+
+    for (int i = 0; i < workers; i++) {
+        Deque *deque = &ex->deques[i];
+        pthread_mutex_init(&deque->lock, NULL);
+        deque->jobs = NULL;
+        deque->front = 0;
+        deque->count = 0;
+        deque->capacity = 0;
+    }
+
+    for (int i = 0; i < workers; i++) {
+        Worker *worker = &ex->workers[i];
+        worker->ex = ex;
+        worker->index = i;
+        if (pthread_create(&worker->thread, NULL, work, worker) != 0) {
+            perror("pthread_create: ");
+            exit(1);
+        }
+    }
+
+    return ex;
+}
+
+void executorSubmit(Executor *ex, const char *src, JobDone done, void *arg) {
+    atomic_fetch_add(&ex->pending, 1);
+    atomic_fetch_add(&ex->queued, 1);
+
+    unsigned index = atomic_fetch_add(&ex->next, 1) % ex->workerCount;
+    push_back(&ex->deques[index], (Job){src, done, arg});
+
+    pthread_mutex_lock(&ex->lock);
+    pthread_cond_signal(&ex->work);
+    pthread_mutex_unlock(&ex->lock);
+}
+
+void executorWait(Executor *ex) {
+    pthread_mutex_lock(&ex->lock);
+    while (atomic_load(&ex->pending) > 0) {
+        pthread_cond_wait(&ex->idle, &ex->lock);
+    }
+    pthread_mutex_unlock(&ex->lock);
+}
+
+void executorFree(Executor *ex) {
+    pthread_mutex_lock(&ex->lock);
+    ex->stopping = true;
+    pthread_cond_broadcast(&ex->work);
+    pthread_mutex_unlock(&ex->lock);
+
+    for (int i = 0; i < ex->workerCount; i++) {
+        pthread_join(ex->workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < ex->workerCount; i++) {
+        pthread_mutex_destroy(&ex->deques[i].lock);
+        free(ex->deques[i].jobs);
+    }
+    pthread_mutex_destroy(&ex->lock);
+    pthread_cond_destroy(&ex->work);
+    pthread_cond_destroy(&ex->idle);
+    free(ex->deques);
+    free(ex->workers);
+    free(ex);
+}
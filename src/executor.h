@@ -0,0 +1,31 @@
+#ifndef CLOX_EXECUTOR_H
+#define CLOX_EXECUTOR_H
+
+#include "common.h"
+#include "vm.h"
+
+/* Runs scripts in parallel on a fixed set of worker threads. Every script
+ * gets a VM of its own on the worker that takes it, so scripts share nothing
+ * and the interpreter never takes a lock. Each worker keeps a queue of its
+ * own, runs the newest job in it first and, once it runs dry, steals the
+ * oldest job of another worker. */
+typedef struct Executor Executor;
+
+// called on the worker thread once the script of a job has run
+typedef void (*JobDone)(void *arg, InterpretResult result);
+
+// Starts `workers` threads. Their VMs get set up with `options`, or the
+// defaults if NULL.
+Executor *executorNew(int workers, const VMOptions *options);
+
+// Queues `src` to run, after which `done` gets called with `arg`, unless it
+// is NULL. `src` has to stay around until then.
+void executorSubmit(Executor *ex, const char *src, JobDone done, void *arg);
+
+// waits until every job submitted so far has run
+void executorWait(Executor *ex);
+
+// waits for the jobs still queued and stops the workers
+void executorFree(Executor *ex);
+
+#endif
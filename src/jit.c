@@ -0,0 +1,392 @@
+#include "jit.h"
+
+#ifdef JIT
+
+#include "trace.h"
+#include "x64.h"
+
+/* A baseline compiler: every instruction is translated on its own by
+ * stitching together a fixed machine-code template, so each bytecode offset
+ * has a native counterpart and run() can enter the code at any instruction.
+ * Templates cover stack and local traffic, globals, jumps and arithmetic or
+ * comparisons on numbers. Everything else (calls, returns, properties,
+ * strings, closures) and every failed type guard leaves the native code at
+ * the start of the instruction, and the interpreter carries on from there.
+ * So does a loop back edge once the loop is hot enough to be traced, see
+ * trace.h.
+ *
+ * Native code never allocates, so the GC cannot run underneath it. */
+
+struct JitCode {
+    uint8_t *code;     // prologue at the start, see jitRun()
+    size_t size;       // of the mapping
+    uint32_t *entries; // native offset of each bytecode offset
+};
+
+static void jump_to(Asm *a, size_t at, uint32_t offset) {
+    add_patch(&a->jumps, at, offset);
+}
+
+
+// Emits jumps taken when the value is falsey and returns how many, with the
+// offsets to patch in `at`.
+static int jump_if_falsey(Asm *a, int base, int32_t disp, size_t *at) {
+#ifdef NAN_BOXING
+    load(a, RAX, base, disp);
+    mov_imm(a, RCX, NIL_VAL); // FALSE_VAL is NIL_VAL + 1
+    alu(a, ALU_SUB, RAX, RCX);
+    cmp_imm(a, RAX, 1);
+    at[0] = jcc(a, CC_BE);
+    return 1;
+#else
+    cmp_mem32(a, base, disp, VAL_NIL);
+    at[0] = jcc(a, CC_E);
+    cmp_mem32(a, base, disp, VAL_BOOL);
+    size_t truthy = jcc(a, CC_NE);
+    cmp_mem8(a, base, disp + NUM_DISP, 0);
+    at[1] = jcc(a, CC_E);
+    patch_rel32(a, truthy, a->len);
+    return 2;
+#endif
+}
+
+// guards both operands and loads them into xmm0 and xmm1
+static void load_numbers(Asm *a, int lbase, int32_t ldisp, int rbase,
+                         int32_t rdisp) {
+    guard_number(a, lbase, ldisp);
+    guard_number(a, rbase, rdisp);
+    sse_mem(a, SSE_LOAD, 0, lbase, ldisp + NUM_DISP);
+    sse_mem(a, SSE_LOAD, 1, rbase, rdisp + NUM_DISP);
+}
+
+// compares xmm0 with xmm1, leaving the result of `op` in al
+static void compare(Asm *a, uint8_t op) {
+    switch (op) {
+    // <= and >= are !(a > b) and !(a < b), true for NaN like in run()
+    case OP_LESS:
+    case OP_GREATER_EQUAL:
+        sse_reg(a, SSE_UCOMI, 1, 0);
+        setcc(a, op == OP_LESS ? CC_A : CC_BE, RAX);
+        break;
+    case OP_GREATER:
+    case OP_LESS_EQUAL:
+        sse_reg(a, SSE_UCOMI, 0, 1);
+        setcc(a, op == OP_GREATER ? CC_A : CC_BE, RAX);
+        break;
+    case OP_EQUAL:
+        // an unordered compare sets ZF too, so NaN needs the parity flag
+        sse_reg(a, SSE_UCOMI, 0, 1);
+        setcc(a, CC_E, RAX);
+        setcc(a, CC_NP, RCX);
+        emit8(a, 0x20); // and al, cl
+        emit8(a, 0xc8);
+        break;
+    case OP_NOT_EQUAL:
+        sse_reg(a, SSE_UCOMI, 0, 1);
+        setcc(a, CC_NE, RAX);
+        setcc(a, CC_P, RCX);
+        emit8(a, 0x08); // or al, cl
+        emit8(a, 0xc8);
+        break;
+    }
+}
+
+static uint8_t arith_op(uint8_t op) {
+    switch (op) {
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+        return SSE_ADD;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_RR:
+    case OP_SUBTRACT_RK:
+        return SSE_SUB;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_RR:
+    case OP_MULTIPLY_RK:
+        return SSE_MUL;
+    default:
+        return SSE_DIV;
+    }
+}
+
+static uint32_t operand(uint8_t *at, int width) {
+    uint32_t ret = 0;
+    for (int i = 0; i < width; i++)
+        ret = (ret << 8) | at[i];
+    return ret;
+}
+
+static void get_global(Asm *a, uint32_t slot) {
+    load(a, RAX, GLOBALS, offsetof(Globals, defined));
+    cmp_mem8(a, RAX, slot, 0);
+    exit_if(a, CC_E);
+    load(a, RDX, GLOBALS, offsetof(Globals, values));
+    copy_value(a, SP, 0, RDX, slot * VS);
+    add_imm(a, SP, VS);
+}
+static void set_global(Asm *a, uint32_t slot) {
+    load(a, RAX, GLOBALS, offsetof(Globals, defined));
+    cmp_mem8(a, RAX, slot, 0);
+    exit_if(a, CC_E);
+    load(a, RDX, GLOBALS, offsetof(Globals, values));
+    copy_value(a, RDX, slot * VS, SP, -VS);
+}
+
+// translates the instruction at `offset`, which is `len` bytes long
+static void translate(Asm *a, ObjFunction *func, uint32_t offset, int len) {
+    uint8_t *code = func->chunk.code;
+    uint8_t op = code[offset];
+    uint8_t *args = code + offset + 1;
+    // jumps end with their 16-bit distance
+    uint32_t after = offset + len;
+    uint32_t dist = len >= 3 ? operand(code + after - 2, 2) : 0;
+    size_t at[2];
+
+    switch (op) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+        copy_value(a, SP, 0, CONSTS, operand(args, len - 1) * VS);
+        add_imm(a, SP, VS);
+        break;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+        store_literal(a, SP, 0, op);
+        add_imm(a, SP, VS);
+        break;
+    case OP_POP:
+        add_imm(a, SP, -VS);
+        break;
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+        copy_value(a, SP, 0, SLOTS, operand(args, len - 1) * VS);
+        add_imm(a, SP, VS);
+        break;
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_LONG:
+        copy_value(a, SLOTS, operand(args, len - 1) * VS, SP, -VS);
+        break;
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+        get_global(a, operand(args, len - 1));
+        break;
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+        set_global(a, operand(args, len - 1));
+        break;
+    case OP_EQUAL:
+    case OP_EQUAL_NUM:
+    case OP_NOT_EQUAL:
+    case OP_NOT_EQUAL_NUM:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+        load_numbers(a, SP, -2 * VS, SP, -VS);
+        if (op == OP_EQUAL_NUM)
+            op = OP_EQUAL;
+        if (op == OP_NOT_EQUAL_NUM)
+            op = OP_NOT_EQUAL;
+        compare(a, op);
+        add_imm(a, SP, -VS);
+        store_flag(a, SP, -VS);
+        break;
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+        load_numbers(a, SP, -2 * VS, SP, -VS);
+        sse_reg(a, arith_op(op), 0, 1);
+        add_imm(a, SP, -VS);
+        store_number(a, SP, -VS, 0);
+        break;
+    case OP_NOT: {
+        int count = jump_if_falsey(a, SP, -VS, at);
+        mov_eax(a, 0);
+        size_t done = jmp(a);
+        for (int i = 0; i < count; i++)
+            patch_rel32(a, at[i], a->len);
+        mov_eax(a, 1);
+        patch_rel32(a, done, a->len);
+        store_flag(a, SP, -VS);
+        break;
+    }
+    case OP_NEGATE:
+        guard_number(a, SP, -VS);
+        sse_mem(a, SSE_LOAD, 0, SP, -VS + NUM_DISP);
+        mov_imm(a, RAX, (uint64_t)1 << 63);
+        emit8(a, 0x66); // movq xmm1, rax
+        emit8(a, 0x48);
+        emit8(a, 0x0f);
+        emit8(a, 0x6e);
+        emit8(a, 0xc8);
+        sse_reg(a, SSE_XOR, 0, 1);
+        store_number(a, SP, -VS, 0);
+        break;
+    case OP_JUMP:
+        jump_to(a, jmp(a), after + dist);
+        break;
+    case OP_LOOP: {
+        // counts down to the loop getting traced, which run() takes care of
+        Trace *trace = traceLoop(func, after - dist);
+        mov_imm(a, RAX, (uint64_t)(uintptr_t)&trace->hits);
+        emit8(a, 0x83); // sub dword [rax], 1
+        modrm_mem(a, 5, RAX, 0);
+        emit8(a, 1);
+        exit_if(a, CC_LE);
+        jump_to(a, jmp(a), after - dist);
+        break;
+    }
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE: {
+        int32_t disp = -VS;
+        if (op == OP_POP_JUMP_IF_FALSE) {
+            add_imm(a, SP, -VS); // the value stays readable above the top
+            disp = 0;
+        }
+        int count = jump_if_falsey(a, SP, disp, at);
+        for (int i = 0; i < count; i++)
+            jump_to(a, at[i], after + dist);
+        break;
+    }
+    case OP_LESS_JUMP_IF_FALSE:
+        load_numbers(a, SP, -2 * VS, SP, -VS);
+        add_imm(a, SP, -2 * VS);
+        sse_reg(a, SSE_UCOMI, 1, 0);
+        jump_to(a, jcc(a, CC_BE), after + dist);
+        break;
+    case OP_GET_LOCAL_GET_LOCAL:
+        copy_value(a, SP, 0, SLOTS, args[0] * VS);
+        copy_value(a, SP, VS, SLOTS, args[1] * VS);
+        add_imm(a, SP, 2 * VS);
+        break;
+    case OP_GET_LOCAL_CONSTANT:
+        copy_value(a, SP, 0, SLOTS, args[0] * VS);
+        copy_value(a, SP, VS, CONSTS, args[1] * VS);
+        add_imm(a, SP, 2 * VS);
+        break;
+    case OP_SET_LOCAL_POP:
+        copy_value(a, SLOTS, args[0] * VS, SP, -VS);
+        add_imm(a, SP, -VS);
+        break;
+    case OP_ADD_RR:
+    case OP_SUBTRACT_RR:
+    case OP_MULTIPLY_RR:
+    case OP_DIVIDE_RR:
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RK: {
+        bool constant = op == OP_ADD_RK || op == OP_SUBTRACT_RK ||
+                        op == OP_MULTIPLY_RK || op == OP_DIVIDE_RK;
+        load_numbers(a, SLOTS, args[1] * VS, constant ? CONSTS : SLOTS,
+                     args[2] * VS);
+        sse_reg(a, arith_op(op), 0, 1);
+        store_number(a, SLOTS, args[0] * VS, 0);
+        break;
+    }
+    case OP_LESS_RR_JUMP:
+    case OP_LESS_RK_JUMP:
+        load_numbers(a, SLOTS, args[0] * VS,
+                     op == OP_LESS_RK_JUMP ? CONSTS : SLOTS, args[1] * VS);
+        sse_reg(a, SSE_UCOMI, 1, 0);
+        jump_to(a, jcc(a, CC_BE), after + dist);
+        break;
+    default:
+        exit_always(a);
+        break;
+    }
+}
+
+bool jitCompile(ObjFunction *func) {
+    Chunk *chunk = &func->chunk;
+    Asm a = {0};
+    uint32_t *entries = malloc(sizeof(uint32_t) * chunk->len);
+    size_t *stubs = malloc(sizeof(size_t) * chunk->len);
+    if (entries == NULL || stubs == NULL)
+        exit(1);
+
+    emit_prologue(&a);
+    for (uint32_t offset = 0; offset < chunk->len;) {
+        int len = instructionLen(chunk, offset);
+        entries[offset] = a.len;
+        stubs[offset] = 0;
+        a.offset = offset;
+        translate(&a, func, offset, len);
+        offset += len;
+    }
+
+    // one stub per instruction that can leave, loading its offset
+    PatchList to_epilogue = {0};
+    for (size_t i = 0; i < a.exits.len; i++) {
+        Patch *leave = &a.exits.patches[i];
+        if (stubs[leave->offset] == 0) {
+            stubs[leave->offset] = a.len;
+            mov_eax(&a, leave->offset);
+            add_patch(&to_epilogue, jmp(&a), 0);
+        }
+        patch_rel32(&a, leave->at, stubs[leave->offset]);
+    }
+
+    size_t epilogue = emit_epilogue(&a);
+    for (size_t i = 0; i < to_epilogue.len; i++)
+        patch_rel32(&a, to_epilogue.patches[i].at, epilogue);
+    for (size_t i = 0; i < a.jumps.len; i++) {
+        Patch *jump = &a.jumps.patches[i];
+        patch_rel32(&a, jump->at, entries[jump->offset]);
+    }
+
+    free(stubs);
+    free(to_epilogue.patches);
+    free(a.exits.patches);
+    free(a.jumps.patches);
+
+    size_t size;
+    uint8_t *code = map_code(&a, &size);
+    if (code == NULL) {
+        free(entries);
+        return false;
+    }
+
+    JitCode *jit = malloc(sizeof(JitCode));
+    if (jit == NULL)
+        exit(1);
+    jit->code = code;
+    jit->size = size;
+    jit->entries = entries;
+    func->jit = jit;
+
+    return true;
+}
+
+void jitRun(JitCode *code, JitState *state) {
+    enter_code(code->code, state, code->code + code->entries[state->offset]);
+}
+
+void jitFree(JitCode *code) {
+    if (code == NULL)
+        return;
+
+    munmap(code->code, code->size);
+    free(code->entries);
+    free(code);
+}
+
+#else
+
+bool jitCompile(ObjFunction *func) {
+    (void)func;
+    return false;
+}
+
+void jitRun(JitCode *code, JitState *state) {
+    (void)code;
+    (void)state;
+}
+
+void jitFree(JitCode *code) { (void)code; }
+
+#endif
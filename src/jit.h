@@ -0,0 +1,37 @@
+#ifndef CLOX_JIT_H
+#define CLOX_JIT_H
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// calls plus loop back edges after which a function gets compiled
+#ifdef DEBUG_STRESS_JIT
+#define JIT_THRESHOLD 1
+#else
+#define JIT_THRESHOLD 1000
+#endif
+
+/* What native code shares with run(): the frame's slots and constants, and
+ * the stack top and bytecode offset to resume from, which it updates when
+ * it leaves. */
+typedef struct {
+    Value *slots;
+    Value *sp;
+    Value *constants;
+    uint32_t offset;
+} JitState;
+
+typedef struct JitCode JitCode;
+
+// Compiles `func` to native code and sets `func->jit`. Returns false where
+// the JIT is not available, leaving the function to the interpreter.
+bool jitCompile(ObjFunction *func);
+
+// Runs `code` from `state->offset` until it reaches an instruction it leaves
+// to the interpreter, whose offset it stores back into `state`.
+void jitRun(JitCode *code, JitState *state);
+
+void jitFree(JitCode *code);
+
+#endif
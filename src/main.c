@@ -5,28 +5,92 @@
 #include "chunk.h"
 #include "common.h"
 #include "debug.h"
+#include "executor.h"
+#include "memory.h"
 #include "vm.h"
 
-void repl();
-void runFile(const char *path);
+void repl(VM *machine);
+void runFile(VM *machine, const char *path);
+void runJobs(int workers, const VMOptions *options, int count, char **paths);
+
+static void usage() {
+    fputs("Usage: clox [options] [script]\n"
+          "       clox [options] --jobs N script...\n"
+          "Options, in any order, apply to the VM of every job as well:\n"
+          "  --registers       fuse arithmetic on locals into one instruction\n"
+          "  --gc-budget N     trace or sweep at most N objects per pause\n"
+          "  --gc-concurrent   mark on a background thread (NaN-boxed builds)\n"
+          "  --gc-threads N    trace on N threads\n",
+          stderr);
+    exit(64);
+}
+
+// the number after the flag at argv[*i], which it skips
+static int count_arg(int argc, char **argv, int *i) {
+    int count = *i + 1 < argc ? atoi(argv[*i + 1]) : 0;
+    if (count < 1) {
+        usage();
+    }
+    (*i)++;
+    return count;
+}
 
 int main(int argc, char **argv) {
-    initVM();
+    VMOptions options = vmDefaultOptions();
+    int workers = 0;
+
+    int i = 1;
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        if (strcmp(argv[i], "--registers") == 0) {
+            // has the optimizer fuse a few stack patterns over locals into
+            // instructions on frame slots; the stack VM runs either way
+            options.registerOps = true;
+        } else if (strcmp(argv[i], "--gc-budget") == 0) {
+            // caps the objects a major collection traces or sweeps in one
+            // go, trading longer collections for shorter pauses
+            options.gcBudget = count_arg(argc, argv, &i);
+        } else if (strcmp(argv[i], "--gc-concurrent") == 0) {
+            // traces on a thread of its own while the script runs
+            if (!GC_CAN_MARK_CONCURRENTLY) {
+                fputs("--gc-concurrent needs a NAN_BOXING build\n", stderr);
+                exit(64);
+            }
+            options.gcConcurrent = true;
+        } else if (strcmp(argv[i], "--gc-threads") == 0) {
+            // traces on N threads at once, in one pause
+            options.gcThreads = count_arg(argc, argv, &i);
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            // runs the scripts on N threads, each in a VM of its own
+            workers = count_arg(argc, argv, &i);
+        } else {
+            usage();
+        }
+    }
+
+    if (workers > 0) {
+        if (i == argc) {
+            usage();
+        }
+
+        runJobs(workers, &options, argc - i, argv + i);
+        return 0;
+    }
 
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    VM *machine = vmNew();
+    vmConfigure(machine, &options);
+    if (i == argc) {
+        repl(machine);
+    } else if (i == argc - 1) {
+        runFile(machine, argv[i]);
     } else {
-        fputs("Usage: clox [script]\n", stderr);
-        exit(64);
+        usage();
     }
 
-    freeVM();
+    vmFree(machine);
     return 0;
 }
 
-void repl() {
+void repl(VM *machine) {
     char *line = NULL;
     size_t line_len = 0;
 
@@ -40,7 +104,7 @@ void repl() {
             return;
         }
 
-        interpret(line);
+        vmInterpret(machine, line);
     }
 
     free(line);
@@ -74,9 +138,9 @@ static char *read_file(const char *path) {
     return buf;
 }
 
-void runFile(const char *path) {
+void runFile(VM *machine, const char *path) {
     char *src = read_file(path);
-    InterpretResult ret = interpret(src);
+    InterpretResult ret = vmInterpret(machine, src);
 
     free(src);
 
@@ -85,3 +149,43 @@ void runFile(const char *path) {
     if (ret == INTERPRET_RUNTIME_ERR)
         exit(70);
 }
+
+static void job_done(void *arg, InterpretResult result) {
+    *(InterpretResult *)arg = result;
+}
+
+// Exits as runFile() does for the worst result, runtime errors first.
+void runJobs(int workers, const VMOptions *options, int count, char **paths) {
+    char **srcs = malloc(sizeof(char *) * count);
+    InterpretResult *results = malloc(sizeof(InterpretResult) * count);
+    if (!srcs || !results) {
+        perror("malloc: ");
+        exit(74);
+    }
+
+    for (int i = 0; i < count; i++) {
+        srcs[i] = read_file(paths[i]);
+    }
+
+    Executor *ex = executorNew(workers, options);
+    for (int i = 0; i < count; i++) {
+        executorSubmit(ex, srcs[i], job_done, &results[i]);
+    }
+    executorFree(ex);
+
+    InterpretResult worst = INTERPRET_OK;
+    for (int i = 0; i < count; i++) {
+        if (results[i] == INTERPRET_RUNTIME_ERR ||
+            (results[i] == INTERPRET_COMPILE_ERR && worst == INTERPRET_OK)) {
+            worst = results[i];
+        }
+        free(srcs[i]);
+    }
+    free(srcs);
+    free(results);
+
+    if (worst == INTERPRET_COMPILE_ERR)
+        exit(65);
+    if (worst == INTERPRET_RUNTIME_ERR)
+        exit(70);
+}
@@ -1,8 +1,16 @@
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "channel.h"
 #include "chunk.h"
 #include "compiler.h"
+#include "jit.h"
+#include "trace.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -15,17 +23,34 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
-void *mem_reallocate(void *ptr, size_t old_size, size_t new_size) {
-    vm.bytesAllocated += (new_size - old_size);
+// bytes allocated between minor collections
+#ifndef GC_NURSERY_SIZE
+#define GC_NURSERY_SIZE (256 * 1024)
+#endif
 
-    if (new_size > old_size) {
-#ifdef DEBUG_LOG_GC
-        collectGarbage();
+// bytes allocated between increments of a major collection
+#ifndef GC_STEP_SIZE
+#define GC_STEP_SIZE (64 * 1024)
 #endif
+
+// objects the background marker traces per turn of the heap lock
+#define MARK_BATCH 64
+
+static void gc_poll();
+
+void *mem_reallocate(void *ptr, size_t old_size, size_t new_size) {
+    // memory used outside of any VM, like chunks built by hand, is nobody's
+    // to account for or collect
+    if (vm != NULL) {
+        vm->bytesAllocated += (new_size - old_size);
     }
 
-    if (vm.bytesAllocated > vm.nextGC) {
-        collectGarbage();
+    // only collect when growing; freeing from within a sweep must not
+    // start another collection
+    if (vm != NULL && new_size > old_size) {
+        vm->youngBytes += new_size - old_size;
+        vm->stepBytes += new_size - old_size;
+        gc_poll();
     }
 
     if (new_size == 0) {
@@ -42,6 +67,7 @@ void *mem_reallocate(void *ptr, size_t old_size, size_t new_size) {
     return ret;
 }
 
+// Frees what `object` owns. Its cell goes back to its page with the sweep.
 static void free_object(Obj *object) {
 #ifdef DEBUG_LOG_GC
     fprintf(stderr, "%p free type  %d\n", (void *)object, object->type);
@@ -51,103 +77,1055 @@ static void free_object(Obj *object) {
     case OBJ_STRING: {
         ObjString *str = (ObjString *)object;
         FREE_ARRAY(char, str->chars, str->len + 1);
-        FREE(ObjString, object);
         break;
     }
     case OBJ_FUNC: {
         ObjFunction *func = (ObjFunction *)object;
         freeChunk(&func->chunk);
-        FREE(ObjFunction, object);
+        jitFree(func->jit);
+        traceFree(func);
         break;
     }
     case OBJ_CLOSURE: {
         ObjClosure *closure = (ObjClosure *)object;
         FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-        FREE(ObjClosure, object);
         break;
     }
-    case OBJ_UPVALUE:
-        FREE(ObjUpvalue, object);
+    case OBJ_CLASS:
+        freeTable(&((ObjClass *)object)->methods);
         break;
-    case OBJ_NATIVE:
-        FREE(ObjNativeFunc, object);
-        break;
-    case OBJ_CLASS: {
-        ObjClass *klass = (ObjClass *)object;
-        freeTable(&klass->methods);
-        FREE(ObjClass, object);
-        break;
-    }
     case OBJ_INSTANCE: {
         ObjInstance *inst = (ObjInstance *)object;
-        freeTable(&inst->fields);
-        FREE(ObjInstance, object);
+        if (inst->fields != inst->inlineFields) {
+            FREE_ARRAY(Value, inst->fields, inst->fieldCapacity);
+        }
+        break;
+    }
+    case OBJ_SHAPE:
+        freeTable(&((ObjShape *)object)->transitions);
+        break;
+    case OBJ_CHANNEL:
+        channelRelease(((ObjChannel *)object)->channel);
+        break;
+    case OBJ_FIBER: {
+        ObjFiber *fiber = (ObjFiber *)object;
+        FREE_ARRAY(CallFrame, fiber->stacks.frames,
+                   fiber->stacks.frameCapacity);
+        FREE_ARRAY(Value, fiber->stacks.stack, fiber->stacks.stackCapacity);
         break;
     }
+    case OBJ_UPVALUE:
+    case OBJ_NATIVE:
     case OBJ_BOUND_METHOD:
-        FREE(ObjBoundMethod, object);
         break;
     }
 }
+
+/* Pages of each size class come in a list, and those with free cells also in
+ * one of their own to allocate from. Cells get allocated from the free list
+ * of a page, which sweeping rebuilds, or else from the part of it never used
+ * yet. Objects above GC_SMALL_MAX bytes get a page each, in the last class.
+ *
+ * A sweep does not look at live objects: the cells to free are those with
+ * their bit set in `allocated` and not in `marks`, a word of 64 at a time.
+ * A major sweep goes through the pages of each class in increments and,
+ * ahead of those, whenever a class runs out of free cells. Pages swept in
+ * the sweep under way carry its epoch, including those allocated meanwhile,
+ * so a page allocated from is always swept already. Minor collections sweep
+ * the young pages, those allocated from since the last collection, only, and
+ * free the pages of large objects they find dead. */
+#define GC_SMALL_MAX 256
+#define SIZE_CLASSES (GC_SMALL_MAX / GC_GRANULE)
+
+typedef struct {
+    Page *pages;
+    Page **sweepLink; // to the next page to sweep, NULL once all are
+    Page *current;    // allocated from
+    Page *available;  // swept pages with free cells besides `current`
+} SizeClass;
+
+typedef struct Heap {
+    SizeClass classes[SIZE_CLASSES + 1];
+    Page *young;
+    unsigned epoch;
+    int sweepClass; // the class the major sweep is in
+} Heap;
+
+// cells start past the page header
+#define PAGE_HEADER ((sizeof(Page) + GC_GRANULE - 1) & ~(GC_GRANULE - 1))
+
+struct Heap *heapNew() {
+    Heap *heap = calloc(1, sizeof(Heap));
+    if (heap == NULL)
+        exit(1);
+    return heap;
+}
+
+static Page *new_page(int size_class, size_t cell_size) {
+    size_t size = GC_PAGE_SIZE;
+    if (size_class == SIZE_CLASSES) {
+        size = (PAGE_HEADER + cell_size + GC_PAGE_SIZE - 1) &
+               ~(size_t)(GC_PAGE_SIZE - 1);
+    }
+
+    Page *page = aligned_alloc(GC_PAGE_SIZE, size);
+    if (page == NULL) {
+        perror("aligned_alloc: ");
+        exit(1);
+    }
+
+    Heap *heap = vm->heap;
+    SizeClass *cls = &heap->classes[size_class];
+    memset(page, 0, sizeof(Page));
+    page->next = cls->pages;
+    if (cls->pages != NULL) {
+        cls->pages->prev = page;
+    }
+    page->bump = (char *)page + PAGE_HEADER;
+    page->end = page->bump + (size - PAGE_HEADER) / cell_size * cell_size;
+    page->cellSize = cell_size;
+    page->sizeClass = size_class;
+    page->epoch = heap->epoch;
+    cls->pages = page;
+#ifdef DEBUG_GC_STATS
+    vm->gcStats.pageBytes += size;
+#endif
+    return page;
+}
+
+static void free_unreached(Obj *obj);
+
+// Unlinks `page`, which holds no objects, from its size class and frees it.
+static void free_page(SizeClass *cls, Page *page) {
+    Page **link = page->prev != NULL ? &page->prev->next : &cls->pages;
+    *link = page->next;
+    if (page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+    if (cls->sweepLink == &page->next) {
+        cls->sweepLink = link;
+    }
+#ifdef DEBUG_GC_STATS
+    // as new_page() sized it: cells end in its last GC_PAGE_SIZE bytes
+    vm->gcStats.pageBytes -=
+        ((size_t)(page->end - (char *)page) + GC_PAGE_SIZE - 1) &
+        ~(size_t)(GC_PAGE_SIZE - 1);
+#endif
+    free(page);
+}
+
+// Frees the unmarked objects of `page`. Returns how many there were.
+static long sweep_page(Page *page) {
+    long freed = 0;
+    for (int i = 0; i < GC_PAGE_WORDS; i++) {
+        uint64_t dead = page->allocated[i] & ~page->marks[i];
+        page->allocated[i] &= ~dead;
+        for (; dead != 0; dead &= dead - 1) {
+            int granule = i * 64 + __builtin_ctzll(dead);
+            Obj *obj = (Obj *)((char *)page + granule * GC_GRANULE);
+            free_unreached(obj);
+
+            *(void **)obj = page->freeCells;
+            page->freeCells = obj;
+            page->live--;
+            freed++;
+        }
+    }
+    return freed;
+}
+
+static void make_available(Page *page) {
+    SizeClass *cls = &vm->heap->classes[page->sizeClass];
+    if (page->sizeClass == SIZE_CLASSES || page->available ||
+        page == cls->current || page->freeCells == NULL) {
+        return;
+    }
+
+    page->available = true;
+    page->nextAvailable = cls->available;
+    cls->available = page;
+}
+
+// Sweeps the next page of `cls` not swept yet, if any, and frees it if it
+// ends up empty. Returns the objects freed, plus one for the page.
+static long sweep_next(SizeClass *cls) {
+    Heap *heap = vm->heap;
+    Page *page = *cls->sweepLink;
+    if (page == NULL) {
+        cls->sweepLink = NULL;
+        return 0;
+    }
+    if (page->epoch == heap->epoch) {
+        cls->sweepLink = &page->next;
+        return 1;
+    }
+
+    page->epoch = heap->epoch;
+    long freed = sweep_page(page);
+    if (page->live == 0) {
+        // neither current, available nor young: not swept before
+        free_page(cls, page);
+    } else {
+        cls->sweepLink = &page->next;
+        make_available(page);
+    }
+    return freed + 1;
+}
+
+// a page of `cls` with a free cell, which becomes the current one
+static Page *next_page(SizeClass *cls, int size_class, size_t cell_size) {
+    while (cls->available == NULL && cls->sweepLink != NULL) {
+        sweep_next(cls);
+    }
+
+    Page *page = cls->available;
+    if (page != NULL) {
+        cls->available = page->nextAvailable;
+        page->available = false;
+    } else {
+        page = new_page(size_class, cell_size);
+    }
+    cls->current = page;
+    return page;
+}
+
+void *heapAllocate(size_t size) {
+    size_t cell_size = (size + GC_GRANULE - 1) & ~(size_t)(GC_GRANULE - 1);
+    vm->bytesAllocated += cell_size;
+    vm->youngBytes += cell_size;
+    vm->stepBytes += cell_size;
+    gc_poll();
+
+    Page *page;
+    if (cell_size > GC_SMALL_MAX) {
+        page = new_page(SIZE_CLASSES, cell_size);
+    } else {
+        int size_class = cell_size / GC_GRANULE - 1;
+        SizeClass *cls = &vm->heap->classes[size_class];
+        page = cls->current;
+        if (page == NULL ||
+            (page->freeCells == NULL && page->bump == page->end)) {
+            page = next_page(cls, size_class, cell_size);
+        }
+    }
+
+    char *cell = page->freeCells;
+    if (cell != NULL) {
+        page->freeCells = *(void **)cell;
+    } else {
+        cell = page->bump;
+        page->bump += cell_size;
+    }
+
+    size_t granule = (cell - (char *)page) / GC_GRANULE;
+    page->allocated[granule / 64] |= (uint64_t)1 << (granule % 64);
+    page->live++;
+    if (!page->young) {
+        page->young = true;
+        page->nextYoung = vm->heap->young;
+        vm->heap->young = page;
+    }
+    return cell;
+}
+
+// the young pages become old ones
+static void forget_young() {
+    for (Page *page = vm->heap->young; page != NULL; page = page->nextYoung) {
+        page->young = false;
+    }
+    vm->heap->young = NULL;
+}
+
+static void stop_marker();
+static void stop_pool();
+
 void freeObjects() {
-    Obj *obj = vm.objects;
-    while (obj) {
-        Obj *next = obj->next;
-        free_object(obj);
-        obj = next;
+    if (vm->marker != NULL) {
+        stop_marker();
+    }
+    if (vm->markPool != NULL) {
+        stop_pool();
+    }
+
+    for (int i = 0; i <= SIZE_CLASSES; i++) {
+        Page *page = vm->heap->classes[i].pages;
+        while (page != NULL) {
+            for (int j = 0; j < GC_PAGE_WORDS; j++) {
+                for (uint64_t bits = page->allocated[j]; bits != 0;
+                     bits &= bits - 1) {
+                    int granule = j * 64 + __builtin_ctzll(bits);
+                    free_object((Obj *)((char *)page + granule * GC_GRANULE));
+                }
+            }
+
+            Page *next = page->next;
+            free(page);
+            page = next;
+        }
     }
+    free(vm->heap);
+    vm->heap = NULL;
+    vm->gcPhase = GC_IDLE;
 
-    free(vm.grayStack);
+    free(vm->grayStack);
+    vm->grayStack = NULL;
+    vm->grayCapacity = 0;
+    vm->grayCount = 0;
+    free(vm->remembered);
+    vm->remembered = NULL;
+    vm->rememberedCount = 0;
+    vm->rememberedCapacity = 0;
 }
 
 static void mark_roots();
+static void blacken_object(Obj *obj);
 static void trace_references();
-static void sweep();
+static void sweep_young();
+#ifdef DEBUG_GC_STATS
+static bool marker_working();
+#endif
 
-void collectGarbage() {
+void gcRemember(Obj *obj) {
+    if (obj->remembered || (!isMarked(obj) && !vm->markingConcurrently))
+        return;
+#ifdef DEBUG_GC_STATS
+    if (vm->markingConcurrently && marker_working()) {
+        vm->gcStats.markerRaces++;
+    }
+#endif
+
+    if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+        vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+        vm->remembered = (Obj **)realloc(
+            vm->remembered, sizeof(Obj *) * vm->rememberedCapacity);
+
+        if (vm->remembered == NULL)
+            exit(1);
+    }
+
+    obj->remembered = true;
+    vm->remembered[vm->rememberedCount++] = obj;
+}
+
+static void forget_remembered() {
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        vm->remembered[i]->remembered = false;
+    }
+    vm->rememberedCount = 0;
+}
+
+/* Objects start out young, and those a collection finds reachable become
+ * old. Most die young, so minor collections only look at the young objects:
+ * old objects keep their mark bit set between collections, which makes
+ * marking stop at them and sweeping leave them alone. What old objects
+ * refer to is only traced for those recorded by writeBarrier() since the
+ * last collection. Objects never move, since native code, inline caches and
+ * the C stack hold on to their addresses. */
+void collectYoung() {
+    // a major collection is marking, and takes the young objects along
+    if (vm->gcPhase == GC_MARK)
+        return;
+
+#ifdef DEBUG_LOG_GC
+    log_info("-- minor gc begin\n");
+    size_t before = vm->bytesAllocated;
+#endif
+
+    mark_roots();
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        blacken_object(vm->remembered[i]);
+    }
+    forget_remembered();
+    trace_references();
+    sweep_young();
+    vm->youngBytes = 0;
+
+#ifdef DEBUG_LOG_GC
+    log_info("-- minor gc end\n");
+    log_info("   collected %zu bytes ( from %zu to %zu)\n",
+             before - vm->bytesAllocated, before, vm->bytesAllocated);
+#endif
+}
+
+/* With vm->gcConcurrent set, the tracing of a major collection runs on a
+ * background thread while the program goes on. Marking starts and ends with
+ * a pause as usual; in between, the program records every object it writes
+ * a reference into, and the end of marking traces those again along with the
+ * roots. The marker reads objects under the heap lock, which the program
+ * takes around what would pull memory out from under it, like freeing an
+ * array an object just outgrew. What the program stores into objects in the
+ * meantime goes through gcStore(), which takes NaN boxing. Nothing else is
+ * shared: the marker owns the gray stack until it is done, and objects only
+ * get freed by sweeping. */
+typedef struct Marker {
+    VM *vm;
+    pthread_t thread;
+    pthread_mutex_t heap;
+
+    // the program starts and waits for the marker under `lock`
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    atomic_bool working;
+    bool stopping;
+} Marker;
+
+void gcLockHeap() {
+    if (vm != NULL && vm->heapLocks++ == 0 && vm->markingConcurrently) {
+        pthread_mutex_lock(&vm->marker->heap);
+    }
+}
+
+void gcUnlockHeap() {
+    if (vm != NULL && --vm->heapLocks == 0 && vm->markingConcurrently) {
+        pthread_mutex_unlock(&vm->marker->heap);
+    }
+}
+
+static void *mark_in_background(void *arg) {
+    Marker *marker = arg;
+    vm = marker->vm;
+
+    pthread_mutex_lock(&marker->lock);
+    while (true) {
+        while (!atomic_load(&marker->working) && !marker->stopping) {
+            pthread_cond_wait(&marker->wake, &marker->lock);
+        }
+        if (marker->stopping) {
+            break;
+        }
+        pthread_mutex_unlock(&marker->lock);
+
+        bool empty = false;
+        while (!empty) {
+            pthread_mutex_lock(&marker->heap);
+            for (int i = 0; i < MARK_BATCH && vm->grayCount > 0; i++) {
+                blacken_object(vm->grayStack[--vm->grayCount]);
+            }
+            empty = vm->grayCount == 0;
+            pthread_mutex_unlock(&marker->heap);
+        }
+
+        pthread_mutex_lock(&marker->lock);
+        atomic_store(&marker->working, false);
+        pthread_cond_broadcast(&marker->idle);
+    }
+    pthread_mutex_unlock(&marker->lock);
+    return NULL;
+}
+
+#ifdef DEBUG_GC_STATS
+static bool marker_working() { return atomic_load(&vm->marker->working); }
+#endif
+
+// hands the gray stack to the marker, which is started on first use
+static void start_marker() {
+    Marker *marker = vm->marker;
+    if (marker == NULL) {
+        marker = malloc(sizeof(Marker));
+        if (marker == NULL)
+            exit(1);
+
+        marker->vm = vm;
+        pthread_mutex_init(&marker->heap, NULL);
+        pthread_mutex_init(&marker->lock, NULL);
+        pthread_cond_init(&marker->wake, NULL);
+        pthread_cond_init(&marker->idle, NULL);
+        atomic_init(&marker->working, false);
+        marker->stopping = false;
+        if (pthread_create(&marker->thread, NULL, mark_in_background,
+                           marker) != 0) {
+            perror("pthread_create: ");
+            exit(1);
+        }
+        vm->marker = marker;
+    }
+
+    pthread_mutex_lock(&marker->lock);
+    atomic_store(&marker->working, true);
+    pthread_cond_signal(&marker->wake);
+    pthread_mutex_unlock(&marker->lock);
+}
+
+// waits until the marker runs out of gray objects
+static void wait_marker() {
+    Marker *marker = vm->marker;
+    pthread_mutex_lock(&marker->lock);
+    while (atomic_load(&marker->working)) {
+        pthread_cond_wait(&marker->idle, &marker->lock);
+    }
+    pthread_mutex_unlock(&marker->lock);
+}
+
+static void stop_marker() {
+    Marker *marker = vm->marker;
+    wait_marker();
+    vm->markingConcurrently = false;
+
+    pthread_mutex_lock(&marker->lock);
+    marker->stopping = true;
+    pthread_cond_signal(&marker->wake);
+    pthread_mutex_unlock(&marker->lock);
+    pthread_join(marker->thread, NULL);
+
+    pthread_mutex_destroy(&marker->heap);
+    pthread_mutex_destroy(&marker->lock);
+    pthread_cond_destroy(&marker->wake);
+    pthread_cond_destroy(&marker->idle);
+    free(marker);
+    vm->marker = NULL;
+}
+
+/* With vm->gcThreads above one, tracing in a pause is split between that
+ * many threads: the VM's, which waits for the others anyway, and a pool
+ * started on first use. Each has a deque of gray objects after Chase and
+ * Lev's. Its thread pushes and takes at the bottom, and threads that run out
+ * steal from the top of another's. Two threads can reach the same object,
+ * so they claim it by swapping its mark bit in. Marking ends once every
+ * thread is out of work at once. */
+typedef struct GrayArray {
+    struct GrayArray *retired; // outgrown arrays, freed after tracing
+    long mask;                 // the capacity, a power of 2, minus 1
+    _Atomic(Obj *) objs[];
+} GrayArray;
+
+typedef struct {
+    atomic_long top;
+    atomic_long bottom;
+    _Atomic(GrayArray *) array;
+#ifdef DEBUG_GC_STATS
+    long stolen; // by its thread, from the others
+#endif
+} GrayDeque;
+
+typedef struct {
+    struct MarkPool *pool;
+    int index;
+    pthread_t thread;
+} PoolThread;
+
+typedef struct MarkPool {
+    VM *vm;
+    int count; // deques, one per thread tracing
+    GrayDeque *deques;
+    PoolThread *threads;
+    atomic_int active; // threads that may still find work
+
+    // the VM's thread starts a round of tracing under `lock`, and waits for
+    // the other threads to finish it
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    int round;
+    int finished;
+    bool stopping;
+} MarkPool;
+
+// that of the thread tracing in parallel, NULL for the others
+static _Thread_local GrayDeque *gray_deque = NULL;
+
+static GrayArray *new_gray_array(long capacity) {
+    GrayArray *array =
+        malloc(sizeof(GrayArray) + sizeof(_Atomic(Obj *)) * capacity);
+    if (array == NULL)
+        exit(1);
+
+    array->retired = NULL;
+    array->mask = capacity - 1;
+    return array;
+}
+
+static void push_gray(GrayDeque *deque, Obj *obj) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    GrayArray *array =
+        atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+    if (bottom - top > array->mask) {
+        // thieves may still read the old array
+        GrayArray *grown = new_gray_array((array->mask + 1) * 2);
+        for (long i = top; i < bottom; i++) {
+            Obj *obj = atomic_load_explicit(&array->objs[i & array->mask],
+                                            memory_order_relaxed);
+            atomic_store_explicit(&grown->objs[i & grown->mask], obj,
+                                  memory_order_relaxed);
+        }
+        grown->retired = array;
+        atomic_store_explicit(&deque->array, grown, memory_order_release);
+        array = grown;
+    }
+
+    atomic_store_explicit(&array->objs[bottom & array->mask], obj,
+                          memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+}
+
+// the object pushed last, or NULL; only for the deque's thread
+static Obj *take_gray(GrayDeque *deque) {
+    long bottom =
+        atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    GrayArray *array =
+        atomic_load_explicit(&deque->array, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_seq_cst);
+
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1,
+                              memory_order_relaxed);
+        return NULL;
+    }
+
+    Obj *obj = atomic_load_explicit(&array->objs[bottom & array->mask],
+                                    memory_order_relaxed);
+    if (top == bottom) {
+        // the last one, which a thief may be taking too
+        if (!atomic_compare_exchange_strong(&deque->top, &top, top + 1)) {
+            obj = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1,
+                              memory_order_relaxed);
+    }
+    return obj;
+}
+
+// the object pushed first, or NULL if there is none or another thread got
+// it first
+static Obj *steal_gray(GrayDeque *deque) {
+    long top = atomic_load_explicit(&deque->top, memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_seq_cst);
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    GrayArray *array =
+        atomic_load_explicit(&deque->array, memory_order_acquire);
+    Obj *obj = atomic_load_explicit(&array->objs[top & array->mask],
+                                    memory_order_relaxed);
+    if (!atomic_compare_exchange_strong(&deque->top, &top, top + 1)) {
+        return NULL;
+    }
+    return obj;
+}
+
+static Obj *steal_any(MarkPool *pool, int self) {
+    for (int i = 1; i < pool->count; i++) {
+        Obj *obj = steal_gray(&pool->deques[(self + i) % pool->count]);
+        if (obj != NULL) {
+#ifdef DEBUG_GC_STATS
+            pool->deques[self].stolen++;
+#endif
+            return obj;
+        }
+    }
+    return NULL;
+}
+
+static bool any_gray(MarkPool *pool) {
+    for (int i = 0; i < pool->count; i++) {
+        GrayDeque *deque = &pool->deques[i];
+        if (atomic_load(&deque->top) < atomic_load(&deque->bottom)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// traces until no thread has any gray object left
+static void drain_gray(MarkPool *pool, int self) {
+    GrayDeque *deque = &pool->deques[self];
+    gray_deque = deque;
+
+    while (true) {
+        Obj *obj = take_gray(deque);
+        if (obj == NULL) {
+            obj = steal_any(pool, self);
+        }
+        if (obj != NULL) {
+            blacken_object(obj);
+            continue;
+        }
+
+        // Out of work. A thread only stops counting itself active with
+        // an empty deque, so once none is active there is nothing left.
+        atomic_fetch_sub(&pool->active, 1);
+        while (obj == NULL && atomic_load(&pool->active) > 0) {
+            if (any_gray(pool)) {
+                atomic_fetch_add(&pool->active, 1);
+                obj = steal_any(pool, self);
+                if (obj == NULL) {
+                    atomic_fetch_sub(&pool->active, 1);
+                }
+            } else {
+                sched_yield();
+            }
+        }
+        if (obj == NULL) {
+            break;
+        }
+        blacken_object(obj);
+    }
+
+    gray_deque = NULL;
+}
+
+static void *mark_in_pool(void *arg) {
+    PoolThread *thread = arg;
+    MarkPool *pool = thread->pool;
+    vm = pool->vm;
+
+    int round = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->round == round && !pool->stopping) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->stopping) {
+            break;
+        }
+        round = pool->round;
+        pthread_mutex_unlock(&pool->lock);
+
+        drain_gray(pool, thread->index);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->finished++;
+        pthread_cond_signal(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static MarkPool *start_pool(int count) {
+    MarkPool *pool = malloc(sizeof(MarkPool));
+    if (pool == NULL)
+        exit(1);
+
+    pool->vm = vm;
+    pool->count = count;
+    pool->deques = malloc(sizeof(GrayDeque) * count);
+    pool->threads = malloc(sizeof(PoolThread) * count);
+    if (pool->deques == NULL || pool->threads == NULL)
+        exit(1);
+
+    atomic_init(&pool->active, 0);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pool->round = 0;
+    pool->finished = 0;
+    pool->stopping = false;
+
+    for (int i = 0; i < count; i++) {
+        atomic_init(&pool->deques[i].top, 0);
+        atomic_init(&pool->deques[i].bottom, 0);
+        atomic_init(&pool->deques[i].array, new_gray_array(1024));
+#ifdef DEBUG_GC_STATS
+        pool->deques[i].stolen = 0;
+#endif
+    }
+
+    // the VM's thread is the first
+    for (int i = 1; i < count; i++) {
+        PoolThread *thread = &pool->threads[i];
+        thread->pool = pool;
+        thread->index = i;
+        if (pthread_create(&thread->thread, NULL, mark_in_pool, thread) !=
+            0) {
+            perror("pthread_create: ");
+            exit(1);
+        }
+    }
+    return pool;
+}
+
+static void stop_pool() {
+    MarkPool *pool = vm->markPool;
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 1; i < pool->count; i++) {
+        pthread_join(pool->threads[i].thread, NULL);
+    }
+
+    for (int i = 0; i < pool->count; i++) {
+        free(atomic_load(&pool->deques[i].array));
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+    vm->markPool = NULL;
+}
+
+// traces what is gray with all of the pool's threads
+static void trace_parallel() {
+    if (vm->markPool == NULL) {
+        vm->markPool = start_pool(vm->gcThreads);
+    }
+    MarkPool *pool = vm->markPool;
+
+    // deal the gray objects out
+    for (int i = 0; i < vm->grayCount; i++) {
+        push_gray(&pool->deques[i % pool->count], vm->grayStack[i]);
+    }
+    vm->grayCount = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->active, pool->count);
+    pool->finished = 0;
+    pool->round++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    drain_gray(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->finished < pool->count - 1) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+#ifdef DEBUG_GC_STATS
+    for (int i = 0; i < pool->count; i++) {
+        vm->gcStats.grayStolen += pool->deques[i].stolen;
+        pool->deques[i].stolen = 0;
+    }
+#endif
+
+    for (int i = 0; i < pool->count; i++) {
+        GrayArray *array = atomic_load(&pool->deques[i].array);
+        while (array->retired != NULL) {
+            GrayArray *retired = array->retired;
+            array->retired = retired->retired;
+            free(retired);
+        }
+    }
+}
+
+/* Major collections run in increments of at most vm->gcBudget objects
+ * traced or swept, one every GC_STEP_SIZE bytes allocated, so their pauses
+ * do not grow with the heap. Clearing the mark bitmaps turns every object
+ * white at once. While marking, the program keeps allocating young objects and
+ * writeBarrier() keeps recording marked objects that get a reference to a
+ * white one, so no marked object ends up pointing at an object nobody
+ * traces: those recorded get traced again. Only the roots, which have no
+ * barrier, are marked again in one go at the end of marking. Sweeping then
+ * frees what is still white while minor collections carry on. */
+static void begin_major() {
 #ifdef DEBUG_LOG_GC
-    log_info("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
+    log_info("-- major gc begin\n");
 #endif
 
+    for (int i = 0; i <= SIZE_CLASSES; i++) {
+        for (Page *page = vm->heap->classes[i].pages; page != NULL;
+             page = page->next) {
+            memset(page->marks, 0, sizeof(page->marks));
+        }
+    }
+    forget_young();
+    forget_remembered();
+    vm->gcPhase = GC_MARK;
+    mark_roots();
+
+    if (vm->gcConcurrent && GC_CAN_MARK_CONCURRENTLY) {
+        vm->markingConcurrently = true;
+        start_marker();
+    }
+}
+
+// Ends marking in one go: what the increments or the marker left gets
+// traced, and so do the roots once more.
+static void finish_mark() {
+    vm->markingConcurrently = false;
+
+    // objects written while the marker ran get traced again with what they
+    // hold now; those it never reached get traced if anything else is
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        Obj *obj = vm->remembered[i];
+        obj->remembered = false;
+        if (isMarked(obj)) {
+            blacken_object(obj);
+        }
+    }
+    vm->rememberedCount = 0;
+
     mark_roots();
     trace_references();
-    table_remove_white(&vm.strings);
-    sweep();
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    // what got allocated meanwhile is swept along with the rest, and
+    // nothing gets allocated from a page before it is swept
+    forget_young();
+    Heap *heap = vm->heap;
+    heap->epoch++;
+    heap->sweepClass = 0;
+    for (int i = 0; i <= SIZE_CLASSES; i++) {
+        SizeClass *cls = &heap->classes[i];
+        cls->sweepLink = &cls->pages;
+        cls->current = NULL;
+        for (Page *page = cls->available; page != NULL;
+             page = page->nextAvailable) {
+            page->available = false;
+        }
+        cls->available = NULL;
+    }
+    vm->gcPhase = GC_SWEEP;
+}
+
+// Traces up to `budget` objects, and finishes marking once there are none
+// left. Returns the budget left.
+static long mark_step(long budget) {
+    // tracing is split between threads in one go instead
+    if (vm->gcThreads > 1) {
+        finish_mark();
+        return budget;
+    }
+
+    while (budget > 0) {
+        Obj *obj;
+        if (vm->grayCount > 0) {
+            obj = vm->grayStack[--vm->grayCount];
+        } else if (vm->rememberedCount > 0) {
+            obj = vm->remembered[--vm->rememberedCount];
+            obj->remembered = false;
+        } else {
+            break;
+        }
+
+        blacken_object(obj);
+        budget--;
+    }
+    if (vm->grayCount == 0 && vm->rememberedCount == 0) {
+        finish_mark();
+    }
+    return budget;
+}
+
+// Sweeps pages until it has freed `budget` objects, and ends the collection
+// once all are swept.
+static long sweep_step(long budget) {
+    Heap *heap = vm->heap;
+    while (budget > 0 && heap->sweepClass <= SIZE_CLASSES) {
+        SizeClass *cls = &heap->classes[heap->sweepClass];
+        if (cls->sweepLink == NULL) {
+            heap->sweepClass++;
+        } else {
+            budget -= sweep_next(cls);
+        }
+    }
 
+    if (heap->sweepClass > SIZE_CLASSES) {
+        vm->gcPhase = GC_IDLE;
+        vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
 #ifdef DEBUG_LOG_GC
-    log_info("-- gc end\n");
-    log_info("   collected %zu bytes ( from %zu to %zu) next at %zu\n",
-             before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+        log_info("-- major gc end, next at %zu\n", vm->nextGC);
 #endif
+    }
+    return budget;
+}
+
+static void major_step(long budget) {
+    if (vm->gcPhase == GC_MARK && vm->markingConcurrently) {
+        // the marker may be waiting for the heap lock
+        if (vm->heapLocks > 0 || atomic_load(&vm->marker->working)) {
+            return;
+        }
+        finish_mark();
+    } else if (vm->gcPhase == GC_MARK) {
+        budget = mark_step(budget);
+    }
+    if (vm->gcPhase == GC_SWEEP) {
+        sweep_step(budget);
+    }
+}
+
+static void finish_major() {
+    if (vm->markingConcurrently) {
+        wait_marker();
+        finish_mark();
+    }
+    while (vm->gcPhase != GC_IDLE) {
+        major_step(LONG_MAX);
+    }
+}
+
+void collectGarbage() {
+    // one under way may have started before some of the garbage was
+    finish_major();
+    begin_major();
+    finish_major();
+    vm->youngBytes = 0;
+}
+
+// runs whatever collection work the allocations so far call for
+static void gc_poll() {
+#ifdef DEBUG_STRESS_GC
+    // always a major collection going on, in increments of one object, and
+    // a minor collection on every allocation outside of marking
+    collectYoung();
+    if (vm->gcPhase == GC_IDLE && vm->heapLocks == 0) {
+        begin_major();
+    }
+    major_step(1);
+    return;
+#endif
+
+    if (vm->gcPhase == GC_IDLE && vm->bytesAllocated > vm->nextGC &&
+        vm->heapLocks == 0) {
+        begin_major();
+        vm->stepBytes = 0;
+    }
+    if (vm->gcPhase != GC_MARK && vm->youngBytes > GC_NURSERY_SIZE) {
+        collectYoung();
+    }
+    if (vm->gcPhase == GC_IDLE || vm->stepBytes < GC_STEP_SIZE) {
+        return;
+    }
+
+    vm->stepBytes = 0;
+    if (vm->gcPhase == GC_MARK && vm->heapLocks == 0 &&
+        vm->bytesAllocated > vm->nextGC * GC_HEAP_GROW_FACTOR) {
+        // the program allocates faster than marking goes, which is not to
+        // leave it running out of memory
+        finish_major();
+    } else {
+        major_step(vm->gcBudget);
+    }
 }
 
 void mark_object(Obj *obj) {
     if (obj == NULL)
         return;
-    if (obj->marked)
+    if (isMarked(obj))
         return;
 
+    // the other threads tracing may be claiming it too
+    if (setMarked(obj))
+        return;
+    if (gray_deque != NULL) {
+        push_gray(gray_deque, obj);
+        return;
+    }
+
 #ifdef DEBUG_LOG_GC
     fprintf(stderr, "%p mark ", (void *)obj);
     printValue(OBJ_VAL(obj));
     printf("\n");
 #endif
 
-    obj->marked = true;
-
-    if (vm.grayCapacity < vm.grayCount + 1) {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-        vm.grayStack =
-            (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
+    if (vm->grayCapacity < vm->grayCount + 1) {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+        vm->grayStack =
+            (Obj **)realloc(vm->grayStack, sizeof(Obj *) * vm->grayCapacity);
 
-        if (vm.grayStack == NULL)
+        if (vm->grayStack == NULL)
             exit(1);
     }
 
-    vm.grayStack[vm.grayCount++] = obj;
+    vm->grayStack[vm->grayCount++] = obj;
 }
 void mark_value(Value value) {
     if (IS_OBJ(value))
@@ -159,6 +1137,34 @@ static void mark_array(ValueArray *arr) {
         mark_value(arr->values[i]);
     }
 }
+static void mark_caches(Chunk *chunk) {
+    for (int i = 0; i < chunk->cacheCount; i++) {
+        InlineCache *cache = &chunk->caches[i];
+        mark_object((Obj *)cache->name);
+
+        for (int j = 0; j < cache->count; j++) {
+            mark_object((Obj *)cache->entries[j].shape);
+            mark_object((Obj *)cache->entries[j].transition);
+            mark_value(cache->entries[j].method);
+        }
+    }
+}
+// the stacks of a fiber the VM does not run
+static void mark_stacks(FiberStacks *stacks) {
+    // open upvalues store into them
+    for (Value *slot = stacks->stack; slot < stacks->stackTop; slot++) {
+        mark_value(gcLoadValue(slot));
+    }
+
+    for (int i = 0; i < stacks->frameCount; i++) {
+        mark_object((Obj *)stacks->frames[i].closure);
+    }
+
+    for (ObjUpvalue *upvalue = stacks->openUpvalues; upvalue != NULL;
+         upvalue = upvalue->next) {
+        mark_object((Obj *)upvalue);
+    }
+}
 static void blacken_object(Obj *obj) {
 #ifdef DEBUG_LOG_GC
     fprintf(stderr, "%p blacken ", (void *)obj);
@@ -169,14 +1175,23 @@ static void blacken_object(Obj *obj) {
     switch (obj->type) {
     case OBJ_STRING:
     case OBJ_NATIVE:
+    case OBJ_CHANNEL:
         break;
-    case OBJ_UPVALUE:
-        mark_value(((ObjUpvalue *)obj)->closed);
+    case OBJ_UPVALUE: {
+        // an open one reads the stack of its fiber, which has to stay around
+        // even once nothing else can resume it
+        ObjUpvalue *upvalue = (ObjUpvalue *)obj;
+        if (gcLoad(&upvalue->location) != &upvalue->closed) {
+            mark_object((Obj *)upvalue->fiber);
+        }
+        mark_value(gcLoadValue(&upvalue->closed));
         break;
+    }
     case OBJ_FUNC: {
         ObjFunction *func = (ObjFunction *)obj;
-        mark_object((Obj *)func->name);
+        mark_object((Obj *)gcLoad(&func->name));
         mark_array(&func->chunk.constants);
+        mark_caches(&func->chunk);
         break;
     }
     case OBJ_CLOSURE: {
@@ -184,7 +1199,7 @@ static void blacken_object(Obj *obj) {
         mark_object((Obj *)closure->func);
 
         for (int i = 0; i < closure->upvalueCount; i++) {
-            mark_object((Obj *)closure->upvalues[i]);
+            mark_object((Obj *)gcLoad(&closure->upvalues[i]));
         }
         break;
     }
@@ -192,12 +1207,25 @@ static void blacken_object(Obj *obj) {
         ObjClass *klass = (ObjClass *)obj;
         mark_object((Obj *)klass->name);
         mark_table(&klass->methods);
+        mark_object((Obj *)gcLoad(&klass->rootShape));
         break;
     }
     case OBJ_INSTANCE: {
         ObjInstance *inst = (ObjInstance *)obj;
+        // the fields up to those of the shape are stored by the time it is
+        ObjShape *shape = gcLoad(&inst->shape);
         mark_object((Obj *)inst->klass);
-        mark_table(&inst->fields);
+        mark_object((Obj *)shape);
+        for (int i = 0; i < shape->fieldCount; i++) {
+            mark_value(gcLoadValue(&inst->fields[i]));
+        }
+        break;
+    }
+    case OBJ_SHAPE: {
+        ObjShape *shape = (ObjShape *)obj;
+        mark_object((Obj *)shape->parent);
+        mark_object((Obj *)shape->name);
+        mark_table(&shape->transitions);
         break;
     }
     case OBJ_BOUND_METHOD: {
@@ -206,56 +1234,83 @@ static void blacken_object(Obj *obj) {
         mark_object((Obj *)bound->method);
         break;
     }
+    case OBJ_FIBER: {
+        ObjFiber *fiber = (ObjFiber *)obj;
+        mark_object((Obj *)fiber->closure);
+        mark_object((Obj *)gcLoad(&fiber->caller));
+        mark_stacks(&fiber->stacks);
+        break;
+    }
     }
 }
 
 static void mark_roots() {
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+    for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
         mark_value(*slot);
     }
 
-    for (int i = 0; i < vm.frameCount; i++) {
-        mark_object((Obj *)vm.frames[i].closure);
+    for (int i = 0; i < vm->frameCount; i++) {
+        mark_object((Obj *)vm->frames[i].closure);
     }
 
-    for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL;
+    for (ObjUpvalue *upvalue = vm->openUpvalues; upvalue != NULL;
          upvalue = upvalue->next) {
         mark_object((Obj *)upvalue);
     }
 
-    mark_table(&vm.globals);
+    // The stacks above are those of the running fiber. Those of the fibers
+    // waiting on it are found through its caller, and the main fiber's stay
+    // in the VM.
+    mark_object((Obj *)vm->fiber);
+    if (vm->fiber != NULL) {
+        mark_stacks(&vm->mainStacks);
+    }
+
+    // global names are the keys of `slots`
+    mark_table(&vm->globals.slots);
+    for (int i = 0; i < vm->globals.count; i++) {
+        mark_value(vm->globals.values[i]);
+    }
     mark_compiler_roots();
-    mark_object((Obj *)vm.initString);
+    mark_object((Obj *)vm->initString);
 }
 
 static void trace_references() {
-    while (vm.grayCount > 0) {
-        Obj *obj = vm.grayStack[--vm.grayCount];
+    if (vm->gcThreads > 1) {
+        trace_parallel();
+        return;
+    }
+
+    while (vm->grayCount > 0) {
+        Obj *obj = vm->grayStack[--vm->grayCount];
         blacken_object(obj);
     }
 }
 
-static void sweep() {
-    // walk the objects list freeing the white objects
-    Obj *prev = NULL;
-    Obj *obj = vm.objects;
-
-    while (obj != NULL) {
-        if (obj->marked) {
-            obj->marked = false;
-            prev = obj;
-            obj = obj->next;
-        } else {
-            Obj *unreached = obj;
-            obj = obj->next;
+static void free_unreached(Obj *unreached) {
+    vm->bytesAllocated -= pageOf(unreached)->cellSize;
 
-            if (prev != NULL) {
-                prev->next = obj;
-            } else {
-                vm.objects = obj;
-            }
+    // interned strings are weak, a dead one leaves the table
+    if (unreached->type == OBJ_STRING) {
+        tableDelete(&vm->strings, (ObjString *)unreached);
+    }
+    free_object(unreached);
+}
 
-            free_object(unreached);
+// frees the unreached young objects and makes the others old
+static void sweep_young() {
+    Page *page = vm->heap->young;
+    while (page != NULL) {
+        Page *next = page->nextYoung;
+        page->young = false;
+        sweep_page(page);
+        if (page->sizeClass == SIZE_CLASSES && page->live == 0) {
+            // a large object's page is of no use to any other
+            free_page(&vm->heap->classes[SIZE_CLASSES], page);
+        } else {
+            make_available(page);
         }
+        page = next;
     }
+    vm->heap->young = NULL;
 }
@@ -2,24 +2,124 @@
 #define CLOX_MEMORY_H
 
 #include "common.h"
+#include "object.h"
 #include "value.h"
+#include "vm.h"
 
 #define GROW_CAPACITY(cap) ((cap) < 8 ? 8 : (cap)*2)
 
 #define GROW_ARRAY(type, ptr, old_count, new_count)                            \
-    (type *)mem_reallocate(ptr, sizeof(type) * old_count,                      \
-                           sizeof(type) * new_count)
+    (type *)mem_reallocate(ptr, sizeof(type) * (old_count),                    \
+                           sizeof(type) * (new_count))
 
 #define FREE_ARRAY(type, ptr, old_count)                                       \
-    mem_reallocate(ptr, sizeof(type) * old_count, 0)
+    mem_reallocate(ptr, sizeof(type) * (old_count), 0)
 
 #define FREE(type, ptr) mem_reallocate(ptr, sizeof(type), 0)
 
 void *mem_reallocate(void *pointer, size_t old_size, size_t new_size);
+struct Heap *heapNew();
+// memory for a new object of `size` bytes, in the VM's heap
+void *heapAllocate(size_t size);
 void freeObjects();
 
+/* Objects live in pages of GC_PAGE_SIZE bytes, aligned to it, each of them
+ * cut into cells of one size. Their mark bits are kept on the side, one per
+ * GC_GRANULE bytes of the page, so that sweeping scans bitmaps instead of
+ * objects. See memory.c. */
+#define GC_PAGE_SIZE (32 * 1024)
+#define GC_GRANULE 16
+#define GC_PAGE_WORDS (GC_PAGE_SIZE / GC_GRANULE / 64)
+
+typedef struct Page {
+    uint64_t marks[GC_PAGE_WORDS];     // reached, and kept set on old objects
+    uint64_t allocated[GC_PAGE_WORDS]; // holding an object
+    struct Page *next;                 // in its size class
+    struct Page *prev;
+    struct Page *nextAvailable;        // with free cells, in its size class
+    struct Page *nextYoung;            // allocated from since the last GC
+    void *freeCells;                   // linked through their first word
+    char *bump;                        // the cells never allocated start here
+    char *end;
+    size_t cellSize;
+    int sizeClass;
+    int live;           // objects in the page
+    unsigned epoch;     // of the last sweep it went through
+    bool available;     // on the list of its size class
+    bool young;         // on the young list
+} Page;
+
 void mark_object(Obj *obj);
 void mark_value(Value value);
+// a full collection
 void collectGarbage();
+// a minor collection, of the objects allocated since the last collection
+void collectYoung();
+
+// Records `obj` for the next minor collection to trace, if it is old, or
+// for the end of marking to trace again while a background marker runs.
+void gcRemember(Obj *obj);
+
+/* While a background marker runs, structural changes to what it may be
+ * reading, like swapping a grown array into an object, go between these.
+ * They nest, and a collection does not change phase in between. */
+void gcLockHeap();
+void gcUnlockHeap();
+
+/* What the background marker reads of an object, the program stores with
+ * these once the object may be reachable, and the marker loads it back with
+ * gcLoad(). A release store also publishes everything written before it,
+ * so the marker never sees a reference ahead of what it refers to, nor a new
+ * shape ahead of its field. Each is a single word, which a Value only is with
+ * NaN boxing: without it, marking never runs concurrently and Values are
+ * stored as usual. */
+#define gcStore(slot, val) __atomic_store_n((slot), (val), __ATOMIC_RELEASE)
+#define gcLoad(slot)       __atomic_load_n((slot), __ATOMIC_ACQUIRE)
+#ifdef NAN_BOXING
+#define gcStoreValue(slot, val) gcStore(slot, val)
+#define gcLoadValue(slot)       gcLoad(slot)
+#define GC_CAN_MARK_CONCURRENTLY true
+#else
+#define gcStoreValue(slot, val) ((void)(*(slot) = (val)))
+#define gcLoadValue(slot)       (*(slot))
+#define GC_CAN_MARK_CONCURRENTLY false
+#endif
+
+static inline Page *pageOf(Obj *obj) {
+    return (Page *)((uintptr_t)obj & ~(uintptr_t)(GC_PAGE_SIZE - 1));
+}
+
+// Whether the collection under way reached `obj`; between collections,
+// whether it is old. Marking threads set mark bits while the program reads
+// them, and words of them are shared between objects.
+static inline bool isMarked(Obj *obj) {
+    size_t granule = (uintptr_t)obj % GC_PAGE_SIZE / GC_GRANULE;
+    uint64_t word =
+        __atomic_load_n(&pageOf(obj)->marks[granule / 64], __ATOMIC_RELAXED);
+    return (word >> (granule % 64)) & 1;
+}
+
+// Marks `obj`. Returns whether it already was.
+static inline bool setMarked(Obj *obj) {
+    size_t granule = (uintptr_t)obj % GC_PAGE_SIZE / GC_GRANULE;
+    uint64_t bit = (uint64_t)1 << (granule % 64);
+    return __atomic_fetch_or(&pageOf(obj)->marks[granule / 64], bit,
+                             __ATOMIC_RELAXED) &
+           bit;
+}
+
+/* Minor collections only trace what is reachable from the roots and from
+ * the old objects recorded since the last collection, so a reference to a
+ * young object stored into an object that may be old has to go through this
+ * barrier. Objects being initialized right after they got allocated are
+ * young and need none. While a background marker runs, any object written
+ * gets recorded, whatever the marker made of it so far. */
+static inline void writeBarrier(Obj *owner, Value val) {
+    if (!owner->remembered &&
+        (vm->markingConcurrently ||
+         (isMarked(owner) && IS_OBJ(val) && !isMarked(AS_OBJ(val))))) {
+        gcRemember(owner);
+    }
+}
 
 #endif
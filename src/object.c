@@ -8,12 +8,9 @@
 #include "vm.h"
 
 static Obj *allocate_object(size_t size, ObjType type) {
-    Obj *obj = (Obj *)mem_reallocate(NULL, 0, size);
+    Obj *obj = (Obj *)heapAllocate(size);
     obj->type = type;
-    obj->marked = false;
-
-    obj->next = vm.objects;
-    vm.objects = obj;
+    obj->remembered = false;
 
 #ifdef DEBUG_LOG_GC
     fprintf(stderr, "%p allocate %zu bytes for type %d\n", (void *)obj, size,
@@ -32,7 +29,7 @@ static ObjString *allocate_string(char *chars, int len, uint32_t hash) {
 
     // We intern all strings to deduplicate them
     push(OBJ_VAL(str));
-    tableSet(&vm.strings, str, NIL_VAL); // using a hash set
+    tableSet(&vm->strings, str, NIL_VAL); // using a hash set
     pop();
 
     return str;
@@ -56,7 +53,11 @@ ObjFunction *newFunction() {
 
     func->arity = 0;
     func->upvalueCount = 0;
+    func->maxSlots = 0;
     func->name = NULL;
+    func->hotness = 0;
+    func->jit = NULL;
+    func->traces = NULL;
     initChunk(&func->chunk);
 
     return func;
@@ -80,22 +81,103 @@ ObjClosure *newClosure(ObjFunction *func) {
     return closure;
 }
 
+static ObjShape *new_shape(ObjShape *parent, ObjString *name) {
+    ObjShape *shape = (ObjShape *)allocate_object(sizeof(ObjShape), OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->fieldCount = parent != NULL ? parent->fieldCount + 1 : 0;
+    initTable(&shape->transitions);
+
+    return shape;
+}
+
 ObjClass *newClass(ObjString *name) {
     ObjClass *klass = (ObjClass *)allocate_object(sizeof(ObjClass), OBJ_CLASS);
     klass->name = name;
+    klass->rootShape = NULL;
+    klass->fieldHint = 0;
     initTable(&klass->methods);
+
+    push(OBJ_VAL(klass));
+    gcStore(&klass->rootShape, new_shape(NULL, NULL));
+    writeBarrier(&klass->obj, OBJ_VAL(klass->rootShape));
+    pop();
+
     return klass;
 }
 
 ObjInstance *newInstance(ObjClass *klass) {
-    ObjInstance *inst =
-        (ObjInstance *)allocate_object(sizeof(ObjInstance), OBJ_INSTANCE);
+    int capacity = klass->fieldHint;
+    ObjInstance *inst = (ObjInstance *)allocate_object(
+        sizeof(ObjInstance) + sizeof(Value) * capacity, OBJ_INSTANCE);
     inst->klass = klass;
-    initTable(&inst->fields);
+    inst->shape = klass->rootShape;
+    inst->fields = inst->inlineFields;
+    inst->fieldCapacity = capacity;
+    // a background marker may read a slot before the field is stored
+    for (int i = 0; i < capacity; i++) {
+        inst->fields[i] = NIL_VAL;
+    }
 
     return inst;
 }
 
+int shapeSlot(ObjShape *shape, ObjString *name) {
+    for (; shape->name != NULL; shape = shape->parent) {
+        if (shape->name == name)
+            return shape->fieldCount - 1;
+    }
+
+    return -1;
+}
+
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name) {
+    Value next;
+    if (tableGet(&shape->transitions, name, &next))
+        return AS_SHAPE(next);
+
+    ObjShape *child = new_shape(shape, name);
+    push(OBJ_VAL(child));
+    tableSet(&shape->transitions, name, OBJ_VAL(child));
+    writeBarrier(&shape->obj, OBJ_VAL(name));
+    writeBarrier(&shape->obj, OBJ_VAL(child));
+    pop();
+
+    return child;
+}
+
+void instanceAddField(ObjInstance *inst, ObjShape *next, Value val) {
+    int slot = next->fieldCount - 1;
+    if (slot >= inst->fieldCapacity) {
+        int old_cap = inst->fieldCapacity;
+        int capacity = GROW_CAPACITY(old_cap);
+        Value *fields = GROW_ARRAY(Value, NULL, 0, capacity);
+        for (int i = 0; i < capacity; i++) {
+            fields[i] = i < inst->shape->fieldCount ? inst->fields[i] : NIL_VAL;
+        }
+
+        gcLockHeap();
+        if (inst->fields != inst->inlineFields) {
+            FREE_ARRAY(Value, inst->fields, old_cap);
+        }
+        inst->fields = fields;
+        inst->fieldCapacity = capacity;
+        gcUnlockHeap();
+    }
+
+    // the field goes in ahead of the shape a background marker reads it by
+    gcStoreValue(&inst->fields[slot], val);
+    gcStore(&inst->shape, next);
+    writeBarrier(&inst->obj, val);
+    writeBarrier(&inst->obj, OBJ_VAL(next));
+
+    ObjClass *klass = inst->klass;
+    if (next->fieldCount > klass->fieldHint &&
+        next->fieldCount <= INSTANCE_INLINE_MAX) {
+        klass->fieldHint = next->fieldCount;
+    }
+}
+
 ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method) {
     ObjBoundMethod *bound = (ObjBoundMethod *)allocate_object(
         sizeof(ObjBoundMethod), OBJ_BOUND_METHOD);
@@ -111,6 +193,7 @@ ObjUpvalue *newUpvalue(Value *slot) {
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
     upvalue->next = NULL;
+    upvalue->fiber = NULL;
     return upvalue;
 }
 
@@ -123,9 +206,41 @@ ObjNativeFunc *newNative(NativeFn func) {
     return native;
 }
 
+ObjChannel *newChannel(struct Channel *channel) {
+    ObjChannel *obj =
+        (ObjChannel *)allocate_object(sizeof(ObjChannel), OBJ_CHANNEL);
+    obj->channel = channel;
+    return obj;
+}
+
+ObjFiber *newFiber(ObjClosure *closure) {
+    // room for the closure and its argument, the call grows it from there
+    Value *stack = GROW_ARRAY(Value, NULL, 0, 2);
+    ObjFiber *fiber = (ObjFiber *)allocate_object(sizeof(ObjFiber), OBJ_FIBER);
+    fiber->state = FIBER_NEW;
+    fiber->closure = closure;
+    fiber->caller = NULL;
+    fiber->stacks = (FiberStacks){
+        .stack = stack, .stackTop = stack + 1, .stackCapacity = 2};
+    stack[0] = OBJ_VAL(closure);
+    return fiber;
+}
+
+// A string a major collection found unreachable stays interned until the
+// sweep gets to it, so one found in the meantime is brought back.
+static ObjString *find_interned(const char *chars, int len, uint32_t hash) {
+    ObjString *interned = tableFindString(&vm->strings, chars, len, hash);
+    if (interned != NULL && vm->gcPhase == GC_SWEEP &&
+        !isMarked(&interned->obj)) {
+        setMarked(&interned->obj);
+    }
+
+    return interned;
+}
+
 ObjString *takeString(char *chars, int len) {
     uint32_t hash = hash_string(chars, len);
-    ObjString *interned = tableFindString(&vm.strings, chars, len, hash);
+    ObjString *interned = find_interned(chars, len, hash);
     if (interned != NULL) {
         FREE_ARRAY(char, chars, len + 1);
         return interned;
@@ -136,7 +251,7 @@ ObjString *takeString(char *chars, int len) {
 
 ObjString *copyString(const char *chars, int len) {
     uint32_t hash = hash_string(chars, len);
-    ObjString *interned = tableFindString(&vm.strings, chars, len, hash);
+    ObjString *interned = find_interned(chars, len, hash);
     if (interned != NULL)
         return interned;
 
@@ -185,5 +300,14 @@ void printObject(Value val) {
     case OBJ_BOUND_METHOD:
         print_func(AS_BOUND_METHOD(val)->method->func);
         break;
+    case OBJ_SHAPE:
+        fputs("<shape>", stdout);
+        break;
+    case OBJ_CHANNEL:
+        fputs("<channel>", stdout);
+        break;
+    case OBJ_FIBER:
+        fputs("<fiber>", stdout);
+        break;
     }
 }
@@ -14,6 +14,9 @@
 #define IS_CLASS(obj)        is_obj_type(obj, OBJ_CLASS)
 #define IS_INSTANCE(obj)     is_obj_type(obj, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(obj) is_obj_type(obj, OBJ_BOUND_METHOD)
+#define IS_SHAPE(obj)        is_obj_type(obj, OBJ_SHAPE)
+#define IS_CHANNEL(obj)      is_obj_type(obj, OBJ_CHANNEL)
+#define IS_FIBER(obj)        is_obj_type(obj, OBJ_FIBER)
 
 #define AS_STRING(val)       ((ObjString *)AS_OBJ(val))
 #define AS_CSTRING(val)      (((ObjString *)AS_OBJ(val))->chars)
@@ -23,6 +26,9 @@
 #define AS_CLASS(val)        ((ObjClass *)AS_OBJ(val))
 #define AS_INSTANCE(val)     ((ObjInstance *)AS_OBJ(val))
 #define AS_BOUND_METHOD(val) ((ObjBoundMethod *)AS_OBJ(val))
+#define AS_SHAPE(val)        ((ObjShape *)AS_OBJ(val))
+#define AS_CHANNEL(val)      ((ObjChannel *)AS_OBJ(val))
+#define AS_FIBER(val)        ((ObjFiber *)AS_OBJ(val))
 
 typedef enum {
     OBJ_STRING,
@@ -33,12 +39,15 @@ typedef enum {
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
+    OBJ_SHAPE,
+    OBJ_CHANNEL,
+    OBJ_FIBER,
 } ObjType;
 
+// Mark bits are kept in the object's page, see memory.h.
 struct Obj {
     ObjType type;
-    bool marked;
-    struct Obj *next;
+    bool remembered; // in vm->remembered
 };
 
 struct ObjString {
@@ -48,12 +57,19 @@ struct ObjString {
     uint32_t hash;
 };
 
+struct JitCode;
+struct Trace;
+
 typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
+    int maxSlots; // stack its frame needs, temporaries included
     Chunk chunk;
     ObjString *name;
+    int hotness;          // calls and loop back edges, see JIT_THRESHOLD
+    struct JitCode *jit;  // native code once the function got hot
+    struct Trace *traces; // its loops, see trace.h
 } ObjFunction;
 
 typedef struct ObjUpvalue {
@@ -61,6 +77,8 @@ typedef struct ObjUpvalue {
     Value *location;
     Value closed;
     struct ObjUpvalue *next;
+    // the fiber whose stack it points into while open, NULL for the main one
+    struct ObjFiber *fiber;
 } ObjUpvalue;
 
 typedef struct {
@@ -70,16 +88,41 @@ typedef struct {
     int upvalueCount;
 } ObjClosure;
 
+/* A shape (hidden class) describes the field layout shared by every instance
+ * that added the same fields in the same order. Each shape records the field
+ * it appended to its parent, so the slot of a name is found by walking up the
+ * chain. `transitions` maps a field name to the child shape that adds it, so
+ * instances growing the same way end up on the same shape. Every class owns
+ * the root (empty) shape of its tree. */
+typedef struct ObjShape {
+    Obj obj;
+    struct ObjShape *parent;
+    ObjString *name; // NULL at the root
+    int fieldCount;
+    Table transitions;
+} ObjShape;
+
 typedef struct {
     Obj obj;
     ObjString *name;
     Table methods;
+    ObjShape *rootShape;
+    // largest layout seen so far, used to size new instances up front
+    int fieldHint;
 } ObjClass;
 
+// cap on the number of fields allocated inline with an instance
+#define INSTANCE_INLINE_MAX 16
+
 typedef struct {
     Obj obj;
     ObjClass *klass;
-    Table fields;
+    ObjShape *shape;
+    // field values indexed by slot; points at inlineFields until the layout
+    // outgrows the inline capacity chosen at allocation
+    Value *fields;
+    int fieldCapacity;
+    Value inlineFields[];
 } ObjInstance;
 
 typedef struct {
@@ -95,6 +138,45 @@ typedef struct {
     NativeFn func;
 } ObjNativeFunc;
 
+struct Channel;
+
+// a VM's handle on a channel, holding a reference to it, see channel.h
+typedef struct {
+    Obj obj;
+    struct Channel *channel;
+} ObjChannel;
+
+struct CallFrame;
+
+// The call and value stacks of a fiber and its open upvalues. The VM holds
+// those of the fiber it runs, see vm.h.
+typedef struct {
+    struct CallFrame *frames;
+    int frameCount;
+    int frameCapacity;
+    Value *stack;
+    Value *stackTop;
+    int stackCapacity;
+    ObjUpvalue *openUpvalues;
+} FiberStacks;
+
+typedef enum {
+    FIBER_NEW,       // not resumed yet
+    FIBER_SUSPENDED, // in yield()
+    FIBER_RUNNING,   // running, or waiting for a fiber it resumed
+    FIBER_DONE,      // returned, or ended by a runtime error
+} FiberState;
+
+/* A function running on stacks of its own, which can stop halfway with
+ * yield() and pick up from there on the next resume(). */
+typedef struct ObjFiber {
+    Obj obj;
+    FiberState state;
+    ObjClosure *closure;
+    struct ObjFiber *caller; // the fiber that resumed it, while it runs
+    FiberStacks stacks;      // empty while it runs and once it is done
+} ObjFiber;
+
 static inline bool is_obj_type(Value val, ObjType type) {
     return IS_OBJ(val) && AS_OBJ(val)->type == type;
 }
@@ -105,8 +187,20 @@ ObjClass *newClass(ObjString *name);
 ObjInstance *newInstance(ObjClass *klass);
 ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method);
 
+// slot of `name` in the layout, or -1 if the layout has no such field
+int shapeSlot(ObjShape *shape, ObjString *name);
+// layout reached by appending `name` to `shape`, created on first use
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name);
+// moves `inst` to `next` (a transition of its shape), storing `val` in the
+// new slot
+void instanceAddField(ObjInstance *inst, ObjShape *next, Value val);
+
 ObjUpvalue *newUpvalue(Value *slot);
 ObjNativeFunc *newNative(NativeFn func);
+// takes over a reference to `channel`
+ObjChannel *newChannel(struct Channel *channel);
+// a fiber that is to call `closure`, which takes at most one argument
+ObjFiber *newFiber(ObjClosure *closure);
 
 ObjString *takeString(char *chars, int len);
 ObjString *copyString(const char *chars, int len);
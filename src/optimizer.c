@@ -0,0 +1,505 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "optimizer.h"
+
+/* The chunk is decoded into a list of instructions, rewritten until nothing
+ * changes and encoded back in place. A jump refers to the index of the
+ * instruction it lands on, so deleting instructions never breaks it: a jump
+ * to a deleted instruction lands on the next live one instead, and every
+ * deletion below is only done where that is equivalent. */
+
+typedef struct {
+    int offset; // in the original code
+    int len;
+    int target; // index of the instruction jumped to, -1 if not a jump
+    bool live;
+} Inst;
+
+typedef struct {
+    Chunk *chunk;
+    Inst *insts; // insts[count] is a live sentinel marking the end
+    int count;
+    int *targets; // number of live jumps landing on each instruction
+} Code;
+
+static inline uint8_t op_at(Code *code, int i) {
+    return code->chunk->code[code->insts[i].offset];
+}
+static inline bool is_jump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE ||
+           op == OP_POP_JUMP_IF_FALSE || op == OP_LOOP;
+}
+// control never falls through to the next instruction
+static inline bool is_exit(uint8_t op) {
+    return op == OP_JUMP || op == OP_LOOP || op == OP_RETURN;
+}
+// pushes a value without side effects, so it can go together with a POP
+static inline bool is_pure_push(uint8_t op) {
+    switch (op) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+    case OP_GET_UPVALUE:
+    case OP_GET_UPVALUE_LONG:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// first live instruction at or after `i`
+static inline int resolve(Code *code, int i) {
+    while (!code->insts[i].live)
+        i++;
+    return i;
+}
+static inline int next_live(Code *code, int i) { return resolve(code, i + 1); }
+
+// deletes instruction `i`; whatever jumped to it now lands on the next one
+static void kill(Code *code, int i) {
+    code->insts[i].live = false;
+    code->targets[next_live(code, i)] += code->targets[i];
+    code->targets[i] = 0;
+}
+
+static void decode(Code *code, Chunk *chunk) {
+    int len = (int)chunk->len;
+    int count = 0;
+    for (int offset = 0; offset < len; offset += instructionLen(chunk, offset))
+        count++;
+
+    code->chunk = chunk;
+    code->count = count;
+    code->insts = GROW_ARRAY(Inst, NULL, 0, count + 1);
+    code->targets = GROW_ARRAY(int, NULL, 0, count + 1);
+
+    int *index_of = GROW_ARRAY(int, NULL, 0, len + 1);
+    int offset = 0;
+    for (int i = 0; i <= count; i++) {
+        Inst *inst = &code->insts[i];
+        inst->offset = offset;
+        inst->len = i < count ? instructionLen(chunk, offset) : 0;
+        inst->target = -1;
+        inst->live = true;
+        index_of[offset] = i;
+        offset += inst->len;
+    }
+
+    for (int i = 0; i < count; i++) {
+        Inst *inst = &code->insts[i];
+        uint8_t op = chunk->code[inst->offset];
+        if (!is_jump(op))
+            continue;
+
+        int dist = (chunk->code[inst->offset + 1] << 8) |
+                   chunk->code[inst->offset + 2];
+        int after = inst->offset + 3;
+        inst->target = index_of[op == OP_LOOP ? after - dist : after + dist];
+    }
+
+    FREE_ARRAY(int, index_of, len + 1);
+}
+
+static void mark_targets(Code *code) {
+    memset(code->targets, 0, sizeof(int) * (code->count + 1));
+    for (int i = 0; i < code->count; i++) {
+        if (code->insts[i].live && code->insts[i].target >= 0) {
+            code->targets[resolve(code, code->insts[i].target)]++;
+        }
+    }
+}
+
+/* A jump landing on an unconditional jump can go straight to its target.
+ * So can a JUMP_IF_FALSE landing on another one, since the value it tested
+ * is still on the stack. Conditional jumps have no backward form, and no
+ * jump may grow past a 16-bit offset (the layout only shrinks, so checking
+ * against the original offsets is enough). */
+static bool thread_jumps(Code *code) {
+    bool changed = false;
+    for (int i = 0; i < code->count; i++) {
+        Inst *inst = &code->insts[i];
+        if (!inst->live || inst->target < 0)
+            continue;
+
+        uint8_t src = op_at(code, i);
+        bool conditional =
+            src == OP_JUMP_IF_FALSE || src == OP_POP_JUMP_IF_FALSE;
+        int first = resolve(code, inst->target);
+        int t = first;
+        for (int hops = 0; hops < code->count && t < code->count; hops++) {
+            uint8_t op = op_at(code, t);
+            if (!(op == OP_JUMP || op == OP_LOOP ||
+                  (src == OP_JUMP_IF_FALSE && op == OP_JUMP_IF_FALSE)))
+                break;
+
+            int next = resolve(code, code->insts[t].target);
+            if (next == t || (conditional && next <= i) ||
+                abs(code->insts[next].offset - inst->offset) > UINT16_MAX)
+                break;
+            t = next;
+        }
+
+        if (t != first) {
+            inst->target = t;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+// code after an unconditional jump or return that nothing jumps to
+static bool remove_dead_code(Code *code) {
+    bool changed = false;
+    bool reachable = true;
+    for (int i = 0; i < code->count; i++) {
+        Inst *inst = &code->insts[i];
+        if (!inst->live)
+            continue;
+
+        if (!reachable && code->targets[i] == 0) {
+            kill(code, i);
+            changed = true;
+            continue;
+        }
+
+        reachable = !is_exit(op_at(code, i));
+    }
+
+    return changed;
+}
+
+// a value pushed only to be popped, e.g. an expression statement `x;`
+static bool remove_push_pop(Code *code) {
+    bool changed = false;
+    for (int i = 0; i < code->count; i++) {
+        if (!code->insts[i].live || !is_pure_push(op_at(code, i)))
+            continue;
+
+        int next = next_live(code, i);
+        if (next < code->count && op_at(code, next) == OP_POP &&
+            code->targets[next] == 0) {
+            kill(code, i);
+            kill(code, next);
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+// jumps to the next instruction, left over from the rewrites above or from
+// an `if` without an else
+static bool remove_jump_to_next(Code *code) {
+    bool changed = false;
+    for (int i = 0; i < code->count; i++) {
+        Inst *inst = &code->insts[i];
+        uint8_t op = op_at(code, i);
+        if (!inst->live || (op != OP_JUMP && op != OP_JUMP_IF_FALSE))
+            continue;
+
+        if (resolve(code, inst->target) == next_live(code, i)) {
+            kill(code, i);
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+/* Conditions of `if`, `while` and `for` compile to
+ *
+ *     JUMP_IF_FALSE else; POP; ...; <exit>; else: POP
+ *
+ * where both POPs discard the condition. When nothing else reaches either
+ * POP, a single POP_JUMP_IF_FALSE does the same with one dispatch less. */
+static bool fuse_condition_pops(Code *code) {
+    bool changed = false;
+    for (int i = 0; i < code->count; i++) {
+        Inst *inst = &code->insts[i];
+        if (!inst->live || op_at(code, i) != OP_JUMP_IF_FALSE)
+            continue;
+
+        int then_pop = next_live(code, i);
+        int else_pop = resolve(code, inst->target);
+        if (then_pop == code->count || else_pop == code->count ||
+            op_at(code, then_pop) != OP_POP || code->targets[then_pop] != 0 ||
+            op_at(code, else_pop) != OP_POP || code->targets[else_pop] != 1 ||
+            else_pop <= then_pop)
+            continue;
+
+        // the else POP must not be reachable by falling into it
+        int prev = else_pop - 1;
+        while (!code->insts[prev].live)
+            prev--;
+        if (!is_exit(op_at(code, prev)))
+            continue;
+
+        code->chunk->code[inst->offset] = OP_POP_JUMP_IF_FALSE;
+        kill(code, then_pop);
+        kill(code, else_pop);
+        inst->target = next_live(code, else_pop);
+        changed = true;
+    }
+
+    return changed;
+}
+
+// Pairs that are frequent enough in hot loops to be worth an opcode. The
+// fused instruction takes the operands of both, so it is one byte shorter.
+static const struct {
+    uint8_t first;
+    uint8_t second;
+    uint8_t fused;
+} superinstructions[] = {
+    {OP_GET_LOCAL, OP_GET_LOCAL, OP_GET_LOCAL_GET_LOCAL},
+    {OP_GET_LOCAL, OP_CONSTANT, OP_GET_LOCAL_CONSTANT},
+    {OP_GET_LOCAL, OP_GET_PROPERTY, OP_GET_LOCAL_PROPERTY},
+    {OP_SET_LOCAL, OP_POP, OP_SET_LOCAL_POP},
+    {OP_LESS, OP_POP_JUMP_IF_FALSE, OP_LESS_JUMP_IF_FALSE},
+};
+
+static int find_superinstruction(uint8_t first, uint8_t second) {
+    int count = sizeof(superinstructions) / sizeof(superinstructions[0]);
+    for (int i = 0; i < count; i++) {
+        if (superinstructions[i].first == first &&
+            superinstructions[i].second == second)
+            return superinstructions[i].fused;
+    }
+
+    return -1;
+}
+
+// Fills `seq` with instruction `i` and the `n - 1` live ones after it, none
+// of which may be a jump target.
+static bool collect(Code *code, int i, int *seq, int n) {
+    seq[0] = i;
+    for (int j = 1; j < n; j++) {
+        seq[j] = next_live(code, seq[j - 1]);
+        if (seq[j] == code->count || code->targets[seq[j]] != 0)
+            return false;
+    }
+
+    return true;
+}
+
+/* Replaces the instructions in `seq` by the single one in `bytes`, which must
+ * be no longer than they are together. If one of them was a jump, the new
+ * instruction takes over its target and ends with the 16-bit offset. */
+static void replace(Code *code, const int *seq, int n, const uint8_t *bytes,
+                    const int *lines, int len) {
+    Chunk *chunk = code->chunk;
+    Inst *inst = &code->insts[seq[0]];
+
+    // only dead code lies between them, so their bytes have room
+    memcpy(chunk->code + inst->offset, bytes, len);
+    memcpy(chunk->lines + inst->offset, lines, sizeof(int) * len);
+    inst->len = len;
+    for (int j = 1; j < n; j++) {
+        if (code->insts[seq[j]].target >= 0)
+            inst->target = code->insts[seq[j]].target;
+        kill(code, seq[j]);
+    }
+}
+
+/* Runs once the other rewrites are done, since they only know the plain
+ * opcodes. Each operand byte keeps the line of the instruction it came from,
+ * which is the one whose error it can raise. */
+static void fuse_superinstructions(Code *code) {
+    Chunk *chunk = code->chunk;
+    for (int i = 0; i < code->count; i++) {
+        int seq[2];
+        if (!code->insts[i].live || !collect(code, i, seq, 2))
+            continue;
+
+        int fused = find_superinstruction(op_at(code, i), op_at(code, seq[1]));
+        if (fused < 0)
+            continue;
+
+        uint8_t bytes[8];
+        int lines[8];
+        int len = 0;
+        bytes[len] = (uint8_t)fused;
+        lines[len++] = chunk->lines[code->insts[i].offset];
+        for (int j = 0; j < 2; j++) {
+            Inst *inst = &code->insts[seq[j]];
+            for (int k = 1; k < inst->len; k++, len++) {
+                bytes[len] = chunk->code[inst->offset + k];
+                lines[len] = chunk->lines[inst->offset + k];
+            }
+        }
+
+        replace(code, seq, 2, bytes, lines, len);
+    }
+}
+
+static const struct {
+    uint8_t op;
+    uint8_t rr; // both operands in slots
+    uint8_t rk; // right operand a constant
+} register_ops[] = {
+    {OP_ADD, OP_ADD_RR, OP_ADD_RK},
+    {OP_SUBTRACT, OP_SUBTRACT_RR, OP_SUBTRACT_RK},
+    {OP_MULTIPLY, OP_MULTIPLY_RR, OP_MULTIPLY_RK},
+    {OP_DIVIDE, OP_DIVIDE_RR, OP_DIVIDE_RK},
+    {OP_LESS, OP_LESS_RR_JUMP, OP_LESS_RK_JUMP},
+};
+
+static int find_register_op(uint8_t op, bool constant) {
+    int count = sizeof(register_ops) / sizeof(register_ops[0]);
+    for (int i = 0; i < count; i++) {
+        if (register_ops[i].op == op)
+            return constant ? register_ops[i].rk : register_ops[i].rr;
+    }
+
+    return -1;
+}
+
+/* Three-address superinstructions for --registers. This is not a register
+ * VM: only the two patterns below get fused, with one-byte slots, and they
+ * run in the same loop as the stack code around them. Arithmetic between
+ * locals and constants whose result goes straight into a local,
+ *
+ *     GET_LOCAL b; GET_LOCAL c (or CONSTANT k); ADD; SET_LOCAL a; POP
+ *
+ * becomes ADD_RR a b c (ADD_RK a b k), which reads and writes the frame's
+ * slots without touching the stack. A comparison feeding a branch,
+ *
+ *     GET_LOCAL b; GET_LOCAL c (or CONSTANT k); LESS; POP_JUMP_IF_FALSE
+ *
+ * becomes LESS_RR_JUMP b c (LESS_RK_JUMP b k). The whole instruction has the
+ * line of the operator, since only the operator can fail. */
+static void translate_registers(Code *code) {
+    Chunk *chunk = code->chunk;
+    for (int i = 0; i < code->count; i++) {
+        int seq[5];
+        if (!code->insts[i].live || op_at(code, i) != OP_GET_LOCAL ||
+            !collect(code, i, seq, 3))
+            continue;
+
+        uint8_t right = op_at(code, seq[1]);
+        if (right != OP_GET_LOCAL && right != OP_CONSTANT)
+            continue;
+
+        uint8_t op = op_at(code, seq[2]);
+        int reg = find_register_op(op, right == OP_CONSTANT);
+        if (reg < 0)
+            continue;
+
+        uint8_t left = chunk->code[code->insts[seq[0]].offset + 1];
+        uint8_t operand = chunk->code[code->insts[seq[1]].offset + 1];
+        uint8_t bytes[5];
+        int len;
+        int n;
+        if (op == OP_LESS) {
+            n = 4;
+            if (!collect(code, i, seq, n) ||
+                op_at(code, seq[3]) != OP_POP_JUMP_IF_FALSE)
+                continue;
+
+            len = 5; // the jump offset is filled in by encode()
+            bytes[0] = (uint8_t)reg;
+            bytes[1] = left;
+            bytes[2] = operand;
+        } else {
+            n = 5;
+            if (!collect(code, i, seq, n) ||
+                op_at(code, seq[3]) != OP_SET_LOCAL ||
+                op_at(code, seq[4]) != OP_POP)
+                continue;
+
+            len = 4;
+            bytes[0] = (uint8_t)reg;
+            bytes[1] = chunk->code[code->insts[seq[3]].offset + 1];
+            bytes[2] = left;
+            bytes[3] = operand;
+        }
+
+        int lines[5];
+        for (int j = 0; j < len; j++)
+            lines[j] = chunk->lines[code->insts[seq[2]].offset];
+        replace(code, seq, n, bytes, lines, len);
+    }
+}
+
+static void encode(Code *code) {
+    Chunk *chunk = code->chunk;
+    int *new_offset = GROW_ARRAY(int, NULL, 0, code->count + 1);
+    int len = 0;
+    for (int i = 0; i <= code->count; i++) {
+        new_offset[i] = len;
+        if (code->insts[i].live)
+            len += code->insts[i].len;
+    }
+
+    // instructions only move towards the start, so copying in order never
+    // overwrites one that is still to be moved
+    for (int i = 0; i < code->count; i++) {
+        Inst *inst = &code->insts[i];
+        if (!inst->live)
+            continue;
+
+        memmove(chunk->code + new_offset[i], chunk->code + inst->offset,
+                inst->len);
+        memmove(chunk->lines + new_offset[i], chunk->lines + inst->offset,
+                sizeof(int) * inst->len);
+    }
+
+    for (int i = 0; i < code->count; i++) {
+        Inst *inst = &code->insts[i];
+        if (!inst->live || inst->target < 0)
+            continue;
+
+        // the offset is the last operand of every jumping instruction
+        uint8_t *at = chunk->code + new_offset[i];
+        int after = new_offset[i] + inst->len;
+        int dest = new_offset[resolve(code, inst->target)];
+        int dist = dest - after;
+        if (*at == OP_JUMP || *at == OP_LOOP) {
+            // threading may have turned a forward jump backwards or back
+            *at = dist >= 0 ? OP_JUMP : OP_LOOP;
+            dist = abs(dist);
+        }
+
+        at[inst->len - 2] = (dist >> 8) & 0xff;
+        at[inst->len - 1] = dist & 0xff;
+    }
+
+    chunk->len = len;
+    FREE_ARRAY(int, new_offset, code->count + 1);
+}
+
+void optimizeChunk(Chunk *chunk, bool registerOps) {
+    Code code;
+    decode(&code, chunk);
+
+    bool changed = true;
+    while (changed) {
+        mark_targets(&code);
+        changed = thread_jumps(&code);
+
+        mark_targets(&code);
+        changed |= remove_dead_code(&code);
+        changed |= remove_push_pop(&code);
+        changed |= remove_jump_to_next(&code);
+
+        mark_targets(&code);
+        changed |= fuse_condition_pops(&code);
+    }
+
+    mark_targets(&code);
+    if (registerOps)
+        translate_registers(&code);
+    fuse_superinstructions(&code);
+
+    encode(&code);
+    FREE_ARRAY(Inst, code.insts, code.count + 1);
+    FREE_ARRAY(int, code.targets, code.count + 1);
+}
@@ -0,0 +1,10 @@
+#ifndef CLOX_OPTIMIZER_H
+#define CLOX_OPTIMIZER_H
+
+#include "chunk.h"
+
+// Peephole pass over a finished chunk, run once per function by the compiler.
+// With `registerOps` it also emits the three-address register instructions.
+void optimizeChunk(Chunk *chunk, bool registerOps);
+
+#endif
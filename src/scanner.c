@@ -3,139 +3,138 @@
 #include "common.h"
 #include "scanner.h"
 
-typedef struct {
-    const char *start;
-    const char *current;
-    int line;
-} Scanner;
-
-Scanner scanner;
-
-void initScanner(const char *src) {
-    scanner.start = src;
-    scanner.current = src;
-    scanner.line = 1;
+void initScanner(Scanner *scanner, const char *src) {
+    scanner->start = src;
+    scanner->current = src;
+    scanner->line = 1;
 }
 
 static inline bool is_alpha(char c) {
     return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c == '_');
 }
 static inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
-static inline bool is_at_end() { return *scanner.current == '\0'; }
-static char advance() {
-    scanner.current++;
-    return scanner.current[-1];
+static inline bool is_at_end(Scanner *scanner) {
+    return *scanner->current == '\0';
 }
-static bool check_advance(char expected) {
-    if (is_at_end())
+static char advance(Scanner *scanner) {
+    scanner->current++;
+    return scanner->current[-1];
+}
+static bool check_advance(Scanner *scanner, char expected) {
+    if (is_at_end(scanner))
         return false;
 
-    if (*scanner.current != expected)
+    if (*scanner->current != expected)
         return false;
 
-    scanner.current++;
+    scanner->current++;
     return true;
 }
-static void skip_whitespace();
+static void skip_whitespace(Scanner *scanner);
 
-static Token err_token(const char *msg);
-static Token make_token(TokenType type);
-static Token string();
-static Token number();
-static Token identifier();
+static Token err_token(Scanner *scanner, const char *msg);
+static Token make_token(Scanner *scanner, TokenType type);
+static Token string(Scanner *scanner);
+static Token number(Scanner *scanner);
+static Token identifier(Scanner *scanner);
 
-Token scanToken() {
-    skip_whitespace();
-    scanner.start = scanner.current;
+Token scanToken(Scanner *scanner) {
+    skip_whitespace(scanner);
+    scanner->start = scanner->current;
 
-    if (is_at_end())
-        return make_token(TKN_EOF);
+    if (is_at_end(scanner))
+        return make_token(scanner, TKN_EOF);
 
-    char ch = advance();
+    char ch = advance(scanner);
     if (is_alpha(ch))
-        return identifier();
+        return identifier(scanner);
 
     if (is_digit(ch))
-        return number();
+        return number(scanner);
 
     switch (ch) {
     case '(':
-        return make_token(TKN_LParen);
+        return make_token(scanner, TKN_LParen);
     case ')':
-        return make_token(TKN_RParen);
+        return make_token(scanner, TKN_RParen);
     case '{':
-        return make_token(TKN_LBrace);
+        return make_token(scanner, TKN_LBrace);
     case '}':
-        return make_token(TKN_RBrace);
+        return make_token(scanner, TKN_RBrace);
     case ';':
-        return make_token(TKN_Semicolon);
+        return make_token(scanner, TKN_Semicolon);
     case ',':
-        return make_token(TKN_Comma);
+        return make_token(scanner, TKN_Comma);
     case '.':
-        return make_token(TKN_Dot);
+        return make_token(scanner, TKN_Dot);
     case '-':
-        return make_token(TKN_Minus);
+        return make_token(scanner, TKN_Minus);
     case '+':
-        return make_token(TKN_Plus);
+        return make_token(scanner, TKN_Plus);
     case '*':
-        return make_token(TKN_Star);
+        return make_token(scanner, TKN_Star);
     case '/':
-        return make_token(TKN_Slash);
+        return make_token(scanner, TKN_Slash);
     case '!':
-        return make_token(check_advance('=') ? TKN_BangEq : TKN_Bang);
+        return make_token(scanner,
+                          check_advance(scanner, '=') ? TKN_BangEq : TKN_Bang);
     case '=':
-        return make_token(check_advance('=') ? TKN_EqEq : TKN_Eq);
+        return make_token(scanner,
+                          check_advance(scanner, '=') ? TKN_EqEq : TKN_Eq);
     case '<':
-        return make_token(check_advance('=') ? TKN_LessEq : TKN_Less);
+        return make_token(scanner,
+                          check_advance(scanner, '=') ? TKN_LessEq : TKN_Less);
     case '>':
-        return make_token(check_advance('=') ? TKN_GreaterEq : TKN_Greater);
+        return make_token(scanner, check_advance(scanner, '=')
+                                       ? TKN_GreaterEq
+                                       : TKN_Greater);
     case '"':
-        return string();
+        return string(scanner);
     }
 
-    return err_token("Unexpected character");
+    return err_token(scanner, "Unexpected character");
 }
 
-static Token err_token(const char *msg) {
+static Token err_token(Scanner *scanner, const char *msg) {
     Token token = {.type = TKN_Err,
                    .start = msg,
                    .len = (int)strlen(msg),
-                   .line = scanner.line};
+                   .line = scanner->line};
     return token;
 }
-static Token make_token(TokenType type) {
+static Token make_token(Scanner *scanner, TokenType type) {
     Token token = {.type = type,
-                   .start = scanner.start,
-                   .len = (int)(scanner.current - scanner.start),
-                   .line = scanner.line};
+                   .start = scanner->start,
+                   .len = (int)(scanner->current - scanner->start),
+                   .line = scanner->line};
     return token;
 }
 
-static inline char peek() { return *scanner.current; }
-static inline char peek_next() {
-    if (is_at_end())
+static inline char peek(Scanner *scanner) { return *scanner->current; }
+static inline char peek_next(Scanner *scanner) {
+    if (is_at_end(scanner))
         return '\0';
 
-    return scanner.current[1];
+    return scanner->current[1];
 }
-static void skip_whitespace() {
+static void skip_whitespace(Scanner *scanner) {
     while (true) {
-        char ch = peek();
+        char ch = peek(scanner);
         switch (ch) {
         case ' ':
         case '\t':
         case '\r':
-            advance();
+            advance(scanner);
             break;
         case '\n':
-            scanner.line++;
-            advance();
+            scanner->line++;
+            advance(scanner);
             break;
         case '/':
-            if (peek_next() == '/') {
+            if (peek_next(scanner) == '/') {
                 // a comment goes until the end of the line
-                while (peek() != '\n' && !is_at_end())
-                    advance();
+                while (peek(scanner) != '\n' && !is_at_end(scanner))
+                    advance(scanner);
             } else {
                 return;
             }
@@ -146,97 +145,97 @@ static void skip_whitespace() {
     }
 }
 
-static Token string() {
-    while (peek() != '"' && !is_at_end()) {
-        if (peek() == '\n')
-            scanner.line++;
+static Token string(Scanner *scanner) {
+    while (peek(scanner) != '"' && !is_at_end(scanner)) {
+        if (peek(scanner) == '\n')
+            scanner->line++;
 
-        advance();
+        advance(scanner);
     }
 
-    if (is_at_end())
-        return err_token("Unterminated string");
+    if (is_at_end(scanner))
+        return err_token(scanner, "Unterminated string");
 
-    advance(); // consume the closing quote
-    return make_token(TKN_String);
+    advance(scanner); // consume the closing quote
+    return make_token(scanner, TKN_String);
 }
-static Token number() {
-    while (is_digit(peek()))
-        advance();
+static Token number(Scanner *scanner) {
+    while (is_digit(peek(scanner)))
+        advance(scanner);
 
     // look for fractional part
-    if (peek() == '.' && is_digit(peek_next())) {
-        advance();
-        while (is_digit(peek()))
-            advance();
+    if (peek(scanner) == '.' && is_digit(peek_next(scanner))) {
+        advance(scanner);
+        while (is_digit(peek(scanner)))
+            advance(scanner);
     }
 
-    return make_token(TKN_Number);
+    return make_token(scanner, TKN_Number);
 }
 
-static TokenType check_keyword(int start, int len, const char *rest,
-                               TokenType type);
-static TokenType ident_type() {
-    switch (scanner.start[0]) {
+static TokenType check_keyword(Scanner *scanner, int start, int len,
+                               const char *rest, TokenType type);
+static TokenType ident_type(Scanner *scanner) {
+    switch (scanner->start[0]) {
     case 'a':
-        return check_keyword(1, 2, "nd", TKN_And);
+        return check_keyword(scanner, 1, 2, "nd", TKN_And);
     case 'c':
-        return check_keyword(1, 4, "lass", TKN_Class);
+        return check_keyword(scanner, 1, 4, "lass", TKN_Class);
     case 'e':
-        return check_keyword(1, 3, "lse", TKN_Else);
+        return check_keyword(scanner, 1, 3, "lse", TKN_Else);
     case 'f':
-        if ((scanner.current - scanner.start) > 1) {
-            switch (scanner.start[1]) {
+        if ((scanner->current - scanner->start) > 1) {
+            switch (scanner->start[1]) {
             case 'a':
-                return check_keyword(2, 3, "lse", TKN_False);
+                return check_keyword(scanner, 2, 3, "lse", TKN_False);
             case 'o':
-                return check_keyword(2, 1, "r", TKN_For);
+                return check_keyword(scanner, 2, 1, "r", TKN_For);
             case 'u':
-                return check_keyword(2, 1, "n", TKN_Fun);
+                return check_keyword(scanner, 2, 1, "n", TKN_Fun);
             }
         }
         break;
     case 'i':
-        return check_keyword(1, 1, "f", TKN_If);
+        return check_keyword(scanner, 1, 1, "f", TKN_If);
     case 'n':
-        return check_keyword(1, 2, "il", TKN_Nil);
+        return check_keyword(scanner, 1, 2, "il", TKN_Nil);
     case 'o':
-        return check_keyword(1, 1, "r", TKN_Or);
+        return check_keyword(scanner, 1, 1, "r", TKN_Or);
     case 'p':
-        return check_keyword(1, 4, "rint", TKN_Print);
+        return check_keyword(scanner, 1, 4, "rint", TKN_Print);
     case 'r':
-        return check_keyword(1, 5, "eturn", TKN_Return);
+        return check_keyword(scanner, 1, 5, "eturn", TKN_Return);
     case 's':
-        return check_keyword(1, 4, "uper", TKN_Super);
+        return check_keyword(scanner, 1, 4, "uper", TKN_Super);
     case 't':
-        if ((scanner.current - scanner.start) > 1) {
-            switch (scanner.start[1]) {
+        if ((scanner->current - scanner->start) > 1) {
+            switch (scanner->start[1]) {
             case 'h':
-                return check_keyword(2, 2, "is", TKN_This);
+                return check_keyword(scanner, 2, 2, "is", TKN_This);
             case 'r':
-                return check_keyword(2, 2, "ue", TKN_True);
+                return check_keyword(scanner, 2, 2, "ue", TKN_True);
             }
         }
         break;
     case 'v':
-        return check_keyword(1, 2, "ar", TKN_Var);
+        return check_keyword(scanner, 1, 2, "ar", TKN_Var);
     case 'w':
-        return check_keyword(1, 4, "hile", TKN_While);
+        return check_keyword(scanner, 1, 4, "hile", TKN_While);
     }
 
     return TKN_Ident;
 }
-static Token identifier() {
-    while (is_alpha(peek()) || is_digit(peek()))
-        advance();
+static Token identifier(Scanner *scanner) {
+    while (is_alpha(peek(scanner)) || is_digit(peek(scanner)))
+        advance(scanner);
 
-    return make_token(ident_type());
+    return make_token(scanner, ident_type(scanner));
 }
 
-static TokenType check_keyword(int start, int len, const char *rest,
-                               TokenType type) {
-    if (((scanner.current - scanner.start) == (start + len)) &&
-        memcmp(scanner.start + start, rest, len) == 0) {
+static TokenType check_keyword(Scanner *scanner, int start, int len,
+                               const char *rest, TokenType type) {
+    if (((scanner->current - scanner->start) == (start + len)) &&
+        memcmp(scanner->start + start, rest, len) == 0) {
         return type;
     }
 
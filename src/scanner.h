@@ -55,7 +55,15 @@ typedef struct {
     int line;
 } Token;
 
-void initScanner(const char *src);
-Token scanToken();
+// Where scanning is in the source. Each compilation has one of its own, see
+// Parser in compiler.c.
+typedef struct {
+    const char *start;
+    const char *current;
+    int line;
+} Scanner;
+
+void initScanner(Scanner *scanner, const char *src);
+Token scanToken(Scanner *scanner);
 
 #endif
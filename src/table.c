@@ -43,8 +43,9 @@ bool tableSet(Table *table, ObjString *key, Value val) {
     if (is_new_key && IS_NIL(entry->value))
         table->len++;
 
-    entry->key = key;
-    entry->value = val;
+    // a background marker may be reading the entries
+    gcStore(&entry->key, key);
+    gcStoreValue(&entry->value, val);
     return is_new_key;
 }
 
@@ -56,8 +57,8 @@ bool tableDelete(Table *table, ObjString *key) {
     if (entry->key == NULL)
         return false;
 
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true); // tombstone marker
+    gcStore(&entry->key, NULL);
+    gcStoreValue(&entry->value, BOOL_VAL(true)); // tombstone marker
 
     return true;
 }
@@ -84,20 +85,11 @@ ObjString *tableFindString(Table *table, const char *chars, int len,
     }
 }
 
-void table_remove_white(Table *table) {
-    for (size_t i = 0; i < table->capacity; i++) {
-        Entry *entry = &table->entries[i];
-        if ((entry->key != NULL) && !(entry->key->obj.marked)) {
-            tableDelete(table, entry->key);
-        }
-    }
-}
-
 void mark_table(Table *table) {
     for (size_t i = 0; i < table->capacity; i++) {
         Entry *entry = &table->entries[i];
-        mark_object((Obj *)entry->key);
-        mark_value(entry->value);
+        mark_object((Obj *)gcLoad(&entry->key));
+        mark_value(gcLoadValue(&entry->value));
     }
 }
 
@@ -160,8 +152,9 @@ static void rehash(Table *table, size_t new_capacity) {
         table->len++;
     }
 
+    gcLockHeap();
     FREE_ARRAY(Entry, old_entries, old_capacity);
-
     table->entries = new_entries;
     table->capacity = new_capacity;
+    gcUnlockHeap();
 }
@@ -26,9 +26,6 @@ ObjString *tableFindString(Table *table, const char *chars, int len,
                            uint32_t hash);
 
 // gc methods
-// if there is a white string in the table, then we delete it from the hash
-// table and resolve the dangling pointers
-void table_remove_white(Table *table);
 void mark_table(Table *table);
 
 #endif
@@ -0,0 +1,1349 @@
+#include <stdlib.h>
+
+#include "trace.h"
+
+#ifdef JIT
+
+#include "x64.h"
+
+/* Trace compiler for hot loops. Once a loop header has seen TRACE_THRESHOLD
+ * back edges, the recorder follows the next iteration instruction by
+ * instruction on a private copy of the state: it computes the values run()
+ * would see, and with them the path taken at every branch and the type of
+ * every value. What it writes down is a linear, typed IR of that path in SSA
+ * form, in which
+ *
+ *  - values are numbers, booleans or nil; anything else aborts the recording
+ *  - variables (frame slots below the header's stack depth, and globals) read
+ *    before they are written are guarded for their type once, on entry, and
+ *    a loop storing another type into them is rejected, so the types hold for
+ *    every iteration and the body needs no type guards at all
+ *  - branches turn into guards on the direction recorded, each with a
+ *    snapshot of the stack to hand back to the interpreter when it fails
+ *
+ * The IR is optimized on the way: constants are folded as it is built,
+ * guards on constants or on values guarded before are dropped, dead values
+ * are removed and loop invariant ones hoisted into a preheader. Numbers are
+ * unboxed into xmm registers and only boxed again when stored to a variable
+ * or handed back at an exit.
+ *
+ * Stores to variables write through to memory, so the interpreter finds
+ * them up to date at every exit and only the temporaries on the stack need
+ * rebuilding there. Calls and anything else left to the interpreter abort
+ * the recording. An inner loop is recorded through as long as each of its
+ * back edges is taken once per iteration of the traced loop: the guard on
+ * its condition leaves the trace whenever it wants to go round again. A back
+ * edge taken a second time aborts, as does one beyond TRACE_MAX_LOOPS. */
+
+#define TRACE_MAX_INS   1024
+#define TRACE_MAX_VARS  64
+#define TRACE_MAX_STACK 256
+#define TRACE_MAX_LOOPS 16
+
+typedef enum {
+    TY_NIL,
+    TY_BOOL,
+    TY_NUM,
+} Type;
+
+typedef enum {
+    IR_CONST, // `val`
+    IR_VAR,   // variable `var` at the top of the iteration
+    IR_ADD,
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    IR_NEG,
+    IR_LESS,
+    IR_LESS_EQUAL,
+    IR_GREATER,
+    IR_GREATER_EQUAL,
+    IR_EQUAL,
+    IR_NOT_EQUAL,
+    IR_NOT,
+    IR_STORE, // `a` into variable `var`
+    IR_GUARD, // leaves through snapshot `snap` unless `a` is `expect`
+} IrOp;
+
+// no register or stack slot, for values that are never materialized
+#define NO_LOC INT32_MIN
+
+typedef struct {
+    uint8_t op;
+    uint8_t type;  // of the result
+    bool expect;   // IR_GUARD
+    bool tagged;   // IR_STORE: the type tag in memory may differ
+    int32_t a;     // operands
+    int32_t b;
+    int32_t var;   // IR_VAR, IR_STORE
+    int32_t snap;  // IR_GUARD
+    Value val;     // IR_CONST's value, otherwise the one recorded
+
+    // filled in by the passes after recording
+    bool guarded;  // some guard already checks this value
+    bool live;
+    bool hoisted;  // into the preheader
+    bool fused;    // a comparison only tested by guards, which redo it
+    bool operand;  // used by arithmetic or comparisons
+    int32_t uses;  // other than by the guards on it
+    int32_t pos;   // in the emitted order
+    int32_t end;   // last position its value is needed at
+    int32_t loc;   // xmm register if >= 0, else stack slot -loc - 1
+} Ins;
+
+typedef struct {
+    bool global;
+    uint32_t index;  // slot of the frame or of vm->globals
+    uint8_t type;    // at the top of the iteration, if read first
+    bool read;       // read before written, so guarded on entry
+    int32_t entry;   // its value at the top of the iteration
+    int32_t current; // its value now, -1 before the first access
+    int mem_type;    // type tag in memory now, -1 when unknown
+} Var;
+
+typedef struct {
+    uint32_t offset; // instruction to resume at
+    int32_t guard;   // the guard leaving through it, -1 on entry
+    int32_t start;   // its stack, in Recorder.refs
+    int32_t count;
+} Snapshot;
+
+typedef struct {
+    ObjFunction *func;
+    Value *slots;
+    int depth; // stack depth at the loop header
+    uint32_t header;
+    bool failed;
+
+    Ins *ins;
+    size_t len;
+    size_t capacity;
+
+    Var vars[TRACE_MAX_VARS];
+    int var_count;
+
+    // the stack above the header's depth, as refs to instructions
+    int32_t stack[TRACE_MAX_STACK];
+    int top;
+
+    Snapshot *snaps;
+    size_t snap_count;
+    size_t snap_capacity;
+    int32_t *refs;
+    size_t ref_count;
+    size_t ref_capacity;
+
+    // back edges taken, to tell inner loops
+    uint32_t loops[TRACE_MAX_LOOPS];
+    int loop_count;
+} Recorder;
+
+static uint32_t operand(uint8_t *at, int width) {
+    uint32_t ret = 0;
+    for (int i = 0; i < width; i++)
+        ret = (ret << 8) | at[i];
+    return ret;
+}
+
+/* ---- Recording. ---- */
+
+static bool type_of(Value val, uint8_t *type) {
+    if (IS_NUMBER(val)) {
+        *type = TY_NUM;
+    } else if (IS_BOOL(val)) {
+        *type = TY_BOOL;
+    } else if (IS_NIL(val)) {
+        *type = TY_NIL;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Returns 0 rather than -1 on failure, so the caller can go on until it
+// checks `failed`.
+static int32_t emit(Recorder *r, uint8_t op, uint8_t type, int32_t a,
+                    int32_t b, Value val) {
+    if (r->len == TRACE_MAX_INS) {
+        r->failed = true;
+        return 0;
+    }
+
+    r->ins = grow(r->ins, &r->capacity, r->len + 1, sizeof(Ins));
+    r->ins[r->len] = (Ins){
+        .op = op, .type = type, .a = a, .b = b, .var = -1, .snap = -1,
+        .val = val, .loc = NO_LOC,
+    };
+    return (int32_t)r->len++;
+}
+
+static int32_t constant(Recorder *r, Value val) {
+    uint8_t type;
+    if (!type_of(val, &type)) {
+        r->failed = true;
+        return 0;
+    }
+    return emit(r, IR_CONST, type, -1, -1, val);
+}
+
+static void push_ref(Recorder *r, int32_t ref) {
+    if (r->top == TRACE_MAX_STACK) {
+        r->failed = true;
+        return;
+    }
+    r->stack[r->top++] = ref;
+}
+
+static int32_t pop_ref(Recorder *r) {
+    if (r->top == 0) {
+        r->failed = true;
+        return 0;
+    }
+    return r->stack[--r->top];
+}
+
+static int32_t peek_ref(Recorder *r, int dist) {
+    if (r->top <= dist) {
+        r->failed = true;
+        return 0;
+    }
+    return r->stack[r->top - dist - 1];
+}
+
+static Var *find_var(Recorder *r, bool global, uint32_t index) {
+    for (int i = 0; i < r->var_count; i++) {
+        if (r->vars[i].global == global && r->vars[i].index == index)
+            return &r->vars[i];
+    }
+
+    if (r->var_count == TRACE_MAX_VARS ||
+        (global && !vm->globals.defined[index])) {
+        r->failed = true;
+        return NULL;
+    }
+    Var *var = &r->vars[r->var_count++];
+    *var = (Var){global, index, TY_NIL, false, -1, -1, -1};
+    return var;
+}
+
+static int32_t read_var(Recorder *r, bool global, uint32_t index) {
+    Var *var = find_var(r, global, index);
+    if (var == NULL)
+        return 0;
+    if (var->current >= 0)
+        return var->current;
+
+    Value val = global ? vm->globals.values[index] : r->slots[index];
+    uint8_t type;
+    if (!type_of(val, &type)) {
+        r->failed = true;
+        return 0;
+    }
+
+    var->read = true;
+    var->type = type;
+    var->mem_type = type;
+    // nil has a single value, so the type guard on entry is all it takes
+    var->entry = type == TY_NIL ? constant(r, NIL_VAL)
+                                : emit(r, IR_VAR, type, -1, -1, val);
+    r->ins[var->entry].var = (int32_t)(var - r->vars);
+    var->current = var->entry;
+    return var->current;
+}
+
+static void write_var(Recorder *r, bool global, uint32_t index, int32_t ref) {
+    Var *var = find_var(r, global, index);
+    if (var == NULL)
+        return;
+
+    uint8_t type = r->ins[ref].type;
+    int32_t store = emit(r, IR_STORE, TY_NIL, ref, -1, r->ins[ref].val);
+    r->ins[store].var = (int32_t)(var - r->vars);
+    r->ins[store].tagged = var->mem_type != type;
+    var->mem_type = type;
+    var->current = ref;
+}
+
+// slots below the header's depth are variables, the rest are temporaries
+static int32_t get_local(Recorder *r, uint32_t slot) {
+    if (slot < (uint32_t)r->depth)
+        return read_var(r, false, slot);
+    if (slot - r->depth >= (uint32_t)r->top) {
+        r->failed = true;
+        return 0;
+    }
+    return r->stack[slot - r->depth];
+}
+
+static void set_local(Recorder *r, uint32_t slot, int32_t ref) {
+    if (slot < (uint32_t)r->depth) {
+        write_var(r, false, slot, ref);
+    } else if (slot - r->depth < (uint32_t)r->top) {
+        r->stack[slot - r->depth] = ref;
+    } else {
+        r->failed = true;
+    }
+}
+
+static int32_t arith(Recorder *r, uint8_t op, int32_t a, int32_t b) {
+    Ins x = r->ins[a], y = r->ins[b];
+    // strings and type errors are for the interpreter
+    if (x.type != TY_NUM || y.type != TY_NUM) {
+        r->failed = true;
+        return 0;
+    }
+
+    double left = AS_NUMBER(x.val), right = AS_NUMBER(y.val), ret;
+    switch (op) {
+    case IR_ADD:
+        ret = left + right;
+        break;
+    case IR_SUB:
+        ret = left - right;
+        break;
+    case IR_MUL:
+        ret = left * right;
+        break;
+    default:
+        ret = left / right;
+        break;
+    }
+
+    if (x.op == IR_CONST && y.op == IR_CONST)
+        return constant(r, NUMBER_VAL(ret));
+    return emit(r, op, TY_NUM, a, b, NUMBER_VAL(ret));
+}
+
+static int32_t negate(Recorder *r, int32_t a) {
+    Ins x = r->ins[a];
+    if (x.type != TY_NUM) {
+        r->failed = true;
+        return 0;
+    }
+
+    if (x.op == IR_CONST)
+        return constant(r, NUMBER_VAL(-AS_NUMBER(x.val)));
+    return emit(r, IR_NEG, TY_NUM, a, -1, NUMBER_VAL(-AS_NUMBER(x.val)));
+}
+
+static int32_t compare(Recorder *r, uint8_t op, int32_t a, int32_t b) {
+    Ins x = r->ins[a], y = r->ins[b];
+    bool ret;
+
+    if (op == IR_EQUAL || op == IR_NOT_EQUAL) {
+        ret = values_equal(x.val, y.val) == (op == IR_EQUAL);
+        // values of different types are never equal, nil always is
+        if (x.type != y.type || x.type == TY_NIL)
+            return constant(r, BOOL_VAL(ret));
+    } else {
+        if (x.type != TY_NUM || y.type != TY_NUM) {
+            r->failed = true;
+            return 0;
+        }
+
+        double left = AS_NUMBER(x.val), right = AS_NUMBER(y.val);
+        switch (op) {
+        case IR_LESS:
+            ret = left < right;
+            break;
+        case IR_GREATER:
+            ret = left > right;
+            break;
+        // !(a > b) and !(a < b), true for NaN like in run()
+        case IR_LESS_EQUAL:
+            ret = !(left > right);
+            break;
+        default:
+            ret = !(left < right);
+            break;
+        }
+    }
+
+    if (x.op == IR_CONST && y.op == IR_CONST)
+        return constant(r, BOOL_VAL(ret));
+    return emit(r, op, TY_BOOL, a, b, BOOL_VAL(ret));
+}
+
+static int32_t logical_not(Recorder *r, int32_t a) {
+    Ins x = r->ins[a];
+    Value ret = BOOL_VAL(is_falsey(x.val));
+    if (x.type != TY_BOOL || x.op == IR_CONST)
+        return constant(r, ret);
+
+    // each comparison has an exact negation, NaN included
+    switch (x.op) {
+    case IR_NOT:
+        return x.a;
+    case IR_LESS:
+        return emit(r, IR_GREATER_EQUAL, TY_BOOL, x.a, x.b, ret);
+    case IR_GREATER_EQUAL:
+        return emit(r, IR_LESS, TY_BOOL, x.a, x.b, ret);
+    case IR_GREATER:
+        return emit(r, IR_LESS_EQUAL, TY_BOOL, x.a, x.b, ret);
+    case IR_LESS_EQUAL:
+        return emit(r, IR_GREATER, TY_BOOL, x.a, x.b, ret);
+    case IR_EQUAL:
+        return emit(r, IR_NOT_EQUAL, TY_BOOL, x.a, x.b, ret);
+    case IR_NOT_EQUAL:
+        return emit(r, IR_EQUAL, TY_BOOL, x.a, x.b, ret);
+    default:
+        return emit(r, IR_NOT, TY_BOOL, a, -1, ret);
+    }
+}
+
+static int32_t snapshot(Recorder *r, uint32_t offset, int32_t guard) {
+    r->snaps = grow(r->snaps, &r->snap_capacity, r->snap_count + 1,
+                    sizeof(Snapshot));
+    r->refs = grow(r->refs, &r->ref_capacity, r->ref_count + r->top + 1,
+                   sizeof(int32_t));
+    memcpy(r->refs + r->ref_count, r->stack, sizeof(int32_t) * r->top);
+    r->snaps[r->snap_count] =
+        (Snapshot){offset, guard, (int32_t)r->ref_count, r->top};
+    r->ref_count += r->top;
+    return (int32_t)r->snap_count++;
+}
+
+// Guards `cond` to keep the truthiness it has now, leaving for the branch at
+// `offset` with the current stack otherwise. Returns whether it is falsey.
+static bool branch(Recorder *r, int32_t cond, uint32_t offset) {
+    Ins *x = &r->ins[cond];
+    bool falsey = is_falsey(x->val);
+    // only booleans can go either way, numbers and nil are one or the other
+    if (x->type != TY_BOOL || x->op == IR_CONST || x->guarded)
+        return falsey;
+
+    x->guarded = true;
+    int32_t guard = emit(r, IR_GUARD, TY_NIL, cond, -1, NIL_VAL);
+    r->ins[guard].expect = !falsey;
+    r->ins[guard].snap = snapshot(r, offset, guard);
+    return falsey;
+}
+
+static bool back_edge(Recorder *r, uint32_t offset) {
+    for (int i = 0; i < r->loop_count; i++) {
+        if (r->loops[i] == offset)
+            return false; // an inner loop
+    }
+    if (r->loop_count == TRACE_MAX_LOOPS)
+        return false;
+
+    r->loops[r->loop_count++] = offset;
+    return true;
+}
+
+static uint8_t ir_op(uint8_t op) {
+    switch (op) {
+    case OP_EQUAL:
+    case OP_EQUAL_NUM:
+        return IR_EQUAL;
+    case OP_NOT_EQUAL:
+    case OP_NOT_EQUAL_NUM:
+        return IR_NOT_EQUAL;
+    case OP_GREATER:
+        return IR_GREATER;
+    case OP_GREATER_EQUAL:
+        return IR_GREATER_EQUAL;
+    case OP_LESS:
+        return IR_LESS;
+    case OP_LESS_EQUAL:
+        return IR_LESS_EQUAL;
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+        return IR_ADD;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_RR:
+    case OP_SUBTRACT_RK:
+        return IR_SUB;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_RR:
+    case OP_MULTIPLY_RK:
+        return IR_MUL;
+    default:
+        return IR_DIV;
+    }
+}
+
+// Follows one iteration from the header back to it.
+static bool record(Recorder *r) {
+    Chunk *chunk = &r->func->chunk;
+    Value *constants = chunk->constants.values;
+    uint32_t offset = r->header;
+
+    do {
+        uint8_t op = chunk->code[offset];
+        uint8_t *args = chunk->code + offset + 1;
+        int len = instructionLen(chunk, offset);
+        // jumps end with their 16-bit distance
+        uint32_t after = offset + len;
+        uint32_t dist = len >= 3 ? operand(chunk->code + after - 2, 2) : 0;
+        uint32_t next = after;
+        int32_t a, b;
+
+        switch (op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+            push_ref(r, constant(r, constants[operand(args, len - 1)]));
+            break;
+        case OP_NIL:
+            push_ref(r, constant(r, NIL_VAL));
+            break;
+        case OP_TRUE:
+        case OP_FALSE:
+            push_ref(r, constant(r, BOOL_VAL(op == OP_TRUE)));
+            break;
+        case OP_POP:
+            pop_ref(r);
+            break;
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+            push_ref(r, get_local(r, operand(args, len - 1)));
+            break;
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG:
+            set_local(r, operand(args, len - 1), peek_ref(r, 0));
+            break;
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+            push_ref(r, read_var(r, true, operand(args, len - 1)));
+            break;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+            write_var(r, true, operand(args, len - 1), peek_ref(r, 0));
+            break;
+        case OP_EQUAL:
+        case OP_EQUAL_NUM:
+        case OP_NOT_EQUAL:
+        case OP_NOT_EQUAL_NUM:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+            b = pop_ref(r);
+            a = pop_ref(r);
+            push_ref(r, compare(r, ir_op(op), a, b));
+            break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            b = pop_ref(r);
+            a = pop_ref(r);
+            push_ref(r, arith(r, ir_op(op), a, b));
+            break;
+        case OP_NOT:
+            push_ref(r, logical_not(r, pop_ref(r)));
+            break;
+        case OP_NEGATE:
+            push_ref(r, negate(r, pop_ref(r)));
+            break;
+        case OP_JUMP:
+            next = after + dist;
+            break;
+        case OP_JUMP_IF_FALSE:
+            if (branch(r, peek_ref(r, 0), offset))
+                next = after + dist;
+            break;
+        case OP_POP_JUMP_IF_FALSE:
+            if (branch(r, peek_ref(r, 0), offset))
+                next = after + dist;
+            pop_ref(r);
+            break;
+        case OP_LESS_JUMP_IF_FALSE:
+            a = compare(r, IR_LESS, peek_ref(r, 1), peek_ref(r, 0));
+            if (branch(r, a, offset))
+                next = after + dist;
+            pop_ref(r);
+            pop_ref(r);
+            break;
+        case OP_LOOP:
+            next = after - dist;
+            if (next != r->header && !back_edge(r, offset))
+                return false;
+            break;
+        case OP_GET_LOCAL_GET_LOCAL:
+            push_ref(r, get_local(r, args[0]));
+            push_ref(r, get_local(r, args[1]));
+            break;
+        case OP_GET_LOCAL_CONSTANT:
+            push_ref(r, get_local(r, args[0]));
+            push_ref(r, constant(r, constants[args[1]]));
+            break;
+        case OP_SET_LOCAL_POP:
+            set_local(r, args[0], pop_ref(r));
+            break;
+        case OP_ADD_RR:
+        case OP_SUBTRACT_RR:
+        case OP_MULTIPLY_RR:
+        case OP_DIVIDE_RR:
+            a = arith(r, ir_op(op), get_local(r, args[1]),
+                      get_local(r, args[2]));
+            set_local(r, args[0], a);
+            break;
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RK:
+            a = arith(r, ir_op(op), get_local(r, args[1]),
+                      constant(r, constants[args[2]]));
+            set_local(r, args[0], a);
+            break;
+        case OP_LESS_RR_JUMP:
+        case OP_LESS_RK_JUMP:
+            b = op == OP_LESS_RK_JUMP ? constant(r, constants[args[1]])
+                                      : get_local(r, args[1]);
+            a = compare(r, IR_LESS, get_local(r, args[0]), b);
+            if (branch(r, a, offset))
+                next = after + dist;
+            break;
+        default:
+            return false;
+        }
+
+        if (r->failed)
+            return false;
+        offset = next;
+    } while (offset != r->header);
+
+    // Variables read first must come out of the iteration with the type they
+    // went in with, or the entry guards would not hold for the next one.
+    for (int i = 0; i < r->var_count; i++) {
+        Var *var = &r->vars[i];
+        if (var->read && r->ins[var->current].type != var->type)
+            return false;
+    }
+    return r->top == 0;
+}
+
+
+/* ---- Optimization. ---- */
+
+// a variable the loop both reads first and writes, so its IR_VAR is a phi
+static bool carried(Recorder *r, Var *var) {
+    return var->read && var->current != var->entry &&
+           r->ins[var->entry].op == IR_VAR;
+}
+
+// the value `var` takes into the next iteration, if that needs moving
+static Ins *next_value(Recorder *r, Var *var) {
+    if (!carried(r, var) || !r->ins[var->entry].live)
+        return NULL;
+    return &r->ins[var->current];
+}
+
+static void mark(Recorder *r, int32_t ref) {
+    if (ref >= 0)
+        r->ins[ref].live = true;
+}
+
+// Dead code elimination: guards and stores are what a trace does, every other
+// value lives only as long as they, an exit or the next iteration need it.
+static void mark_live(Recorder *r) {
+    bool changed = true;
+    while (changed) {
+        for (size_t i = r->len; i-- > 0;) {
+            Ins *x = &r->ins[i];
+            if (x->op == IR_GUARD || x->op == IR_STORE)
+                x->live = true;
+            if (!x->live)
+                continue;
+
+            mark(r, x->a);
+            mark(r, x->b);
+            if (x->op == IR_GUARD) {
+                Snapshot *snap = &r->snaps[x->snap];
+                for (int32_t j = 0; j < snap->count; j++)
+                    mark(r, r->refs[snap->start + j]);
+            }
+        }
+
+        changed = false;
+        for (int i = 0; i < r->var_count; i++) {
+            Ins *next = next_value(r, &r->vars[i]);
+            if (next != NULL && !next->live) {
+                next->live = true;
+                changed = true;
+            }
+        }
+    }
+}
+
+// Loop invariant code motion: constants, variables the loop never writes
+// and what is computed from those alone move into the preheader.
+static void hoist(Recorder *r) {
+    for (size_t i = 0; i < r->len; i++) {
+        Ins *x = &r->ins[i];
+        if (x->op == IR_CONST) {
+            x->hoisted = true;
+        } else if (x->op == IR_VAR) {
+            x->hoisted = !carried(r, &r->vars[x->var]);
+        } else if (x->op != IR_STORE && x->op != IR_GUARD) {
+            x->hoisted = r->ins[x->a].hoisted &&
+                         (x->b < 0 || r->ins[x->b].hoisted);
+        }
+    }
+}
+
+static bool is_compare(uint8_t op) {
+    return op >= IR_LESS && op <= IR_NOT_EQUAL;
+}
+
+// Comparisons of numbers that only guards look at are redone by each of
+// those guards as a compare and branch, and never turned into a boolean.
+static void fuse(Recorder *r) {
+    for (size_t i = 0; i < r->len; i++) {
+        Ins *x = &r->ins[i];
+        if (!x->live)
+            continue;
+
+        if (x->op == IR_GUARD) {
+            // the value guarded is known at its own exit
+            Snapshot *snap = &r->snaps[x->snap];
+            for (int32_t j = 0; j < snap->count; j++) {
+                int32_t ref = r->refs[snap->start + j];
+                r->ins[ref].uses += ref != x->a;
+            }
+            continue;
+        }
+        if (x->a >= 0)
+            r->ins[x->a].uses++;
+        if (x->b >= 0)
+            r->ins[x->b].uses++;
+        if (x->op >= IR_ADD && x->op <= IR_NOT_EQUAL) {
+            r->ins[x->a].operand = true;
+            if (x->b >= 0)
+                r->ins[x->b].operand = true;
+        }
+    }
+    for (int i = 0; i < r->var_count; i++) {
+        Ins *next = next_value(r, &r->vars[i]);
+        if (next != NULL)
+            next->uses++;
+    }
+
+    for (size_t i = 0; i < r->len; i++) {
+        Ins *x = &r->ins[i];
+        x->fused = x->live && x->uses == 0 && is_compare(x->op) &&
+                   r->ins[x->a].type == TY_NUM;
+    }
+}
+
+/* ---- Register allocation. ---- */
+
+#define FIRST_REG 2 // xmm0 and xmm1 are scratch
+#define REGS      16
+
+// whether `x` needs a register or stack slot of its own
+static bool needs_loc(Ins *x) {
+    if (!x->live || x->fused || x->op == IR_STORE || x->op == IR_GUARD)
+        return false;
+    // other constants are immediates wherever they are used
+    if (x->op == IR_CONST)
+        return x->type == TY_NUM && x->operand;
+    return true;
+}
+
+static void extend(Recorder *r, int32_t ref, int32_t pos) {
+    if (ref >= 0 && r->ins[ref].end < pos)
+        r->ins[ref].end = pos;
+}
+
+/* Lays the live instructions out, the preheader first, and works out how
+ * long each value lives. Returns the position of the back edge, with the
+ * first position of the loop in `loop`. */
+static int32_t layout(Recorder *r, int32_t *order, int32_t *loop) {
+    int32_t count = 0;
+    for (size_t i = 0; i < r->len; i++) {
+        if (r->ins[i].live && r->ins[i].hoisted)
+            order[count++] = (int32_t)i;
+    }
+    // phis load their first value in the preheader too
+    for (size_t i = 0; i < r->len; i++) {
+        if (r->ins[i].live && r->ins[i].op == IR_VAR && !r->ins[i].hoisted)
+            order[count++] = (int32_t)i;
+    }
+    *loop = count;
+    for (size_t i = 0; i < r->len; i++) {
+        if (r->ins[i].live && !r->ins[i].hoisted && r->ins[i].op != IR_VAR)
+            order[count++] = (int32_t)i;
+    }
+
+    for (int32_t i = 0; i < count; i++) {
+        Ins *x = &r->ins[order[i]];
+        x->pos = x->end = i;
+    }
+    for (int32_t i = 0; i < count; i++) {
+        Ins *x = &r->ins[order[i]];
+        if (x->op == IR_GUARD) {
+            Ins *cond = &r->ins[x->a];
+            if (cond->fused) {
+                extend(r, cond->a, i);
+                extend(r, cond->b, i);
+            } else {
+                extend(r, x->a, i);
+            }
+            Snapshot *snap = &r->snaps[x->snap];
+            for (int32_t j = 0; j < snap->count; j++)
+                extend(r, r->refs[snap->start + j], i);
+        } else if (!x->fused) {
+            extend(r, x->a, i);
+            extend(r, x->b, i);
+        }
+    }
+    for (int i = 0; i < r->var_count; i++) {
+        Ins *next = next_value(r, &r->vars[i]);
+        if (next != NULL) {
+            next->end = count;
+            r->ins[r->vars[i].entry].end = count;
+        }
+    }
+    // the preheader runs once, so what the loop uses from it must last
+    for (int32_t i = 0; i < *loop; i++) {
+        Ins *x = &r->ins[order[i]];
+        if (x->end >= *loop)
+            x->end = count;
+    }
+
+    return count;
+}
+
+// Linear scan over the layout: numbers take the first free xmm register,
+// booleans and whatever does not fit go to the stack. Returns the number of
+// stack slots used.
+static int32_t allocate(Recorder *r, int32_t *order, int32_t count) {
+    int32_t busy[REGS]; // until the end of the value in the register
+    for (int i = 0; i < REGS; i++)
+        busy[i] = -1;
+
+    int32_t slots = 0;
+    for (int32_t i = 0; i < count; i++) {
+        Ins *x = &r->ins[order[i]];
+        if (!needs_loc(x))
+            continue;
+
+        x->loc = NO_LOC;
+        // a register whose value dies here can take the result, which is
+        // computed in scratch registers first
+        for (int reg = FIRST_REG; reg < REGS && x->type == TY_NUM; reg++) {
+            if (busy[reg] <= i) {
+                x->loc = reg;
+                busy[reg] = x->end;
+                break;
+            }
+        }
+        if (x->loc == NO_LOC)
+            x->loc = -++slots;
+    }
+    return slots;
+}
+
+/* ---- Code generation. ---- */
+
+static uint64_t num_bits(double num) {
+    uint64_t bits;
+    memcpy(&bits, &num, sizeof(bits));
+    return bits;
+}
+
+static int32_t slot_disp(int32_t loc) { return (-loc - 1) * 8; }
+
+static int var_base(Var *var) { return var->global ? RBP : SLOTS; }
+
+static int32_t var_disp(Var *var) { return (int32_t)var->index * VS; }
+
+// movq xmm, reg
+static void movq_to_xmm(Asm *a, int xmm, int reg) {
+    emit8(a, 0x66);
+    rex(a, true, xmm, reg);
+    emit8(a, 0x0f);
+    emit8(a, 0x6e);
+    modrm_reg(a, xmm, reg);
+}
+
+// movzx eax, al
+static void zero_extend(Asm *a) {
+    emit8(a, 0x0f);
+    emit8(a, 0xb6);
+    emit8(a, 0xc0);
+}
+
+// the register holding number `x`, loading it into `scratch` if it has none
+static int num_reg(Asm *a, Ins *x, int scratch) {
+    if (x->loc >= 0)
+        return x->loc;
+    sse_mem(a, SSE_LOAD, scratch, RSP, slot_disp(x->loc));
+    return scratch;
+}
+
+static void save_num(Asm *a, Ins *x, int xmm) {
+    if (x->loc >= 0)
+        sse_reg(a, SSE_LOAD, x->loc, xmm);
+    else
+        sse_mem(a, SSE_STORE, xmm, RSP, slot_disp(x->loc));
+}
+
+// `op` between xmm and number `x`
+static void sse_with(Asm *a, uint8_t op, int xmm, Ins *x) {
+    if (x->loc >= 0)
+        sse_reg(a, op, xmm, x->loc);
+    else
+        sse_mem(a, op, xmm, RSP, slot_disp(x->loc));
+}
+
+// loads boolean `x` into `reg` as 0 or 1
+static void load_bool(Asm *a, int reg, Ins *x) {
+    if (x->op == IR_CONST)
+        mov_imm(a, reg, AS_BOOL(x->val));
+    else
+        load(a, reg, RSP, slot_disp(x->loc));
+}
+
+static void save_al(Asm *a, Ins *x) {
+    zero_extend(a);
+    store(a, RSP, slot_disp(x->loc), RAX);
+}
+
+// Compares two numbers, returning the condition code under which the
+// comparison holds. Equality needs the parity flag on top, see guard().
+static uint8_t compare_numbers(Asm *a, Recorder *r, Ins *cmp) {
+    Ins *left = &r->ins[cmp->a], *right = &r->ins[cmp->b];
+    switch (cmp->op) {
+    // <= and >= are !(a > b) and !(a < b), true for NaN like in run()
+    case IR_LESS:
+    case IR_GREATER_EQUAL:
+        sse_with(a, SSE_UCOMI, num_reg(a, right, 0), left);
+        return cmp->op == IR_LESS ? CC_A : CC_BE;
+    case IR_GREATER:
+    case IR_LESS_EQUAL:
+        sse_with(a, SSE_UCOMI, num_reg(a, left, 0), right);
+        return cmp->op == IR_GREATER ? CC_A : CC_BE;
+    default:
+        sse_with(a, SSE_UCOMI, num_reg(a, left, 0), right);
+        return cmp->op == IR_EQUAL ? CC_E : CC_NE;
+    }
+}
+
+static void guard(Asm *a, Recorder *r, Ins *x) {
+    Ins *cond = &r->ins[x->a];
+    a->offset = (uint32_t)x->snap;
+    if (!cond->fused) {
+        cmp_mem8(a, RSP, slot_disp(cond->loc), 0);
+        exit_if(a, x->expect ? CC_E : CC_NE);
+        return;
+    }
+
+    uint8_t cc = compare_numbers(a, r, cond);
+    if (cc != CC_E && cc != CC_NE) {
+        exit_if(a, x->expect ? cc ^ 1 : cc); // cc ^ 1 is the opposite
+        return;
+    }
+    // an unordered compare sets ZF too, so NaN equals nothing
+    if ((cc == CC_E) == x->expect) {
+        exit_if(a, CC_NE);
+        exit_if(a, CC_P);
+    } else {
+        size_t unordered = jcc(a, CC_P);
+        exit_if(a, CC_E);
+        patch_rel32(a, unordered, a->len);
+    }
+}
+
+// stores constant `val` as a Value, its type tag only when `tagged`
+static void store_const(Asm *a, int base, int32_t disp, Value val,
+                        bool tagged) {
+#ifdef NAN_BOXING
+    (void)tagged;
+    mov_imm(a, RAX, val);
+    store(a, base, disp, RAX);
+#else
+    if (tagged)
+        store_imm(a, false, base, disp, val.type);
+    uint64_t bits = 0;
+    if (IS_NUMBER(val))
+        bits = num_bits(AS_NUMBER(val));
+    else if (IS_BOOL(val))
+        bits = AS_BOOL(val);
+    mov_imm(a, RAX, bits);
+    store(a, base, disp + NUM_DISP, RAX);
+#endif
+}
+
+// boxes `x` into [base + disp], its type tag only when `tagged`
+static void store_ins(Asm *a, Ins *x, int base, int32_t disp, bool tagged) {
+    if (x->op == IR_CONST) {
+        store_const(a, base, disp, x->val, tagged);
+    } else if (x->type == TY_BOOL) {
+        load(a, RAX, RSP, slot_disp(x->loc));
+        store_flag(a, base, disp);
+    } else if (tagged) {
+        store_number(a, base, disp, num_reg(a, x, 0));
+    } else {
+        sse_mem(a, SSE_STORE, num_reg(a, x, 0), base, disp + NUM_DISP);
+    }
+}
+
+static void translate(Asm *a, Recorder *r, Ins *x) {
+    switch (x->op) {
+    case IR_CONST:
+        if (x->loc != NO_LOC) {
+            mov_imm(a, RAX, num_bits(AS_NUMBER(x->val)));
+            movq_to_xmm(a, 0, RAX);
+            save_num(a, x, 0);
+        }
+        break;
+    case IR_VAR: {
+        Var *var = &r->vars[x->var];
+        if (x->type == TY_NUM) {
+            sse_mem(a, SSE_LOAD, 0, var_base(var), var_disp(var) + NUM_DISP);
+            save_num(a, x, 0);
+            break;
+        }
+#ifdef NAN_BOXING
+        load(a, RAX, var_base(var), var_disp(var));
+        mov_imm(a, RCX, FALSE_VAL); // TRUE_VAL is FALSE_VAL + 1
+        alu(a, ALU_SUB, RAX, RCX);
+#else
+        rex(a, false, RAX, var_base(var)); // movzx eax, byte [...]
+        emit8(a, 0x0f);
+        emit8(a, 0xb6);
+        modrm_mem(a, RAX, var_base(var), var_disp(var) + NUM_DISP);
+#endif
+        store(a, RSP, slot_disp(x->loc), RAX);
+        break;
+    }
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_DIV: {
+        static const uint8_t ops[] = {SSE_ADD, SSE_SUB, SSE_MUL, SSE_DIV};
+        int left = num_reg(a, &r->ins[x->a], 0);
+        if (left != 0)
+            sse_reg(a, SSE_LOAD, 0, left);
+        sse_with(a, ops[x->op - IR_ADD], 0, &r->ins[x->b]);
+        save_num(a, x, 0);
+        break;
+    }
+    case IR_NEG: {
+        int val = num_reg(a, &r->ins[x->a], 0);
+        if (val != 0)
+            sse_reg(a, SSE_LOAD, 0, val);
+        mov_imm(a, RAX, (uint64_t)1 << 63);
+        movq_to_xmm(a, 1, RAX);
+        sse_reg(a, SSE_XOR, 0, 1);
+        save_num(a, x, 0);
+        break;
+    }
+    case IR_LESS:
+    case IR_LESS_EQUAL:
+    case IR_GREATER:
+    case IR_GREATER_EQUAL:
+    case IR_EQUAL:
+    case IR_NOT_EQUAL: {
+        if (x->fused)
+            break;
+        if (r->ins[x->a].type == TY_BOOL) {
+            load_bool(a, RAX, &r->ins[x->a]);
+            load_bool(a, RCX, &r->ins[x->b]);
+            emit8(a, 0x39); // cmp eax, ecx
+            emit8(a, 0xc8);
+            setcc(a, x->op == IR_EQUAL ? CC_E : CC_NE, RAX);
+            save_al(a, x);
+            break;
+        }
+        uint8_t cc = compare_numbers(a, r, x);
+        setcc(a, cc, RAX);
+        if (cc == CC_E || cc == CC_NE) {
+            setcc(a, cc == CC_E ? CC_NP : CC_P, RCX);
+            emit8(a, cc == CC_E ? 0x20 : 0x08); // and/or al, cl
+            emit8(a, 0xc8);
+        }
+        save_al(a, x);
+        break;
+    }
+    case IR_NOT:
+        load_bool(a, RAX, &r->ins[x->a]);
+        emit8(a, 0x83); // xor eax, 1
+        emit8(a, 0xf0);
+        emit8(a, 0x01);
+        store(a, RSP, slot_disp(x->loc), RAX);
+        break;
+    case IR_STORE: {
+        Var *var = &r->vars[x->var];
+        store_ins(a, &r->ins[x->a], var_base(var), var_disp(var), x->tagged);
+        break;
+    }
+    case IR_GUARD:
+        guard(a, r, x);
+        break;
+    }
+}
+
+// 64-bit copy between locations, stack to stack through xmm1
+static void move(Asm *a, int32_t dst, int32_t src) {
+    if (dst >= 0 && src >= 0) {
+        sse_reg(a, SSE_LOAD, dst, src);
+    } else if (dst >= 0) {
+        sse_mem(a, SSE_LOAD, dst, RSP, slot_disp(src));
+    } else {
+        if (src < 0) {
+            sse_mem(a, SSE_LOAD, 1, RSP, slot_disp(src));
+            src = 1;
+        }
+        sse_mem(a, SSE_STORE, src, RSP, slot_disp(dst));
+    }
+}
+
+/* Hands the values of the carried variables to their phis for the next
+ * iteration. The moves happen in parallel, so one whose destination is still
+ * to be read waits, and a cycle of them is broken through xmm0. */
+static void move_phis(Asm *a, Recorder *r) {
+    int32_t dst[TRACE_MAX_VARS], src[TRACE_MAX_VARS];
+    int count = 0;
+    for (int i = 0; i < r->var_count; i++) {
+        Ins *next = next_value(r, &r->vars[i]);
+        Ins *phi = &r->ins[r->vars[i].entry];
+        if (next == NULL || next->op == IR_CONST || next->loc == phi->loc)
+            continue;
+        dst[count] = phi->loc;
+        src[count++] = next->loc;
+    }
+
+    while (count > 0) {
+        int ready = -1;
+        for (int i = 0; i < count && ready < 0; i++) {
+            ready = i;
+            for (int j = 0; j < count; j++) {
+                if (j != i && src[j] == dst[i])
+                    ready = -1;
+            }
+        }
+
+        if (ready < 0) {
+            move(a, 0, dst[0]);
+            for (int j = 0; j < count; j++) {
+                if (src[j] == dst[0])
+                    src[j] = 0;
+            }
+            continue;
+        }
+        move(a, dst[ready], src[ready]);
+        dst[ready] = dst[--count];
+        src[ready] = src[count];
+    }
+
+    for (int i = 0; i < r->var_count; i++) {
+        Ins *next = next_value(r, &r->vars[i]);
+        if (next == NULL || next->op != IR_CONST)
+            continue;
+        Ins *phi = &r->ins[r->vars[i].entry];
+        if (phi->type == TY_BOOL) {
+            mov_imm(a, RAX, AS_BOOL(next->val));
+            store(a, RSP, slot_disp(phi->loc), RAX);
+        } else {
+            mov_imm(a, RAX, num_bits(AS_NUMBER(next->val)));
+            movq_to_xmm(a, 0, RAX);
+            save_num(a, phi, 0);
+        }
+    }
+}
+
+// the type guards on variables read first, leaving through the entry
+// snapshot before the trace has done anything
+static void guard_entry(Asm *a, Recorder *r) {
+    a->offset = 0;
+    for (int i = 0; i < r->var_count; i++) {
+        Var *var = &r->vars[i];
+        if (!var->read)
+            continue;
+
+        int base = var_base(var);
+        int32_t disp = var_disp(var);
+        if (var->type == TY_NUM) {
+            guard_number(a, base, disp);
+            continue;
+        }
+#ifdef NAN_BOXING
+        load(a, RAX, base, disp);
+        if (var->type == TY_NIL) {
+            mov_imm(a, RCX, NIL_VAL);
+            alu(a, ALU_CMP, RAX, RCX);
+            exit_if(a, CC_NE);
+        } else {
+            mov_imm(a, RCX, FALSE_VAL); // TRUE_VAL is FALSE_VAL + 1
+            alu(a, ALU_SUB, RAX, RCX);
+            cmp_imm(a, RAX, 1);
+            exit_if(a, CC_A);
+        }
+#else
+        cmp_mem32(a, base, disp, var->type == TY_NIL ? VAL_NIL : VAL_BOOL);
+        exit_if(a, CC_NE);
+#endif
+    }
+}
+
+// Rebuilds the stack of snapshot `index` above the header's depth and
+// leaves for the interpreter at its instruction.
+static void emit_exit(Asm *a, Recorder *r, int32_t index, int32_t frame) {
+    Snapshot *snap = &r->snaps[index];
+    Ins *guarded = snap->guard >= 0 ? &r->ins[r->ins[snap->guard].a] : NULL;
+
+    for (int32_t i = 0; i < snap->count; i++) {
+        Ins *x = &r->ins[r->refs[snap->start + i]];
+        if (x == guarded) {
+            // it failed the guard, so it is the other boolean
+            bool val = !r->ins[snap->guard].expect;
+            store_literal(a, SP, i * VS, val ? OP_TRUE : OP_FALSE);
+        } else {
+            store_ins(a, x, SP, i * VS, true);
+        }
+    }
+    if (snap->count > 0)
+        add_imm(a, SP, snap->count * VS);
+    if (frame > 0)
+        add_imm(a, RSP, frame);
+    mov_eax(a, snap->offset);
+}
+
+static bool assemble(Recorder *r, Trace *trace) {
+    mark_live(r);
+    hoist(r);
+    fuse(r);
+
+    int32_t *order = malloc(sizeof(int32_t) * r->len);
+    size_t *stubs = malloc(sizeof(size_t) * r->snap_count);
+    if (order == NULL || stubs == NULL)
+        exit(1);
+    int32_t loop;
+    int32_t count = layout(r, order, &loop);
+    int32_t frame = (allocate(r, order, count) * 8 + 15) / 16 * 16;
+
+    Asm a = {0};
+    emit_prologue(&a);
+    size_t entry = a.len;
+    if (frame > 0)
+        add_imm(&a, RSP, -frame);
+    for (int i = 0; i < r->var_count; i++) {
+        if (r->vars[i].global) {
+            load(&a, RBP, GLOBALS, offsetof(Globals, values));
+            break;
+        }
+    }
+    guard_entry(&a, r);
+
+    size_t top = 0;
+    for (int32_t i = 0; i < count; i++) {
+        if (i == loop)
+            top = a.len;
+        translate(&a, r, &r->ins[order[i]]);
+    }
+    if (loop == count)
+        top = a.len;
+    move_phis(&a, r);
+    patch_rel32(&a, jmp(&a), top);
+
+    // one stub per snapshot that is left through
+    PatchList to_epilogue = {0};
+    for (size_t i = 0; i < r->snap_count; i++)
+        stubs[i] = 0;
+    for (size_t i = 0; i < a.exits.len; i++) {
+        Patch *leave = &a.exits.patches[i];
+        if (stubs[leave->offset] == 0) {
+            stubs[leave->offset] = a.len;
+            emit_exit(&a, r, (int32_t)leave->offset, frame);
+            add_patch(&to_epilogue, jmp(&a), 0);
+        }
+        patch_rel32(&a, leave->at, stubs[leave->offset]);
+    }
+    size_t epilogue = emit_epilogue(&a);
+    for (size_t i = 0; i < to_epilogue.len; i++)
+        patch_rel32(&a, to_epilogue.patches[i].at, epilogue);
+
+    free(order);
+    free(stubs);
+    free(to_epilogue.patches);
+    free(a.exits.patches);
+
+    trace->code = map_code(&a, &trace->size);
+    trace->entry = entry;
+    return trace->code != NULL;
+}
+
+static bool compile(Trace *trace, ObjFunction *func, JitState *state) {
+    Recorder *r = calloc(1, sizeof(Recorder));
+    if (r == NULL)
+        exit(1);
+    r->func = func;
+    r->slots = state->slots;
+    r->depth = (int)(state->sp - state->slots);
+    r->header = trace->header;
+    snapshot(r, trace->header, -1);
+
+    bool ret = record(r) && assemble(r, trace);
+    free(r->ins);
+    free(r->snaps);
+    free(r->refs);
+    free(r);
+    return ret;
+}
+
+bool traceEnter(ObjFunction *func, JitState *state) {
+    Trace *trace = traceLoop(func, state->offset);
+    if (trace->code == NULL) {
+        if (--trace->hits > 0)
+            return false;
+        if (!compile(trace, func, state)) {
+            // try again later, maybe along another path, but not forever
+            trace->aborts++;
+            trace->hits = trace->aborts < TRACE_MAX_ABORTS
+                              ? TRACE_THRESHOLD << trace->aborts
+                              : INT32_MAX;
+            return false;
+        }
+    }
+
+    // keeps the baseline JIT's back edges leaving for the interpreter
+    trace->hits = 0;
+    enter_code(trace->code, state, trace->code + trace->entry);
+    return true;
+}
+
+#else
+
+bool traceEnter(ObjFunction *func, JitState *state) {
+    (void)func;
+    (void)state;
+    return false;
+}
+
+#endif
+
+Trace *traceLoop(ObjFunction *func, uint32_t header) {
+    for (Trace *trace = func->traces; trace != NULL; trace = trace->next) {
+        if (trace->header == header)
+            return trace;
+    }
+
+    Trace *trace = malloc(sizeof(Trace));
+    if (trace == NULL)
+        exit(1);
+    *trace = (Trace){.next = func->traces, .header = header,
+                     .hits = TRACE_THRESHOLD};
+    func->traces = trace;
+    return trace;
+}
+
+void traceFree(ObjFunction *func) {
+    Trace *trace = func->traces;
+    while (trace != NULL) {
+        Trace *next = trace->next;
+#ifdef JIT
+        if (trace->code != NULL)
+            munmap(trace->code, trace->size);
+#endif
+        free(trace);
+        trace = next;
+    }
+    func->traces = NULL;
+}
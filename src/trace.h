@@ -0,0 +1,44 @@
+#ifndef CLOX_TRACE_H
+#define CLOX_TRACE_H
+
+#include "common.h"
+#include "jit.h"
+#include "object.h"
+
+// back edges to a loop header after which the loop gets recorded
+#ifdef DEBUG_STRESS_JIT
+#define TRACE_THRESHOLD 1
+#else
+#define TRACE_THRESHOLD 100
+#endif
+
+// failed recordings of a loop after which it is left alone
+#define TRACE_MAX_ABORTS 4
+
+/* A loop of a function, known by the header its back edges jump to. It
+ * counts back edges down to recording a trace of one iteration, which is
+ * compiled to native code and entered from then on. The counter is shared
+ * with the baseline JIT, whose back edges leave for the interpreter once it
+ * runs out. */
+typedef struct Trace {
+    struct Trace *next;
+    uint32_t header; // bytecode offset of the loop header
+    int32_t hits;    // back edges left until the next recording
+    int aborts;      // recordings that failed so far
+    uint8_t *code;   // compiled trace, prologue first
+    size_t size;     // of its mapping
+    size_t entry;    // native offset of the trace itself
+} Trace;
+
+// The record for the loop at `header` in `func`, created on first use.
+Trace *traceLoop(ObjFunction *func, uint32_t header);
+
+// Counts a back edge to `state->offset`, recording the loop once it is hot.
+// Returns whether a trace ran, in which case `state` holds the stack top and
+// offset it left the loop at.
+bool traceEnter(ObjFunction *func, JitState *state);
+
+// frees `func`'s loop records and their code
+void traceFree(ObjFunction *func);
+
+#endif
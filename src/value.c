@@ -17,6 +17,8 @@ void freeValueArray(ValueArray *array) {
 }
 
 void writeValueArray(ValueArray *array, Value val) {
+    // a background marker may be reading the array, as a chunk's constants
+    gcLockHeap();
     if (array->capacity < array->len + 1) {
         size_t old_cap = array->capacity;
         array->capacity = GROW_CAPACITY(old_cap);
@@ -26,9 +28,21 @@ void writeValueArray(ValueArray *array, Value val) {
 
     array->values[array->len] = val;
     array->len++;
+    gcUnlockHeap();
 }
 
 void printValue(Value val) {
+#ifdef NAN_BOXING
+    if (IS_BOOL(val)) {
+        printf(AS_BOOL(val) ? "true" : "false");
+    } else if (IS_NIL(val)) {
+        printf("nil");
+    } else if (IS_NUMBER(val)) {
+        printf("%g", AS_NUMBER(val));
+    } else if (IS_OBJ(val)) {
+        printObject(val);
+    }
+#else
     switch (val.type) {
     case VAL_BOOL:
         printf(AS_BOOL(val) ? "true" : "false");
@@ -43,9 +57,17 @@ void printValue(Value val) {
         printObject(val);
         break;
     }
+#endif
 }
 
 bool values_equal(Value a, Value b) {
+#ifdef NAN_BOXING
+    // NaN != NaN, so numbers can't be compared bitwise
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+        return AS_NUMBER(a) == AS_NUMBER(b);
+
+    return a == b;
+#else
     if (a.type != b.type)
         return false;
 
@@ -62,4 +84,5 @@ bool values_equal(Value a, Value b) {
     default:
         return false;
     }
+#endif
 }
@@ -6,6 +6,54 @@
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+/* A Value is a single 64-bit word. Doubles are stored as-is; everything else
+ * lives inside the unused payload of a quiet NaN. Objects set the sign bit and
+ * keep their pointer in the low 48 bits, the singletons use small tags. */
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL   1 // 01
+#define TAG_FALSE 2 // 10
+#define TAG_TRUE  3 // 11
+
+typedef uint64_t Value;
+
+#define FALSE_VAL         ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL          ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define BOOL_VAL(b)       ((b) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL           ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define NUMBER_VAL(value) num_to_value(value)
+#define OBJ_VAL(object)                                                        \
+    ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object)))
+
+#define IS_BOOL(value)   (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)    ((value) == NIL_VAL)
+#define IS_NUMBER(value) (((value)&QNAN) != QNAN)
+#define IS_OBJ(value)    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value)   ((value) == TRUE_VAL)
+#define AS_NUMBER(value) value_to_num(value)
+#define AS_OBJ(value)    ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+// memcpy is the portable way to pun the bits; compilers reduce it to a move
+static inline double value_to_num(Value value) {
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value num_to_value(double num) {
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
+
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
@@ -39,6 +87,8 @@ typedef struct {
 #define AS_NUMBER(value) ((value).as.number)
 #define AS_OBJ(value)    ((value).as.obj)
 
+#endif
+
 typedef struct {
     size_t len;
     size_t capacity;
@@ -1,27 +1,42 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "channel.h"
 #include "chunk.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "log.h"
 #include "memory.h"
 #include "object.h"
+#include "trace.h"
 #include "value.h"
 #include "vm.h"
 
-VM vm;
+_Thread_local VM *vm = NULL;
+
+static void switch_fiber(ObjFiber *to);
 
 static void reset_stack() {
-    vm.stackTop = vm.stack;
-    vm.frameCount = 0;
-    vm.openUpvalues = NULL;
+    // an error ends the running fiber and all those waiting on it
+    if (vm->fiber != NULL) {
+        for (ObjFiber *fiber = vm->fiber; fiber != NULL;
+             fiber = fiber->caller) {
+            fiber->state = FIBER_DONE;
+        }
+        switch_fiber(NULL);
+    }
+
+    vm->stackTop = vm->stack;
+    vm->frameCount = 0;
+    vm->openUpvalues = NULL;
 }
 
 static void runtime_err(const char *msg, ...) {
-    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
     ObjFunction *function = frame->closure->func;
     size_t inst = frame->ip - function->chunk.code - 1;
     int line = function->chunk.lines[inst];
@@ -34,8 +49,16 @@ static void runtime_err(const char *msg, ...) {
 
     log_error("[line %d] - %s\n", line, buf);
 
-    for (int i = vm.frameCount - 1; i >= 0; i--) {
-        CallFrame *frame = &vm.frames[i];
+    // deep recursion would bury the error, so only the innermost and the
+    // outermost frames are shown
+    const int ends = 16;
+    for (int i = vm->frameCount - 1; i >= 0; i--) {
+        if (i == vm->frameCount - 1 - ends && i >= ends) {
+            fprintf(stderr, "... %d more\n", i - ends + 1);
+            i = ends - 1;
+        }
+
+        CallFrame *frame = &vm->frames[i];
         ObjFunction *func = frame->closure->func;
         size_t inst = frame->ip - func->chunk.code - 1;
         fprintf(stderr, "[line %d] in ", func->chunk.lines[inst]);
@@ -53,322 +76,962 @@ static void define_native(const char *name, NativeFn func) {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
     push(OBJ_VAL(newNative(func)));
 
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    int slot = globalSlot(AS_STRING(vm->stack[0]));
+    vm->globals.values[slot] = vm->stack[1];
+    vm->globals.defined[slot] = true;
 
     pop();
     pop();
 }
 
+int globalSlot(ObjString *name) {
+    Globals *globals = &vm->globals;
+    Value slot;
+    if (tableGet(&globals->slots, name, &slot))
+        return (int)AS_NUMBER(slot);
+
+    // the name may be fresh from the compiler, keep it rooted while growing
+    push(OBJ_VAL(name));
+    if (globals->count == globals->capacity) {
+        int old_cap = globals->capacity;
+        int capacity = GROW_CAPACITY(old_cap);
+        globals->names =
+            GROW_ARRAY(ObjString *, globals->names, old_cap, capacity);
+        globals->values = GROW_ARRAY(Value, globals->values, old_cap, capacity);
+        globals->defined =
+            GROW_ARRAY(bool, globals->defined, old_cap, capacity);
+        globals->capacity = capacity;
+    }
+
+    int index = globals->count;
+    globals->names[index] = name;
+    globals->values[index] = NIL_VAL;
+    globals->defined[index] = false;
+    globals->count++;
+    tableSet(&globals->slots, name, NUMBER_VAL(index));
+    pop();
+
+    return index;
+}
+
+static void init_globals(Globals *globals) {
+    initTable(&globals->slots);
+    globals->names = NULL;
+    globals->values = NULL;
+    globals->defined = NULL;
+    globals->count = 0;
+    globals->capacity = 0;
+}
+static void free_globals(Globals *globals) {
+    freeTable(&globals->slots);
+    FREE_ARRAY(ObjString *, globals->names, globals->capacity);
+    FREE_ARRAY(Value, globals->values, globals->capacity);
+    FREE_ARRAY(bool, globals->defined, globals->capacity);
+    init_globals(globals);
+}
+
 static Value clockNative(int arg_count, Value *args);
+static Value channelNative(int arg_count, Value *args);
+static Value sendNative(int arg_count, Value *args);
+static Value receiveNative(int arg_count, Value *args);
+static Value fiberNative(int arg_count, Value *args);
+static Value resumeNative(int arg_count, Value *args);
+static Value yieldNative(int arg_count, Value *args);
+static Value isDoneNative(int arg_count, Value *args);
+static bool reserve_stack(int count);
+
+VM *vmNew() {
+    VM *machine = malloc(sizeof(VM));
+    if (!machine) {
+        perror("malloc: ");
+        exit(1);
+    }
 
-void initVM() {
+    vm = machine;
+    vm->frames = NULL;
+    vm->frameCapacity = 0;
+    vm->frameLimit = FRAMES_MAX;
+    vm->stack = NULL;
+    vm->stackCapacity = 0;
+    vm->stackLimit = STACK_MAX;
+    vm->fiber = NULL;
+    vm->fiberSwitched = false;
     reset_stack();
-    vm.objects = NULL;
-    vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024; // arbitrary
-    vm.grayCount = 0;
-    vm.grayCapacity = 0;
-    vm.grayStack = NULL;
+    vm->heap = heapNew();
+    vm->youngBytes = 0;
+    vm->gcPhase = GC_IDLE;
+    vm->stepBytes = 0;
+    vm->gcBudget = GC_BUDGET;
+    vm->gcConcurrent = false;
+    vm->markingConcurrently = false;
+    vm->heapLocks = 0;
+    vm->marker = NULL;
+    vm->gcThreads = 1;
+    vm->markPool = NULL;
+    vm->bytesAllocated = 0;
+    vm->nextGC = 1024 * 1024; // arbitrary
+#ifdef DEBUG_GC_STATS
+    vm->gcStats = (GcStats){0};
+#endif
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+    vm->rememberedCount = 0;
+    vm->rememberedCapacity = 0;
+    vm->remembered = NULL;
 
-    initTable(&vm.strings);
-    initTable(&vm.globals);
+    initTable(&vm->strings);
+    init_globals(&vm->globals);
 
     // we set it to NULL before so that the GC does not read uninitialized
     // memory
-    vm.initString = NULL;
-    vm.initString = copyString("init", 4);
+    vm->initString = NULL;
+    vm->parser = NULL;
+
+    // room for what gets pushed outside of any frame, like the strings being
+    // interned, the natives being defined and the script
+    reserve_stack(UINT8_MAX + 1);
+    vm->initString = copyString("init", 4);
+    vm->registerOps = false;
+    vm->nativeError = NULL;
 
     define_native("clock", clockNative);
+    define_native("channel", channelNative);
+    define_native("send", sendNative);
+    define_native("receive", receiveNative);
+    define_native("fiber", fiberNative);
+    define_native("resume", resumeNative);
+    define_native("yield", yieldNative);
+    define_native("isDone", isDoneNative);
+    return machine;
+}
+VMOptions vmDefaultOptions() {
+    return (VMOptions){
+        .registerOps = false,
+        .gcBudget = GC_BUDGET,
+        .gcConcurrent = false,
+        .gcThreads = 1,
+    };
+}
+
+void vmConfigure(VM *machine, const VMOptions *options) {
+    machine->registerOps = options->registerOps;
+    machine->gcBudget = options->gcBudget;
+    machine->gcConcurrent = options->gcConcurrent;
+    machine->gcThreads = options->gcThreads;
 }
-void freeVM() {
-    freeTable(&vm.strings);
-    freeTable(&vm.globals);
 
-    vm.initString = NULL;
+void vmFree(VM *machine) {
+    VM *running = vm;
+    vm = machine;
+
+    freeTable(&vm->strings);
+    free_globals(&vm->globals);
+    FREE_ARRAY(CallFrame, vm->frames, vm->frameCapacity);
+    FREE_ARRAY(Value, vm->stack, vm->stackCapacity);
+    vm->initString = NULL;
     freeObjects();
+    free(machine);
+
+    vm = running == machine ? NULL : running;
 }
 
-static inline Value peek(int dist) { return vm.stackTop[-dist - 1]; }
+static inline Value peek(int dist) { return vm->stackTop[-dist - 1]; }
 static bool call(ObjClosure *closure, int arg_count);
 static bool call_value(Value callee, int arg_count);
+static bool tail_call(Value callee, int arg_count);
 static ObjUpvalue *capture_upvalue(Value *local);
 static void close_upvalues(Value *last);
 static void concatenate();
+static void finish_fiber(Value ret);
 static void define_method(ObjString *name);
-static bool bind_method(ObjClass *klass, ObjString *name);
-static bool invoke(ObjString *name, int arg_count);
+static bool get_property(ObjInstance *inst, InlineCache *cache);
+static void set_property(ObjInstance *inst, InlineCache *cache, Value val);
+static bool invoke(InlineCache *cache, int arg_count);
+
+// counts a call or loop back edge, compiling the function once it gets hot
+static inline void count_hot(ObjFunction *func) {
+#ifdef JIT
+    if (func->jit == NULL && ++func->hotness == JIT_THRESHOLD) {
+        jitCompile(func);
+    }
+#else
+    (void)func;
+#endif
+}
+
+/* run() keeps the hot interpreter state in locals so the compiler can hold
+ * them in registers: the instruction pointer, the frame's slot window, its
+ * constant table and the stack top. They are written back (STORE_FRAME) before
+ * anything that can inspect them, i.e. calls, allocations that may trigger the
+ * GC and runtime errors, and reloaded (LOAD_FRAME) when the frame changes. */
+#define READ_BYTE() (*ip++)
 
-#define READ_BYTE() (*frame->ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 
-#define READ_SHORT()                                                           \
-    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_LONG()                                                            \
+    (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
 
-#define READ_CONSTANT()                                                        \
-    (frame->closure->func->chunk.constants.values[READ_BYTE()])
+// operand of an instruction sharing its handler with the _LONG variant;
+// ip[-1] is still the opcode just dispatched on
+#define READ_INDEX(op) (ip[-1] == (op) ? READ_BYTE() : READ_LONG())
+
+#define READ_CONSTANT() (constants[READ_BYTE()])
 
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 
+#define READ_CACHE() (&caches[READ_SHORT()])
+
+#define PUSH(val)  (*sp++ = (val))
+#define POP()      (*--sp)
+#define PEEK(dist) (sp[-(dist)-1])
+
+#define STORE_FRAME() (frame->ip = ip, machine->stackTop = sp)
+#define LOAD_FRAME()                                                           \
+    do {                                                                       \
+        frame = &machine->frames[machine->frameCount - 1];                     \
+        ip = frame->ip;                                                        \
+        slots = frame->slots;                                                  \
+        constants = frame->closure->func->chunk.constants.values;              \
+        caches = frame->closure->func->chunk.caches;                           \
+        sp = machine->stackTop;                                                \
+    } while (false)
+
+/* Hands the frame to its native code, if it has any, at the current
+ * instruction. It returns at the first instruction it cannot run, with the
+ * stack top and offset updated, and the interpreter goes on from there. This
+ * happens on entry to a frame and on loop back edges. */
+#ifdef JIT
+#define RUN_JIT()                                                              \
+    do {                                                                       \
+        ObjFunction *func = frame->closure->func;                              \
+        if (func->jit != NULL) {                                               \
+            JitState state = {slots, sp, constants,                            \
+                              (uint32_t)(ip - func->chunk.code)};              \
+            jitRun(func->jit, &state);                                         \
+            sp = state.sp;                                                     \
+            ip = func->chunk.code + state.offset;                              \
+        }                                                                      \
+    } while (false)
+
+// Runs the trace of the loop at `ip` once the loop is hot, see trace.h. The
+// trace leaves the loop where a guard fails, mostly at its exit condition.
+#define RUN_TRACE()                                                            \
+    do {                                                                       \
+        ObjFunction *func = frame->closure->func;                              \
+        JitState state = {slots, sp, constants,                                \
+                          (uint32_t)(ip - func->chunk.code)};                  \
+        if (traceEnter(func, &state)) {                                        \
+            sp = state.sp;                                                     \
+            ip = func->chunk.code + state.offset;                              \
+        }                                                                      \
+    } while (false)
+#else
+#define RUN_JIT()   ((void)0)
+#define RUN_TRACE() ((void)0)
+#endif
+
+#define RUNTIME_ERR(...)                                                       \
+    do {                                                                       \
+        STORE_FRAME();                                                         \
+        runtime_err(__VA_ARGS__);                                              \
+        return INTERPRET_RUNTIME_ERR;                                          \
+    } while (false)
+
+// `a <= b` and `a >= b` are !(a > b) and !(a < b), so both hold for NaN
+#define NOT_BOOL_VAL(b) BOOL_VAL(!(b))
+
 #define BINARY_OP(valueType, op)                                               \
     do {                                                                       \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                      \
-            runtime_err("Operands must be numbers");                           \
-            return INTERPRET_RUNTIME_ERR;                                      \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                      \
+            RUNTIME_ERR("Operands must be numbers");                           \
         }                                                                      \
-        double b = AS_NUMBER(pop());                                           \
-        double a = AS_NUMBER(pop());                                           \
-        push(valueType(a op b));                                               \
+        double b = AS_NUMBER(POP());                                           \
+        double a = AS_NUMBER(POP());                                           \
+        PUSH(valueType(a op b));                                               \
     } while (false)
 
-static InterpretResult run() {
-    CallFrame *frame = &vm.frames[vm.frameCount - 1];
-    uint8_t inst;
+/* Three-address instructions: the destination and left operand are frame
+ * slots, the right one a slot or, for the _RK forms, a constant. */
+#define READ_REGISTER() (slots[READ_BYTE()])
+
+#define REGISTER_OP(rk_op, op)                                                 \
+    do {                                                                       \
+        uint8_t inst = ip[-1];                                                 \
+        Value *dest = &READ_REGISTER();                                        \
+        Value a = READ_REGISTER();                                             \
+        Value b = inst == (rk_op) ? READ_CONSTANT() : READ_REGISTER();         \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                  \
+            RUNTIME_ERR("Operands must be numbers");                           \
+        }                                                                      \
+        *dest = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b));                      \
+    } while (false)
 
-    while (true) {
 #ifdef DEBUG_TRACE_EXEC
-        printf("       ");
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(
-            &frame->closure->func->chunk,
-            (int)(frame->ip - frame->closure->func->chunk.code));
+static void trace_exec(CallFrame *frame) {
+    printf("       ");
+    for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassembleInstruction(&frame->closure->func->chunk,
+                           (int)(frame->ip - frame->closure->func->chunk.code));
+}
+#define TRACE_EXEC() (STORE_FRAME(), trace_exec(frame))
+#else
+#define TRACE_EXEC() ((void)0)
 #endif
 
+static inline CacheEntry *cache_lookup(InlineCache *cache, ObjShape *shape) {
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->entries[i].shape == shape)
+            return &cache->entries[i];
+    }
+
+    return NULL;
+}
+
+// An open upvalue writes into the stack of its fiber, which is what the
+// barrier has to record. The main fiber's stacks are roots.
+static inline void set_upvalue(ObjUpvalue *upvalue, Value val) {
+    gcStoreValue(upvalue->location, val);
+    if (upvalue->location == &upvalue->closed) {
+        writeBarrier(&upvalue->obj, val);
+    } else if (upvalue->fiber != NULL) {
+        writeBarrier(&upvalue->fiber->obj, val);
+    }
+}
+
+/* With labels-as-values every handler jumps straight to the next one through
+ * the dispatch table, so each opcode gets its own indirect branch (and its own
+ * prediction history) instead of sharing the single one at the top of the
+ * switch. Labels-as-values are a GNU extension, hence the pedantic pragma. */
+#ifdef COMPUTED_GOTO
+#define CASE(op) op_##op
+#define DISPATCH()                                                             \
+    do {                                                                       \
+        TRACE_EXEC();                                                          \
+        goto *dispatch_table[READ_BYTE()];                                     \
+    } while (false)
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#else
+#define CASE(op)   case op
+#define DISPATCH() continue
+#endif
+
+static InterpretResult run() {
+    VM *const machine = vm; // one load of the thread's VM, not one per use
+    CallFrame *frame;
+    uint8_t *ip;
+    Value *slots;
+    Value *constants;
+    InlineCache *caches;
+    Value *sp;
+
+    LOAD_FRAME();
+    RUN_JIT();
+
+#ifdef COMPUTED_GOTO
+    static void *dispatch_table[] = {
+        [OP_CONSTANT] = &&op_OP_CONSTANT,
+        [OP_CONSTANT_LONG] = &&op_OP_CONSTANT_LONG,
+        [OP_NIL] = &&op_OP_NIL,
+        [OP_FALSE] = &&op_OP_FALSE,
+        [OP_TRUE] = &&op_OP_TRUE,
+        [OP_POP] = &&op_OP_POP,
+        [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+        [OP_GET_LOCAL_LONG] = &&op_OP_GET_LOCAL_LONG,
+        [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+        [OP_SET_LOCAL_LONG] = &&op_OP_SET_LOCAL_LONG,
+        [OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+        [OP_GET_GLOBAL_LONG] = &&op_OP_GET_GLOBAL_LONG,
+        [OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+        [OP_SET_GLOBAL_LONG] = &&op_OP_SET_GLOBAL_LONG,
+        [OP_GET_UPVALUE] = &&op_OP_GET_UPVALUE,
+        [OP_GET_UPVALUE_LONG] = &&op_OP_GET_UPVALUE_LONG,
+        [OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+        [OP_SET_UPVALUE_LONG] = &&op_OP_SET_UPVALUE_LONG,
+        [OP_GET_PROPERTY] = &&op_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&op_OP_SET_PROPERTY,
+        [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+        [OP_DEFINE_GLOBAL_LONG] = &&op_OP_DEFINE_GLOBAL_LONG,
+        [OP_EQUAL] = &&op_OP_EQUAL,
+        [OP_NOT_EQUAL] = &&op_OP_NOT_EQUAL,
+        [OP_GREATER] = &&op_OP_GREATER,
+        [OP_GREATER_EQUAL] = &&op_OP_GREATER_EQUAL,
+        [OP_LESS] = &&op_OP_LESS,
+        [OP_LESS_EQUAL] = &&op_OP_LESS_EQUAL,
+        [OP_ADD] = &&op_OP_ADD,
+        [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&op_OP_MULTIPLY,
+        [OP_DIVIDE] = &&op_OP_DIVIDE,
+        [OP_NOT] = &&op_OP_NOT,
+        [OP_NEGATE] = &&op_OP_NEGATE,
+        [OP_PRINT] = &&op_OP_PRINT,
+        [OP_JUMP] = &&op_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+        [OP_POP_JUMP_IF_FALSE] = &&op_OP_POP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&op_OP_LOOP,
+        [OP_CALL] = &&op_OP_CALL,
+        [OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+        [OP_CLOSURE] = &&op_OP_CLOSURE,
+        [OP_CLOSURE_LONG] = &&op_OP_CLOSURE_LONG,
+        [OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+        [OP_CLASS] = &&op_OP_CLASS,
+        [OP_CLASS_LONG] = &&op_OP_CLASS_LONG,
+        [OP_METHOD] = &&op_OP_METHOD,
+        [OP_METHOD_LONG] = &&op_OP_METHOD_LONG,
+        [OP_INVOKE] = &&op_OP_INVOKE,
+        [OP_RETURN] = &&op_OP_RETURN,
+        [OP_GET_LOCAL_GET_LOCAL] = &&op_OP_GET_LOCAL_GET_LOCAL,
+        [OP_GET_LOCAL_CONSTANT] = &&op_OP_GET_LOCAL_CONSTANT,
+        [OP_GET_LOCAL_PROPERTY] = &&op_OP_GET_LOCAL_PROPERTY,
+        [OP_SET_LOCAL_POP] = &&op_OP_SET_LOCAL_POP,
+        [OP_LESS_JUMP_IF_FALSE] = &&op_OP_LESS_JUMP_IF_FALSE,
+        [OP_ADD_NUM] = &&op_OP_ADD_NUM,
+        [OP_ADD_STR] = &&op_OP_ADD_STR,
+        [OP_EQUAL_NUM] = &&op_OP_EQUAL_NUM,
+        [OP_NOT_EQUAL_NUM] = &&op_OP_NOT_EQUAL_NUM,
+        [OP_ADD_ANY] = &&op_OP_ADD_ANY,
+        [OP_EQUAL_ANY] = &&op_OP_EQUAL_ANY,
+        [OP_NOT_EQUAL_ANY] = &&op_OP_NOT_EQUAL_ANY,
+        [OP_ADD_RR] = &&op_OP_ADD_RR,
+        [OP_ADD_RK] = &&op_OP_ADD_RK,
+        [OP_SUBTRACT_RR] = &&op_OP_SUBTRACT_RR,
+        [OP_SUBTRACT_RK] = &&op_OP_SUBTRACT_RK,
+        [OP_MULTIPLY_RR] = &&op_OP_MULTIPLY_RR,
+        [OP_MULTIPLY_RK] = &&op_OP_MULTIPLY_RK,
+        [OP_DIVIDE_RR] = &&op_OP_DIVIDE_RR,
+        [OP_DIVIDE_RK] = &&op_OP_DIVIDE_RK,
+        [OP_LESS_RR_JUMP] = &&op_OP_LESS_RR_JUMP,
+        [OP_LESS_RK_JUMP] = &&op_OP_LESS_RK_JUMP,
+    };
+
+    DISPATCH();
+#else
+    uint8_t inst;
+    while (true) {
+        TRACE_EXEC();
+
         switch (inst = READ_BYTE()) {
-        case OP_CONSTANT: {
+#endif
+        CASE(OP_CONSTANT): {
             Value constant = READ_CONSTANT();
-            push(constant);
-            break;
-        }
-        case OP_NIL:
-            push(NIL_VAL);
-            break;
-        case OP_FALSE:
-            push(BOOL_VAL(false));
-            break;
-        case OP_TRUE:
-            push(BOOL_VAL(true));
-            break;
-        case OP_POP:
-            pop();
-            break;
-        case OP_GET_LOCAL: {
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(OP_CONSTANT_LONG): {
+            Value constant = constants[READ_LONG()];
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(OP_NIL):
+            PUSH(NIL_VAL);
+            DISPATCH();
+        CASE(OP_FALSE):
+            PUSH(BOOL_VAL(false));
+            DISPATCH();
+        CASE(OP_TRUE):
+            PUSH(BOOL_VAL(true));
+            DISPATCH();
+        CASE(OP_POP):
+            sp--;
+            DISPATCH();
+        CASE(OP_GET_LOCAL): {
             uint8_t slot = READ_BYTE();
-            push(frame->slots[slot]);
-            break;
+            PUSH(slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_LONG): {
+            uint16_t slot = READ_SHORT();
+            PUSH(slots[slot]);
+            DISPATCH();
         }
-        case OP_SET_LOCAL: {
+        CASE(OP_SET_LOCAL): {
             uint8_t slot = READ_BYTE();
-            frame->slots[slot] = peek(0);
-            break;
-        }
-        case OP_GET_GLOBAL: {
-            ObjString *name = READ_STRING();
-            Value val;
-            if (!tableGet(&vm.globals, name, &val)) {
-                runtime_err("Undefined variable '%s'", name->chars);
-                return INTERPRET_RUNTIME_ERR;
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL_LONG): {
+            uint16_t slot = READ_SHORT();
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_GET_LOCAL): {
+            uint8_t first = READ_BYTE();
+            uint8_t second = READ_BYTE();
+            sp[0] = slots[first];
+            sp[1] = slots[second];
+            sp += 2;
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_CONSTANT): {
+            uint8_t slot = READ_BYTE();
+            sp[0] = slots[slot];
+            sp[1] = READ_CONSTANT();
+            sp += 2;
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL_POP): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = POP();
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL):
+        CASE(OP_GET_GLOBAL_LONG): {
+            uint32_t slot = READ_INDEX(OP_GET_GLOBAL);
+            if (!machine->globals.defined[slot]) {
+                RUNTIME_ERR("Undefined variable '%s'",
+                            machine->globals.names[slot]->chars);
             }
-            push(val);
-            break;
-        }
-        case OP_SET_GLOBAL: {
-            ObjString *name = READ_STRING();
-            if (tableSet(&vm.globals, name, peek(0))) {
-                tableDelete(&vm.globals, name);
-                runtime_err("Undefined variable '%s'", name->chars);
-                return INTERPRET_RUNTIME_ERR;
+            PUSH(machine->globals.values[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL):
+        CASE(OP_SET_GLOBAL_LONG): {
+            uint32_t slot = READ_INDEX(OP_SET_GLOBAL);
+            if (!machine->globals.defined[slot]) {
+                RUNTIME_ERR("Undefined variable '%s'",
+                            machine->globals.names[slot]->chars);
             }
-            break;
+            machine->globals.values[slot] = PEEK(0);
+            DISPATCH();
         }
-        case OP_GET_UPVALUE: {
+        CASE(OP_GET_UPVALUE): {
             uint8_t slot = READ_BYTE();
-            push(*frame->closure->upvalues[slot]->location);
-            break;
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
         }
-        case OP_SET_UPVALUE: {
-            uint8_t slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
-            break;
+        CASE(OP_GET_UPVALUE_LONG): {
+            uint16_t slot = READ_SHORT();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
         }
-        case OP_GET_PROPERTY: {
-            if (!IS_INSTANCE(peek(0))) {
-                runtime_err("Only instances have properties");
-                return INTERPRET_RUNTIME_ERR;
+        CASE(OP_SET_UPVALUE): {
+            set_upvalue(frame->closure->upvalues[READ_BYTE()], PEEK(0));
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE_LONG): {
+            set_upvalue(frame->closure->upvalues[READ_SHORT()], PEEK(0));
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_PROPERTY):
+            PUSH(slots[READ_BYTE()]);
+            // the cache operand follows, as for OP_GET_PROPERTY
+            goto get_property;
+        CASE(OP_GET_PROPERTY):
+        get_property: {
+            InlineCache *cache = READ_CACHE();
+            if (!IS_INSTANCE(PEEK(0))) {
+                RUNTIME_ERR("Only instances have properties");
             }
 
-            ObjInstance *inst = AS_INSTANCE(peek(0));
-            ObjString *name = READ_STRING();
+            ObjInstance *inst = AS_INSTANCE(PEEK(0));
+            CacheEntry *entry = cache_lookup(cache, inst->shape);
+            if (entry != NULL) {
+                if (entry->slot >= 0) {
+                    // replaces the instance
+                    PEEK(0) = inst->fields[entry->slot];
+                    DISPATCH();
+                }
 
-            Value val;
-            if (tableGet(&inst->fields, name, &val)) {
-                pop(); // Instance
-                push(val);
-                break;
+                STORE_FRAME();
+                ObjBoundMethod *bound =
+                    newBoundMethod(PEEK(0), AS_CLOSURE(entry->method));
+                PEEK(0) = OBJ_VAL(bound);
+                DISPATCH();
             }
 
-            if (!bind_method(inst->klass, name)) {
+            STORE_FRAME();
+            if (!get_property(inst, cache)) {
                 return INTERPRET_RUNTIME_ERR;
             }
+            sp = machine->stackTop;
 
-            break;
+            DISPATCH();
         }
-        case OP_SET_PROPERTY: {
-            if (!IS_INSTANCE(peek(1))) {
-                runtime_err("Only instances have fields");
-                return INTERPRET_RUNTIME_ERR;
+        CASE(OP_SET_PROPERTY): {
+            InlineCache *cache = READ_CACHE();
+            if (!IS_INSTANCE(PEEK(1))) {
+                RUNTIME_ERR("Only instances have fields");
+            }
+
+            ObjInstance *inst = AS_INSTANCE(PEEK(1));
+            CacheEntry *entry = cache_lookup(cache, inst->shape);
+            if (entry != NULL && entry->transition == NULL) {
+                gcStoreValue(&inst->fields[entry->slot], PEEK(0));
+                writeBarrier(&inst->obj, PEEK(0));
+            } else if (entry != NULL && entry->slot < inst->fieldCapacity) {
+                gcStoreValue(&inst->fields[entry->slot], PEEK(0));
+                gcStore(&inst->shape, entry->transition);
+                writeBarrier(&inst->obj, PEEK(0));
+                writeBarrier(&inst->obj, OBJ_VAL(entry->transition));
+            } else {
+                STORE_FRAME();
+                set_property(inst, cache, PEEK(0));
+            }
+
+            Value val = POP();
+            PEEK(0) = val;
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL):
+        CASE(OP_DEFINE_GLOBAL_LONG): {
+            uint32_t slot = READ_INDEX(OP_DEFINE_GLOBAL);
+            machine->globals.values[slot] = POP();
+            machine->globals.defined[slot] = true;
+            DISPATCH();
+        }
+        CASE(OP_EQUAL): {
+            if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                *--ip = OP_EQUAL_NUM;
+                DISPATCH();
+            }
+            goto equal;
+        }
+        CASE(OP_EQUAL_ANY):
+        equal: {
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VAL(values_equal(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_EQUAL_NUM): {
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                *--ip = OP_EQUAL_ANY;
+                DISPATCH();
+            }
+
+            double b = AS_NUMBER(POP());
+            PEEK(0) = BOOL_VAL(AS_NUMBER(PEEK(0)) == b);
+            DISPATCH();
+        }
+        CASE(OP_NOT_EQUAL): {
+            if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                *--ip = OP_NOT_EQUAL_NUM;
+                DISPATCH();
+            }
+            goto not_equal;
+        }
+        CASE(OP_NOT_EQUAL_ANY):
+        not_equal: {
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VAL(!values_equal(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_NOT_EQUAL_NUM): {
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                *--ip = OP_NOT_EQUAL_ANY;
+                DISPATCH();
             }
 
-            ObjInstance *inst = AS_INSTANCE(peek(1));
-            tableSet(&inst->fields, READ_STRING(), peek(0));
-            Value val = pop();
-            pop();
-            push(val);
-            break;
-        }
-        case OP_DEFINE_GLOBAL: {
-            ObjString *name = READ_STRING();
-            tableSet(&vm.globals, name, peek(0));
-            pop();
-            break;
-        }
-        case OP_EQUAL: {
-            Value b = pop();
-            Value a = pop();
-            push(BOOL_VAL(values_equal(a, b)));
-            break;
-        }
-        case OP_GREATER:
+            double b = AS_NUMBER(POP());
+            PEEK(0) = BOOL_VAL(AS_NUMBER(PEEK(0)) != b);
+            DISPATCH();
+        }
+        CASE(OP_GREATER):
             BINARY_OP(BOOL_VAL, >);
-            break;
-        case OP_LESS:
+            DISPATCH();
+        CASE(OP_GREATER_EQUAL):
+            BINARY_OP(NOT_BOOL_VAL, <);
+            DISPATCH();
+        CASE(OP_LESS):
             BINARY_OP(BOOL_VAL, <);
-            break;
-        case OP_ADD: {
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                concatenate();
-            } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a + b));
+            DISPATCH();
+        CASE(OP_LESS_EQUAL):
+            BINARY_OP(NOT_BOOL_VAL, >);
+            DISPATCH();
+        CASE(OP_ADD):
+            // the site runs again as the variant for these operands
+            if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                *--ip = OP_ADD_NUM;
+            } else if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+                *--ip = OP_ADD_STR;
             } else {
-                runtime_err("Operands must be two numbers or two strings");
-                return INTERPRET_RUNTIME_ERR;
+                RUNTIME_ERR("Operands must be two numbers or two strings");
+            }
+            DISPATCH();
+        CASE(OP_ADD_NUM): {
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                *--ip = OP_ADD_ANY;
+                DISPATCH();
             }
-            break;
+
+            double b = AS_NUMBER(POP());
+            PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) + b);
+            DISPATCH();
         }
-        case OP_SUBTRACT:
+        CASE(OP_ADD_STR):
+            if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))) {
+                *--ip = OP_ADD_ANY;
+                DISPATCH();
+            }
+
+            STORE_FRAME();
+            concatenate();
+            sp = machine->stackTop;
+            DISPATCH();
+        CASE(OP_ADD_ANY):
+            if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                double b = AS_NUMBER(POP());
+                PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) + b);
+            } else if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+                STORE_FRAME();
+                concatenate();
+                sp = machine->stackTop;
+            } else {
+                RUNTIME_ERR("Operands must be two numbers or two strings");
+            }
+            DISPATCH();
+        CASE(OP_SUBTRACT):
             BINARY_OP(NUMBER_VAL, -);
-            break;
-        case OP_MULTIPLY:
+            DISPATCH();
+        CASE(OP_MULTIPLY):
             BINARY_OP(NUMBER_VAL, *);
-            break;
-        case OP_DIVIDE:
+            DISPATCH();
+        CASE(OP_DIVIDE):
             BINARY_OP(NUMBER_VAL, /);
-            break;
-        case OP_NOT:
-            push(BOOL_VAL(is_falsey(pop())));
-            break;
-        case OP_NEGATE:
-            if (!IS_NUMBER(peek(0))) {
-                runtime_err("Operand must be a number");
-                return INTERPRET_RUNTIME_ERR;
+            DISPATCH();
+        CASE(OP_NOT):
+            PEEK(0) = BOOL_VAL(is_falsey(PEEK(0)));
+            DISPATCH();
+        CASE(OP_NEGATE):
+            if (!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERR("Operand must be a number");
             }
 
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
-            break;
-        case OP_PRINT:
-            printValue(pop());
+            PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+            DISPATCH();
+        CASE(OP_PRINT):
+            printValue(POP());
             printf("\n");
-            break;
-        case OP_JUMP: {
+            DISPATCH();
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            ip += (is_falsey(PEEK(0)) * offset);
+            DISPATCH();
+        }
+        CASE(OP_POP_JUMP_IF_FALSE): {
             uint16_t offset = READ_SHORT();
-            frame->ip += offset;
-            break;
+            ip += (is_falsey(POP()) * offset);
+            DISPATCH();
         }
-        case OP_JUMP_IF_FALSE: {
+        CASE(OP_LESS_JUMP_IF_FALSE): {
+            // checked before reading the offset so errors report the line
+            // of the comparison
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                RUNTIME_ERR("Operands must be numbers");
+            }
             uint16_t offset = READ_SHORT();
-            frame->ip += (is_falsey(peek(0)) * offset);
-            break;
+            double b = AS_NUMBER(POP());
+            double a = AS_NUMBER(POP());
+            ip += !(a < b) * offset;
+            DISPATCH();
+        }
+        CASE(OP_ADD_RR):
+        CASE(OP_ADD_RK): {
+            uint8_t inst = ip[-1];
+            Value *dest = &READ_REGISTER();
+            Value a = READ_REGISTER();
+            Value b = inst == OP_ADD_RK ? READ_CONSTANT() : READ_REGISTER();
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                *dest = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+            } else if (IS_STRING(a) && IS_STRING(b)) {
+                PUSH(a);
+                PUSH(b);
+                STORE_FRAME();
+                concatenate();
+                sp = machine->stackTop;
+                *dest = POP();
+            } else {
+                RUNTIME_ERR("Operands must be two numbers or two strings");
+            }
+            DISPATCH();
         }
-        case OP_LOOP: {
+        CASE(OP_SUBTRACT_RR):
+        CASE(OP_SUBTRACT_RK):
+            REGISTER_OP(OP_SUBTRACT_RK, -);
+            DISPATCH();
+        CASE(OP_MULTIPLY_RR):
+        CASE(OP_MULTIPLY_RK):
+            REGISTER_OP(OP_MULTIPLY_RK, *);
+            DISPATCH();
+        CASE(OP_DIVIDE_RR):
+        CASE(OP_DIVIDE_RK):
+            REGISTER_OP(OP_DIVIDE_RK, /);
+            DISPATCH();
+        CASE(OP_LESS_RR_JUMP):
+        CASE(OP_LESS_RK_JUMP): {
+            uint8_t inst = ip[-1];
+            Value a = READ_REGISTER();
+            Value b =
+                inst == OP_LESS_RK_JUMP ? READ_CONSTANT() : READ_REGISTER();
             uint16_t offset = READ_SHORT();
-            frame->ip -= offset;
-            break;
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                RUNTIME_ERR("Operands must be numbers");
+            }
+            ip += !(AS_NUMBER(a) < AS_NUMBER(b)) * offset;
+            DISPATCH();
         }
-        case OP_CALL: {
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            count_hot(frame->closure->func);
+            RUN_TRACE();
+            RUN_JIT();
+            DISPATCH();
+        }
+        CASE(OP_CALL): {
+            int arg_count = READ_BYTE();
+            STORE_FRAME();
+            if (!call_value(PEEK(arg_count), arg_count)) {
+                return INTERPRET_RUNTIME_ERR;
+            }
+            LOAD_FRAME();
+            RUN_JIT();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_CALL): {
             int arg_count = READ_BYTE();
-            if (!call_value(peek(arg_count), arg_count)) {
+            STORE_FRAME();
+            if (!tail_call(PEEK(arg_count), arg_count)) {
                 return INTERPRET_RUNTIME_ERR;
             }
-            frame = &vm.frames[vm.frameCount - 1];
-            break;
+            LOAD_FRAME();
+            RUN_JIT();
+            DISPATCH();
         }
-        case OP_CLOSURE: {
-            ObjFunction *func = AS_FUNC(READ_CONSTANT());
+        CASE(OP_CLOSURE):
+        CASE(OP_CLOSURE_LONG): {
+            bool wide = ip[-1] == OP_CLOSURE_LONG;
+            ObjFunction *func = AS_FUNC(constants[READ_INDEX(OP_CLOSURE)]);
+            STORE_FRAME();
             ObjClosure *closure = newClosure(func);
-            push(OBJ_VAL(closure));
+            PUSH(OBJ_VAL(closure));
+            machine->stackTop = sp; // keep the closure rooted while capturing
 
             for (int i = 0; i < closure->upvalueCount; i++) {
                 uint8_t isLocal = READ_BYTE();
-                uint8_t index = READ_BYTE();
+                uint16_t index = wide ? READ_SHORT() : READ_BYTE();
 
                 if (isLocal) {
-                    closure->upvalues[i] =
-                        capture_upvalue(frame->slots + index);
+                    gcStore(&closure->upvalues[i],
+                            capture_upvalue(slots + index));
                 } else {
-                    closure->upvalues[i] = frame->closure->upvalues[index];
+                    gcStore(&closure->upvalues[i],
+                            frame->closure->upvalues[index]);
                 }
+                // capturing allocates, which may have made the closure old
+                writeBarrier(&closure->obj, OBJ_VAL(closure->upvalues[i]));
             }
-            break;
-        }
-        case OP_CLOSE_UPVALUE:
-            close_upvalues(vm.stackTop - 1);
-            pop();
-            break;
-        case OP_CLASS:
-            push(OBJ_VAL(newClass(READ_STRING())));
-            break;
-        case OP_METHOD:
-            define_method(READ_STRING());
-            break;
-        case OP_INVOKE: {
-            ObjString *method = READ_STRING();
+            DISPATCH();
+        }
+        CASE(OP_CLOSE_UPVALUE):
+            close_upvalues(sp - 1);
+            sp--;
+            DISPATCH();
+        CASE(OP_CLASS):
+        CASE(OP_CLASS_LONG): {
+            ObjString *name = AS_STRING(constants[READ_INDEX(OP_CLASS)]);
+            STORE_FRAME();
+            PUSH(OBJ_VAL(newClass(name)));
+            DISPATCH();
+        }
+        CASE(OP_METHOD):
+        CASE(OP_METHOD_LONG): {
+            ObjString *name = AS_STRING(constants[READ_INDEX(OP_METHOD)]);
+            STORE_FRAME();
+            define_method(name);
+            sp = machine->stackTop;
+            DISPATCH();
+        }
+        CASE(OP_INVOKE): {
+            InlineCache *cache = READ_CACHE();
             int arg_count = READ_BYTE();
-            if (!invoke(method, arg_count)) {
+            STORE_FRAME();
+
+            Value receiver = PEEK(arg_count);
+            CacheEntry *entry;
+            if (IS_INSTANCE(receiver) &&
+                (entry = cache_lookup(cache, AS_INSTANCE(receiver)->shape)) &&
+                entry->slot < 0) {
+                if (!call(AS_CLOSURE(entry->method), arg_count)) {
+                    return INTERPRET_RUNTIME_ERR;
+                }
+            } else if (!invoke(cache, arg_count)) {
                 return INTERPRET_RUNTIME_ERR;
             }
-            frame = &vm.frames[vm.frameCount - 1];
-            break;
-        }
-        case OP_RETURN: {
-            Value ret = pop();
-            close_upvalues(frame->slots);
-            vm.frameCount--;
-            if (vm.frameCount == 0) {
-                pop(); // pop the main function
-                return INTERPRET_OK;
+            LOAD_FRAME();
+            RUN_JIT();
+            DISPATCH();
+        }
+        CASE(OP_RETURN): {
+            Value ret = POP();
+            close_upvalues(slots);
+            machine->frameCount--;
+            if (machine->frameCount == 0) {
+                machine->stackTop = sp - 1; // pop the main function
+                if (machine->fiber == NULL) {
+                    return INTERPRET_OK;
+                }
+
+                finish_fiber(ret);
+                LOAD_FRAME();
+                RUN_JIT();
+                DISPATCH();
             }
 
-            vm.stackTop = frame->slots;
-            push(ret);
-            frame = &vm.frames[vm.frameCount - 1];
-            break;
+            machine->stackTop = slots;
+            *machine->stackTop++ = ret;
+            LOAD_FRAME();
+            RUN_JIT();
+            DISPATCH();
         }
+#ifndef COMPUTED_GOTO
         }
     }
+#endif
 }
 
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+#undef CASE
+#undef DISPATCH
+#undef TRACE_EXEC
 #undef BINARY_OP
+#undef NOT_BOOL_VAL
+#undef REGISTER_OP
+#undef READ_REGISTER
+#undef RUNTIME_ERR
+#undef RUN_JIT
+#undef RUN_TRACE
+#undef LOAD_FRAME
+#undef STORE_FRAME
+#undef PEEK
+#undef POP
+#undef PUSH
+#undef READ_CACHE
 #undef READ_STRING
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_LONG
+#undef READ_INDEX
 #undef READ_CONSTANT
 
-InterpretResult interpret(const char *src) {
+InterpretResult vmInterpret(VM *machine, const char *src) {
+    vm = machine;
     ObjFunction *func = compile(src);
     if (func == NULL)
         return INTERPRET_COMPILE_ERR;
@@ -383,13 +1046,13 @@ InterpretResult interpret(const char *src) {
 }
 
 void push(Value val) {
-    *vm.stackTop = val;
-    vm.stackTop++;
+    *vm->stackTop = val;
+    vm->stackTop++;
 }
 
 Value pop() {
-    vm.stackTop--;
-    return *vm.stackTop;
+    vm->stackTop--;
+    return *vm->stackTop;
 }
 
 static void concatenate() {
@@ -408,6 +1071,62 @@ static void concatenate() {
     push(OBJ_VAL(ret));
 }
 
+// values the runtime pushes on top of a frame's own to keep what it allocates
+// rooted, like a string being interned
+#define STACK_SCRATCH 8
+
+/* Both stacks grow on calls, by doubling up to their limits. The value stack
+ * gets copied, after which the frames' slots, the stack top and the open
+ * upvalues are moved over to the copy. */
+static bool reserve_frame() {
+    if (vm->frameCount < vm->frameCapacity) {
+        return true;
+    }
+    if (vm->frameCount >= vm->frameLimit) {
+        return false;
+    }
+
+    int capacity = GROW_CAPACITY(vm->frameCapacity);
+    capacity = capacity < vm->frameLimit ? capacity : vm->frameLimit;
+    vm->frames = GROW_ARRAY(CallFrame, vm->frames, vm->frameCapacity, capacity);
+    vm->frameCapacity = capacity;
+    return true;
+}
+
+// makes room for `count` values on the stack
+static bool reserve_stack(int count) {
+    if (count <= vm->stackCapacity) {
+        return true;
+    }
+    if (count > vm->stackLimit) {
+        return false;
+    }
+
+    int capacity = vm->stackCapacity;
+    while (capacity < count) {
+        capacity = GROW_CAPACITY(capacity);
+    }
+    capacity = capacity < vm->stackLimit ? capacity : vm->stackLimit;
+
+    Value *stack = GROW_ARRAY(Value, NULL, 0, capacity);
+    if (vm->stack != NULL) {
+        memcpy(stack, vm->stack, sizeof(Value) * (vm->stackTop - vm->stack));
+    }
+    for (int i = 0; i < vm->frameCount; i++) {
+        vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+    }
+    for (ObjUpvalue *upvalue = vm->openUpvalues; upvalue != NULL;
+         upvalue = upvalue->next) {
+        gcStore(&upvalue->location, stack + (upvalue->location - vm->stack));
+    }
+    vm->stackTop = stack + (vm->stackTop - vm->stack);
+
+    FREE_ARRAY(Value, vm->stack, vm->stackCapacity);
+    vm->stack = stack;
+    vm->stackCapacity = capacity;
+    return true;
+}
+
 static bool call(ObjClosure *closure, int arg_count) {
     if (arg_count != closure->func->arity) {
         runtime_err("Expected %d arguments, got %d", closure->func->arity,
@@ -415,49 +1134,89 @@ static bool call(ObjClosure *closure, int arg_count) {
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
+    int base = (int)(vm->stackTop - vm->stack) - arg_count - 1;
+    if (!reserve_frame() ||
+        !reserve_stack(base + closure->func->maxSlots + STACK_SCRATCH)) {
         runtime_err("Stack overflow");
         return false;
     }
 
-    CallFrame *frame = &vm.frames[vm.frameCount++];
+    Value *slots = vm->stack + base;
+    count_hot(closure->func);
+    CallFrame *frame = &vm->frames[vm->frameCount++];
     frame->closure = closure;
     frame->ip = closure->func->chunk.code;
-    frame->slots = vm.stackTop - arg_count - 1;
+    frame->slots = slots;
 
     return true;
 }
 
+// The closure a call to `callee` runs, with the receiver it gets put in the
+// callee's stack slot. NULL for callees that do not run one: natives, classes
+// without an initializer and values that cannot be called.
+static ObjClosure *callee_closure(Value callee, int arg_count) {
+    if (!IS_OBJ(callee)) {
+        return NULL;
+    }
+
+    switch (OBJ_TYPE(callee)) {
+    case OBJ_CLOSURE:
+        return AS_CLOSURE(callee);
+    case OBJ_CLASS: {
+        ObjClass *klass = AS_CLASS(callee);
+        Value initializer;
+        if (!tableGet(&klass->methods, vm->initString, &initializer)) {
+            return NULL;
+        }
+
+        vm->stackTop[-arg_count - 1] = OBJ_VAL(newInstance(klass));
+        return AS_CLOSURE(initializer);
+    }
+    case OBJ_BOUND_METHOD: {
+        ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
+        vm->stackTop[-arg_count - 1] = bound->receiver;
+        return bound->method;
+    }
+    default:
+        return NULL;
+    }
+}
+
 static bool call_value(Value callee, int arg_count) {
+    ObjClosure *closure = callee_closure(callee, arg_count);
+    if (closure != NULL) {
+        return call(closure, arg_count);
+    }
+
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
-        case OBJ_CLOSURE:
-            return call(AS_CLOSURE(callee), arg_count);
         case OBJ_NATIVE: {
             NativeFn native = AS_NATIVE(callee);
-            Value ret = native(arg_count, vm.stackTop - arg_count);
-            vm.stackTop -= (arg_count + 1);
+            Value ret = native(arg_count, vm->stackTop - arg_count);
+            if (vm->nativeError != NULL) {
+                runtime_err("%s", vm->nativeError);
+                vm->nativeError = NULL;
+                return false;
+            }
+            if (vm->fiberSwitched) {
+                // the native took its call off the stack it was on
+                vm->fiberSwitched = false;
+                return true;
+            }
+            vm->stackTop -= (arg_count + 1);
             push(ret);
             return true;
         }
         case OBJ_CLASS: {
             ObjClass *klass = AS_CLASS(callee);
-            vm.stackTop[-arg_count - 1] = OBJ_VAL(newInstance(klass));
-            Value initializer;
-            if (tableGet(&klass->methods, vm.initString, &initializer)) {
-                return call(AS_CLOSURE(initializer), arg_count);
-            } else if (arg_count != 0) {
+            vm->stackTop[-arg_count - 1] = OBJ_VAL(newInstance(klass));
+            if (arg_count != 0) {
                 runtime_err("Expected 0 arguments but got %d", arg_count);
                 return false;
             }
 
             return true;
         }
-        case OBJ_BOUND_METHOD: {
-            ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
-            vm.stackTop[-arg_count - 1] = bound->receiver;
-            return call(bound->method, arg_count);
-        }
         default:
             break; // do nothing; non-callable
         }
@@ -467,10 +1226,44 @@ static bool call_value(Value callee, int arg_count) {
     return false;
 }
 
+/* A call in tail position: the callee and its arguments move down over the
+ * slots of the calling frame, which then starts over running the callee, so
+ * recursion in tail position runs in constant stack. Callees that do not run
+ * a closure are called as usual and the OP_RETURN after the call returns
+ * their result. */
+static bool tail_call(Value callee, int arg_count) {
+    ObjClosure *closure = callee_closure(callee, arg_count);
+    if (closure == NULL) {
+        return call_value(callee, arg_count);
+    }
+    if (arg_count != closure->func->arity) {
+        runtime_err("Expected %d arguments, got %d", closure->func->arity,
+                    arg_count);
+        return false;
+    }
+
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
+    int base = (int)(frame->slots - vm->stack);
+    if (!reserve_stack(base + closure->func->maxSlots + STACK_SCRATCH)) {
+        runtime_err("Stack overflow");
+        return false;
+    }
+
+    close_upvalues(frame->slots);
+    memmove(frame->slots, vm->stackTop - arg_count - 1,
+            sizeof(Value) * (arg_count + 1));
+    vm->stackTop = frame->slots + arg_count + 1;
+
+    count_hot(closure->func);
+    frame->closure = closure;
+    frame->ip = closure->func->chunk.code;
+    return true;
+}
+
 static ObjUpvalue *capture_upvalue(Value *local) {
     // we look for a previously created upvalue referring to the same local
     ObjUpvalue *prev = NULL;
-    ObjUpvalue *upvalue = vm.openUpvalues;
+    ObjUpvalue *upvalue = vm->openUpvalues;
     while (upvalue != NULL && upvalue->location > local) {
         prev = upvalue;
         upvalue = upvalue->next;
@@ -482,9 +1275,10 @@ static ObjUpvalue *capture_upvalue(Value *local) {
 
     ObjUpvalue *created_upval = newUpvalue(local);
     created_upval->next = upvalue;
+    created_upval->fiber = vm->fiber;
 
     if (prev == NULL) {
-        vm.openUpvalues = created_upval;
+        vm->openUpvalues = created_upval;
     } else {
         prev->next = created_upval;
     }
@@ -493,11 +1287,12 @@ static ObjUpvalue *capture_upvalue(Value *local) {
 }
 
 static void close_upvalues(Value *last) {
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-        ObjUpvalue *upvalue = vm.openUpvalues;
-        upvalue->closed = *upvalue->location;
-        upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
+        ObjUpvalue *upvalue = vm->openUpvalues;
+        gcStoreValue(&upvalue->closed, *upvalue->location);
+        writeBarrier(&upvalue->obj, upvalue->closed);
+        gcStore(&upvalue->location, &upvalue->closed);
+        vm->openUpvalues = upvalue->next;
     }
 }
 
@@ -505,15 +1300,46 @@ static void define_method(ObjString *name) {
     Value method = peek(0);
     ObjClass *klass = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
+    writeBarrier(&klass->obj, OBJ_VAL(name));
+    writeBarrier(&klass->obj, method);
     pop();
 }
 
-static bool bind_method(ObjClass *klass, ObjString *name) {
+static void cache_update(InlineCache *cache, ObjShape *shape,
+                         ObjShape *transition, int slot, Value method) {
+    gcLockHeap();
+    CacheEntry *entry = cache_lookup(cache, shape);
+    if (entry == NULL) {
+        // monomorphic at first, then polymorphic up to IC_ENTRIES shapes;
+        // past that the last entry keeps getting recycled
+        entry = cache->count < IC_ENTRIES ? &cache->entries[cache->count++]
+                                          : &cache->entries[IC_ENTRIES - 1];
+    }
+
+    entry->shape = shape;
+    entry->transition = transition;
+    entry->slot = slot;
+    entry->method = method;
+    gcUnlockHeap();
+
+    // the cache is the running function's
+    Obj *func = &vm->frames[vm->frameCount - 1].closure->func->obj;
+    writeBarrier(func, OBJ_VAL(shape));
+    if (transition != NULL) {
+        writeBarrier(func, OBJ_VAL(transition));
+    }
+    writeBarrier(func, method);
+}
+
+// only called once the receiver's shape is known to lack the field, so a
+// method entry can never hide a field added later: that changes the shape
+static bool bind_method(ObjInstance *inst, InlineCache *cache) {
     Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
-        runtime_err("Undefined property: '%s'", name->chars);
+    if (!tableGet(&inst->klass->methods, cache->name, &method)) {
+        runtime_err("Undefined property: '%s'", cache->name->chars);
         return false;
     }
+    cache_update(cache, inst->shape, NULL, -1, method);
 
     ObjBoundMethod *bound = newBoundMethod(peek(0), AS_CLOSURE(method));
     pop();
@@ -521,16 +1347,46 @@ static bool bind_method(ObjClass *klass, ObjString *name) {
     return true;
 }
 
-static bool invoke_from_class(ObjClass *klass, ObjString *name, int arg_count) {
+static bool get_property(ObjInstance *inst, InlineCache *cache) {
+    int slot = shapeSlot(inst->shape, cache->name);
+    if (slot >= 0) {
+        cache_update(cache, inst->shape, NULL, slot, NIL_VAL);
+        vm->stackTop[-1] = inst->fields[slot];
+        return true;
+    }
+
+    return bind_method(inst, cache);
+}
+
+static void set_property(ObjInstance *inst, InlineCache *cache, Value val) {
+    ObjShape *shape = inst->shape;
+    int slot = shapeSlot(shape, cache->name);
+    if (slot >= 0) {
+        cache_update(cache, shape, NULL, slot, NIL_VAL);
+        gcStoreValue(&inst->fields[slot], val);
+        writeBarrier(&inst->obj, val);
+        return;
+    }
+
+    // the instance and value are still on the stack, so both stay rooted
+    // while the new shape and field array are allocated
+    ObjShape *next = shapeTransition(shape, cache->name);
+    instanceAddField(inst, next, val);
+    cache_update(cache, shape, next, next->fieldCount - 1, NIL_VAL);
+}
+
+static bool invoke_from_class(ObjInstance *inst, InlineCache *cache,
+                              int arg_count) {
     Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
-        runtime_err("Undefined property '%s'", name->chars);
+    if (!tableGet(&inst->klass->methods, cache->name, &method)) {
+        runtime_err("Undefined property '%s'", cache->name->chars);
         return false;
     }
+    cache_update(cache, inst->shape, NULL, -1, method);
 
     return call(AS_CLOSURE(method), arg_count);
 }
-static bool invoke(ObjString *name, int arg_count) {
+static bool invoke(InlineCache *cache, int arg_count) {
     Value receiver = peek(arg_count);
     if (!IS_INSTANCE(receiver)) {
         runtime_err("Only instances have methods");
@@ -539,16 +1395,197 @@ static bool invoke(ObjString *name, int arg_count) {
 
     ObjInstance *inst = AS_INSTANCE(receiver);
 
-    Value val;
-    if (tableGet(&inst->fields, name, &val)) {
-        vm.stackTop[-arg_count - 1] = val;
+    int slot = shapeSlot(inst->shape, cache->name);
+    if (slot >= 0) {
+        Value val = inst->fields[slot];
+        vm->stackTop[-arg_count - 1] = val;
         return call_value(val, arg_count);
     }
 
-    return invoke_from_class(inst->klass, name, arg_count);
+    return invoke_from_class(inst, cache, arg_count);
+}
+
+/* Every fiber runs on stacks of its own. The VM holds those of the running
+ * one, the others keep theirs, and so does the VM for the main fiber while
+ * another one runs. Switching fibers swaps the stacks, after which run()
+ * picks up the frame on top of the new ones. */
+static void switch_fiber(ObjFiber *to) {
+    FiberStacks *from = &vm->mainStacks;
+    if (vm->fiber != NULL) {
+        from = &vm->fiber->stacks;
+        gcRemember(&vm->fiber->obj);
+    }
+
+    gcLockHeap();
+    *from = (FiberStacks){
+        .frames = vm->frames,
+        .frameCount = vm->frameCount,
+        .frameCapacity = vm->frameCapacity,
+        .stack = vm->stack,
+        .stackTop = vm->stackTop,
+        .stackCapacity = vm->stackCapacity,
+        .openUpvalues = vm->openUpvalues,
+    };
+
+    FiberStacks *stacks = to == NULL ? &vm->mainStacks : &to->stacks;
+    vm->frames = stacks->frames;
+    vm->frameCount = stacks->frameCount;
+    vm->frameCapacity = stacks->frameCapacity;
+    vm->stack = stacks->stack;
+    vm->stackTop = stacks->stackTop;
+    vm->stackCapacity = stacks->stackCapacity;
+    vm->openUpvalues = stacks->openUpvalues;
+    *stacks = (FiberStacks){0};
+    gcUnlockHeap();
+    vm->fiber = to;
+}
+
+// The function of the running fiber returned `ret`, which goes back to the
+// fiber that resumed it as the result of resume().
+static void finish_fiber(Value ret) {
+    ObjFiber *fiber = vm->fiber;
+    fiber->state = FIBER_DONE;
+    switch_fiber(fiber->caller);
+    gcStore(&fiber->caller, NULL);
+    push(ret);
+
+    gcLockHeap();
+    FREE_ARRAY(CallFrame, fiber->stacks.frames, fiber->stacks.frameCapacity);
+    FREE_ARRAY(Value, fiber->stacks.stack, fiber->stacks.stackCapacity);
+    fiber->stacks = (FiberStacks){0};
+    gcUnlockHeap();
+}
+
+/* Natives fail by returning native_error(), which call_value() turns into a
+ * runtime error at the call. */
+static Value native_error(const char *msg) {
+    vm->nativeError = msg;
+    return NIL_VAL;
 }
 
 static Value clockNative(int arg_count __attribute__((unused)),
                          Value *args __attribute__((unused))) {
     return NUMBER_VAL(((double)clock() / CLOCKS_PER_SEC));
 }
+
+// channel() makes a new channel, channel(name) finds the one of that name
+// every VM of the process shares
+static Value channelNative(int arg_count, Value *args) {
+    if (arg_count > 1 || (arg_count == 1 && !IS_STRING(args[0]))) {
+        return native_error("channel() takes an optional name string");
+    }
+
+    Channel *channel = arg_count == 0
+                           ? channelNew()
+                           : channelNamed(AS_CSTRING(args[0]),
+                                          AS_STRING(args[0])->len);
+    return OBJ_VAL(newChannel(channel));
+}
+
+static Value sendNative(int arg_count, Value *args) {
+    if (arg_count != 2 || !IS_CHANNEL(args[0])) {
+        return native_error("send() takes a channel and a value");
+    }
+    if (!channelSend(AS_CHANNEL(args[0])->channel, args[1])) {
+        return native_error(
+            "Only nil, booleans, numbers, strings and channels can be sent");
+    }
+
+    return NIL_VAL;
+}
+
+static Value receiveNative(int arg_count, Value *args) {
+    if (arg_count != 1 || !IS_CHANNEL(args[0])) {
+        return native_error("receive() takes a channel");
+    }
+
+    return channelReceive(AS_CHANNEL(args[0])->channel);
+}
+
+static Value fiberNative(int arg_count, Value *args) {
+    if (arg_count != 1 || !IS_CLOSURE(args[0]) ||
+        AS_CLOSURE(args[0])->func->arity > 1) {
+        return native_error(
+            "fiber() takes a function of at most one parameter");
+    }
+
+    return OBJ_VAL(newFiber(AS_CLOSURE(args[0])));
+}
+
+/* resume(fiber, value) runs `fiber` until it yields or returns and evaluates
+ * to the value it yielded or returned. The first resume passes `value` to
+ * the fiber's function, the others make it the result of the yield() the
+ * fiber stopped at. */
+static Value resumeNative(int arg_count, Value *args) {
+    if (arg_count < 1 || arg_count > 2 || !IS_FIBER(args[0])) {
+        return native_error("resume() takes a fiber and an optional value");
+    }
+
+    ObjFiber *fiber = AS_FIBER(args[0]);
+    Value val = arg_count == 2 ? args[1] : NIL_VAL;
+    switch (fiber->state) {
+    case FIBER_RUNNING:
+        return native_error("Cannot resume a running fiber");
+    case FIBER_DONE:
+        return native_error("Cannot resume a finished fiber");
+    case FIBER_NEW:
+        // the call below must not fail once on the fiber's stacks, which
+        // have no frame to report an error from
+        if (fiber->closure->func->maxSlots + STACK_SCRATCH > vm->stackLimit) {
+            return native_error("Stack overflow");
+        }
+        break;
+    case FIBER_SUSPENDED:
+        break;
+    }
+
+    vm->stackTop = args - 1;
+    gcStore(&fiber->caller, vm->fiber);
+    switch_fiber(fiber);
+    gcRemember(&fiber->obj);
+    vm->fiberSwitched = true;
+
+    if (fiber->state == FIBER_SUSPENDED) {
+        fiber->state = FIBER_RUNNING;
+        push(val);
+        return NIL_VAL;
+    }
+
+    fiber->state = FIBER_RUNNING;
+    int arity = fiber->closure->func->arity;
+    if (arity == 1) {
+        push(val);
+    }
+    call(fiber->closure, arity);
+    return NIL_VAL;
+}
+
+// yield(value) stops the running fiber and makes `value` the result of the
+// resume() that ran it
+static Value yieldNative(int arg_count, Value *args) {
+    if (arg_count > 1) {
+        return native_error("yield() takes an optional value");
+    }
+
+    ObjFiber *fiber = vm->fiber;
+    if (fiber == NULL) {
+        return native_error("Cannot yield from the main fiber");
+    }
+
+    Value val = arg_count == 1 ? args[0] : NIL_VAL;
+    vm->stackTop = args - 1;
+    fiber->state = FIBER_SUSPENDED;
+    switch_fiber(fiber->caller);
+    gcStore(&fiber->caller, NULL);
+    vm->fiberSwitched = true;
+    push(val);
+    return NIL_VAL;
+}
+
+static Value isDoneNative(int arg_count, Value *args) {
+    if (arg_count != 1 || !IS_FIBER(args[0])) {
+        return native_error("isDone() takes a fiber");
+    }
+
+    return BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+}
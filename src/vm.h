@@ -6,34 +6,113 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX  (FRAMES_MAX * (UINT8_MAX + 1))
+// Default limits of the call stack, in frames, and of the value stack, in
+// values. Both stacks start small and grow up to vm->frameLimit and
+// vm->stackLimit, which start out as these.
+#ifndef FRAMES_MAX
+#define FRAMES_MAX (1 << 18)
+#endif
+#ifndef STACK_MAX
+#define STACK_MAX (1 << 22)
+#endif
 
-typedef struct {
+typedef struct CallFrame {
     ObjClosure *closure;
     uint8_t *ip;
     Value *slots;
 } CallFrame;
 
+/* Global variables live in a flat array. The compiler resolves each name to
+ * its slot once, so the VM never hashes a name to reach a global. Slots are
+ * handed out before the definition runs, hence the `defined` side table. */
+typedef struct {
+    Table slots;       // name -> slot, stored as a number
+    ObjString **names; // slot -> name, for error messages and disassembly
+    Value *values;
+    bool *defined;
+    int count;
+    int capacity;
+} Globals;
+
+typedef enum {
+    GC_IDLE,
+    GC_MARK,
+    GC_SWEEP,
+} GcPhase;
+
+#ifdef DEBUG_GC_STATS
+// What the collector did, for the tests to check. None of it feeds back into
+// when or how it collects.
 typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    long markerRaces; // objects written while the marker was tracing
+    long grayStolen;  // objects threads tracing took from one another
+    size_t pageBytes; // taken by the pages of the heap
+} GcStats;
+#endif
+
+// Default of vm->gcBudget, objects a major collection traces or sweeps in
+// one go, which bounds its pauses.
+#ifndef GC_BUDGET
+#define GC_BUDGET 4096
+#endif
+
+/* The stacks and open upvalues below are those of the running fiber. Every
+ * other fiber keeps its own, so switching fibers swaps them, see vm.c. */
+typedef struct VM {
+    CallFrame *frames;
     int frameCount;
+    int frameCapacity;
+    int frameLimit;
 
-    Value stack[STACK_MAX];
+    // The stack moves when it grows, so pointers into it are only good until
+    // the next call.
+    Value *stack;
     Value *stackTop;
-    Table globals;
+    int stackCapacity;
+    int stackLimit;
+    Globals globals;
     Table strings;
     ObjString *initString;    // = "init", name of the constructor in classes
+    struct Parser *parser;    // the compilation in progress, see compiler.c
+    bool registerOps;         // fuse local arithmetic, see optimizer.c
+    const char *nativeError;  // set by a native that failed, see vm.c
     ObjUpvalue *openUpvalues; // tracking open upvalues
-    Obj *objects;             // linked list of all objects
+    ObjFiber *fiber;          // the running fiber, NULL for the main one
+    FiberStacks mainStacks;   // those of the main fiber while another runs
+    bool fiberSwitched;       // set by a native that switched fibers
+    struct Heap *heap;        // the pages objects live in, see memory.c
+    size_t youngBytes;        // allocated since the last GC
+
+    // the major collection under way, see memory.c
+    GcPhase gcPhase;
+    size_t stepBytes; // allocated since the last increment
+    int gcBudget;     // objects traced or swept per increment
+
+    // marking on a background thread instead, see memory.c
+    bool gcConcurrent;         // set to mark that way, with NaN boxing
+    bool markingConcurrently;  // while the marker may be running
+    int heapLocks;             // gcLockHeap() calls not unlocked yet
+    struct Marker *marker;     // the thread, once started
+
+    // threads tracing in parallel, see memory.c
+    int gcThreads;
+    struct MarkPool *markPool; // those besides the VM's, once started
 
     size_t bytesAllocated;
     size_t nextGC;
+#ifdef DEBUG_GC_STATS
+    GcStats gcStats;
+#endif
 
     // tracking all grey objects
     int grayCount;
     int grayCapacity;
     Obj **grayStack;
+
+    // old objects written a reference to a young one since the last GC
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj **remembered;
 } VM;
 
 typedef enum {
@@ -42,13 +121,35 @@ typedef enum {
     INTERPRET_RUNTIME_ERR,
 } InterpretResult;
 
-extern VM vm;
+/* Every VM is an interpreter of its own, with its own heap, globals and
+ * stacks, so a process can run one on each of its threads. Values never move
+ * between VMs. The runtime reaches the VM it works for through `vm`, which is
+ * per thread: vmNew() and vmInterpret() point it at theirs. That pointer is
+ * what is left of the old singleton, until the interpreter, the collector
+ * and the natives take the VM as an argument the way the compiler takes its
+ * Parser. */
+extern _Thread_local VM *vm;
+
+// Settings a VM can start out with, those of vmDefaultOptions() otherwise.
+typedef struct {
+    bool registerOps;
+    int gcBudget;
+    bool gcConcurrent;
+    int gcThreads;
+} VMOptions;
 
-void initVM();
-void freeVM();
+VM *vmNew();
+// frees `machine` and all it allocated
+void vmFree(VM *machine);
+VMOptions vmDefaultOptions();
+// to be called before `machine` runs anything
+void vmConfigure(VM *machine, const VMOptions *options);
+InterpretResult vmInterpret(VM *machine, const char *src);
 
-InterpretResult interpret(const char *src);
 void push(Value val);
 Value pop();
 
+// slot of the global variable `name`, allocated on first use
+int globalSlot(ObjString *name);
+
 #endif
@@ -0,0 +1,423 @@
+#ifndef CLOX_X64_H
+#define CLOX_X64_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "jit.h"
+#include "vm.h"
+
+/* The x86-64 assembler shared by the baseline JIT and the trace compiler,
+ * along with the templates both use to test and build Values.
+ *
+ * While native code runs, these registers hold the interpreter's state:
+ *
+ *   rbx  frame slots      r13  constants     r15  &vm->globals
+ *   r12  stack top        r14  JitState *
+ *
+ * The buffers code is built in are not Lox objects, hence plain malloc
+ * rather than the collector's allocator. */
+
+enum {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSP = 4,
+    RBP = 5,
+    RSI = 6,
+    RDI = 7,
+    R12 = 12,
+    R13 = 13,
+    R14 = 14,
+    R15 = 15,
+};
+
+#define SLOTS   RBX
+#define SP      R12
+#define CONSTS  R13
+#define STATE   R14
+#define GLOBALS R15
+
+// condition codes, the low nibble of jcc and setcc
+enum {
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+    CC_P = 0xa,
+    CC_NP = 0xb,
+    CC_LE = 0xe,
+};
+
+#define VS ((int32_t)sizeof(Value))
+
+#ifdef NAN_BOXING
+#define NUM_DISP 0
+#else
+#define NUM_DISP ((int32_t)offsetof(Value, as))
+#endif
+
+// a rel32 at `at` to be pointed at the code for `offset`
+typedef struct {
+    size_t at;
+    uint32_t offset;
+} Patch;
+
+typedef struct {
+    size_t len;
+    size_t capacity;
+    Patch *patches;
+} PatchList;
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    size_t capacity;
+
+    uint32_t offset; // where exits from the code being emitted go
+    PatchList jumps; // to the native code of an instruction
+    PatchList exits; // to the exit stub for an offset
+} Asm;
+
+static inline void *grow(void *ptr, size_t *capacity, size_t needed,
+                         size_t size) {
+    if (needed <= *capacity)
+        return ptr;
+
+    while (*capacity < needed)
+        *capacity = *capacity < 64 ? 64 : *capacity * 2;
+    void *ret = realloc(ptr, *capacity * size);
+    if (ret == NULL)
+        exit(1);
+
+    return ret;
+}
+
+static inline void add_patch(PatchList *list, size_t at,
+                             uint32_t offset) {
+    list->patches = grow(list->patches, &list->capacity, list->len + 1,
+                         sizeof(Patch));
+    list->patches[list->len++] = (Patch){at, offset};
+}
+
+static inline void emit8(Asm *a, uint8_t byte) {
+    a->buf = grow(a->buf, &a->capacity, a->len + 1, 1);
+    a->buf[a->len++] = byte;
+}
+static inline void emit32(Asm *a, uint32_t word) {
+    for (int i = 0; i < 4; i++)
+        emit8(a, (word >> (8 * i)) & 0xff);
+}
+static inline void emit64(Asm *a, uint64_t word) {
+    emit32(a, (uint32_t)word);
+    emit32(a, (uint32_t)(word >> 32));
+}
+
+static inline void patch_rel32(Asm *a, size_t at, size_t target) {
+    uint32_t rel = (uint32_t)(target - (at + 4));
+    memcpy(a->buf + at, &rel, sizeof(rel));
+}
+
+/* ---- x86-64 encoding. Memory operands are always [base + disp32]. ---- */
+
+static inline void rex(Asm *a, bool wide, int reg, int base) {
+    uint8_t prefix = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (base >> 3);
+    if (prefix != 0x40)
+        emit8(a, prefix);
+}
+static inline void modrm_mem(Asm *a, int reg, int base, int32_t disp) {
+    emit8(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == 4)
+        emit8(a, 0x24); // rsp and r12 need a SIB byte
+    emit32(a, (uint32_t)disp);
+}
+static inline void modrm_reg(Asm *a, int reg, int rm) {
+    emit8(a, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// mov reg, [base + disp]
+static inline void load(Asm *a, int reg, int base, int32_t disp) {
+    rex(a, true, reg, base);
+    emit8(a, 0x8b);
+    modrm_mem(a, reg, base, disp);
+}
+// mov [base + disp], reg
+static inline void store(Asm *a, int base, int32_t disp, int reg) {
+    rex(a, true, reg, base);
+    emit8(a, 0x89);
+    modrm_mem(a, reg, base, disp);
+}
+// mov dword [base + disp], reg
+static inline void store32(Asm *a, int base, int32_t disp, int reg) {
+    rex(a, false, reg, base);
+    emit8(a, 0x89);
+    modrm_mem(a, reg, base, disp);
+}
+// mov reg, imm64
+static inline void mov_imm(Asm *a, int reg, uint64_t imm) {
+    rex(a, true, 0, reg);
+    emit8(a, 0xb8 + (reg & 7));
+    emit64(a, imm);
+}
+// mov eax, imm32
+static inline void mov_eax(Asm *a, uint32_t imm) {
+    emit8(a, 0xb8);
+    emit32(a, imm);
+}
+// the tagged union is tested and built field by field
+#ifndef NAN_BOXING
+// mov dword/qword [base + disp], imm32
+static inline void store_imm(Asm *a, bool wide, int base, int32_t disp,
+                             uint32_t imm) {
+    rex(a, wide, 0, base);
+    emit8(a, 0xc7);
+    modrm_mem(a, 0, base, disp);
+    emit32(a, imm);
+}
+// cmp dword [base + disp], imm8
+static inline void cmp_mem32(Asm *a, int base, int32_t disp,
+                             uint8_t imm) {
+    rex(a, false, 0, base);
+    emit8(a, 0x83);
+    modrm_mem(a, 7, base, disp);
+    emit8(a, imm);
+}
+#endif
+// cmp byte [base + disp], imm8
+static inline void cmp_mem8(Asm *a, int base, int32_t disp, uint8_t imm) {
+    rex(a, false, 0, base);
+    emit8(a, 0x80);
+    modrm_mem(a, 7, base, disp);
+    emit8(a, imm);
+}
+
+// add reg, imm32
+static inline void add_imm(Asm *a, int reg, int32_t imm) {
+    rex(a, true, 0, reg);
+    emit8(a, 0x81);
+    modrm_reg(a, 0, reg);
+    emit32(a, (uint32_t)imm);
+}
+
+// NaN boxed values are tested with arithmetic on the whole word
+#ifdef NAN_BOXING
+enum { ALU_ADD = 0x01, ALU_AND = 0x21, ALU_SUB = 0x29, ALU_CMP = 0x39 };
+
+// <op> dst, src on 64-bit registers
+static inline void alu(Asm *a, uint8_t op, int dst, int src) {
+    rex(a, true, src, dst);
+    emit8(a, op);
+    modrm_reg(a, src, dst);
+}
+// cmp reg, imm8
+static inline void cmp_imm(Asm *a, int reg, uint8_t imm) {
+    rex(a, true, 0, reg);
+    emit8(a, 0x83);
+    modrm_reg(a, 7, reg);
+    emit8(a, imm);
+}
+#endif
+
+enum {
+    SSE_LOAD = 0x10,
+    SSE_STORE = 0x11,
+    SSE_UCOMI = 0x2e,
+    SSE_XOR = 0x57,
+    SSE_ADD = 0x58,
+    SSE_MUL = 0x59,
+    SSE_SUB = 0x5c,
+    SSE_DIV = 0x5e,
+};
+
+// scalar double op between xmm and [base + disp]; ucomisd and xorpd take
+// the 0x66 prefix
+static inline void sse_mem(Asm *a, uint8_t op, int xmm, int base,
+                           int32_t disp) {
+    emit8(a, op == SSE_UCOMI || op == SSE_XOR ? 0x66 : 0xf2);
+    rex(a, false, xmm, base);
+    emit8(a, 0x0f);
+    emit8(a, op);
+    modrm_mem(a, xmm, base, disp);
+}
+// the same between two xmm registers
+static inline void sse_reg(Asm *a, uint8_t op, int dst, int src) {
+    emit8(a, op == SSE_UCOMI || op == SSE_XOR ? 0x66 : 0xf2);
+    rex(a, false, dst, src);
+    emit8(a, 0x0f);
+    emit8(a, op);
+    modrm_reg(a, dst, src);
+}
+// setcc on al (reg 0) or cl (reg 1)
+static inline void setcc(Asm *a, uint8_t cc, int reg) {
+    emit8(a, 0x0f);
+    emit8(a, 0x90 | cc);
+    modrm_reg(a, 0, reg);
+}
+
+// jcc/jmp rel32, returning where the offset goes
+static inline size_t jcc(Asm *a, uint8_t cc) {
+    emit8(a, 0x0f);
+    emit8(a, 0x80 | cc);
+    emit32(a, 0);
+    return a->len - 4;
+}
+static inline size_t jmp(Asm *a) {
+    emit8(a, 0xe9);
+    emit32(a, 0);
+    return a->len - 4;
+}
+
+// leaves for the interpreter through the exit for `a->offset` if `cc` holds
+static inline void exit_if(Asm *a, uint8_t cc) {
+    add_patch(&a->exits, jcc(a, cc), a->offset);
+}
+static inline void exit_always(Asm *a) {
+    add_patch(&a->exits, jmp(a), a->offset);
+}
+
+/* ---- Value templates, for both the tagged union and NaN boxing. ---- */
+
+static inline void copy_value(Asm *a, int dst, int32_t dst_disp, int src,
+                              int32_t src_disp) {
+    for (int32_t i = 0; i < VS; i += 8) {
+        load(a, RAX, src, src_disp + i);
+        store(a, dst, dst_disp + i, RAX);
+    }
+}
+
+// stores nil, true or false
+static inline void store_literal(Asm *a, int base, int32_t disp,
+                                 uint8_t op) {
+#ifdef NAN_BOXING
+    Value val = op == OP_NIL ? NIL_VAL : BOOL_VAL(op == OP_TRUE);
+    mov_imm(a, RAX, val);
+    store(a, base, disp, RAX);
+#else
+    store_imm(a, false, base, disp, op == OP_NIL ? VAL_NIL : VAL_BOOL);
+    store_imm(a, true, base, disp + NUM_DISP, op == OP_TRUE);
+#endif
+}
+
+static inline void guard_number(Asm *a, int base, int32_t disp) {
+#ifdef NAN_BOXING
+    load(a, RAX, base, disp);
+    mov_imm(a, RCX, QNAN);
+    alu(a, ALU_AND, RAX, RCX);
+    alu(a, ALU_CMP, RAX, RCX);
+    exit_if(a, CC_E);
+#else
+    cmp_mem32(a, base, disp, VAL_NUM);
+    exit_if(a, CC_NE);
+#endif
+}
+
+static inline void store_number(Asm *a, int base, int32_t disp, int xmm) {
+#ifndef NAN_BOXING
+    store_imm(a, false, base, disp, VAL_NUM);
+#endif
+    sse_mem(a, SSE_STORE, xmm, base, disp + NUM_DISP);
+}
+
+// stores the boolean in al
+static inline void store_flag(Asm *a, int base, int32_t disp) {
+    emit8(a, 0x0f); // movzx eax, al
+    emit8(a, 0xb6);
+    emit8(a, 0xc0);
+#ifdef NAN_BOXING
+    mov_imm(a, RCX, FALSE_VAL); // TRUE_VAL is FALSE_VAL + 1
+    alu(a, ALU_ADD, RAX, RCX);
+    store(a, base, disp, RAX);
+#else
+    store_imm(a, false, base, disp, VAL_BOOL);
+    store(a, base, disp + NUM_DISP, RAX);
+#endif
+}
+
+/* ---- Entering and leaving native code. ---- */
+
+// The start of every buffer is called as
+// void (*)(JitState *state, uint8_t *target)
+static inline void emit_prologue(Asm *a) {
+    static const uint8_t push[] = {
+        0x53,       // push rbx
+        0x55,       // push rbp
+        0x41, 0x54, // push r12
+        0x41, 0x55, // push r13
+        0x41, 0x56, // push r14
+        0x41, 0x57, // push r15
+        0x48, 0x83, 0xec, 0x08, // sub rsp, 8 to keep it 16-byte aligned
+        0x49, 0x89, 0xfe,       // mov r14, rdi
+    };
+    for (size_t i = 0; i < sizeof(push); i++)
+        emit8(a, push[i]);
+
+    load(a, SLOTS, STATE, offsetof(JitState, slots));
+    load(a, SP, STATE, offsetof(JitState, sp));
+    load(a, CONSTS, STATE, offsetof(JitState, constants));
+    mov_imm(a, GLOBALS, (uint64_t)(uintptr_t)&vm->globals);
+    emit8(a, 0xff); // jmp rsi
+    emit8(a, 0xe6);
+}
+
+// Where every exit ends up, with the bytecode offset in eax. Returns the
+// native offset it starts at.
+static inline size_t emit_epilogue(Asm *a) {
+    size_t start = a->len;
+    store(a, STATE, offsetof(JitState, sp), SP);
+    store32(a, STATE, offsetof(JitState, offset), RAX);
+
+    static const uint8_t pop[] = {
+        0x48, 0x83, 0xc4, 0x08, // add rsp, 8
+        0x41, 0x5f,             // pop r15
+        0x41, 0x5e,             // pop r14
+        0x41, 0x5d,             // pop r13
+        0x41, 0x5c,             // pop r12
+        0x5d,                   // pop rbp
+        0x5b,                   // pop rbx
+        0xc3,                   // ret
+    };
+    for (size_t i = 0; i < sizeof(pop); i++)
+        emit8(a, pop[i]);
+
+    return start;
+}
+
+// Moves the finished code into executable memory and frees the buffer.
+// Returns NULL if the mapping fails, with the mapped size in `size`.
+static inline uint8_t *map_code(Asm *a, size_t *size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    *size = (a->len + page - 1) / page * page;
+    uint8_t *code = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        free(a->buf);
+        return NULL;
+    }
+    memcpy(code, a->buf, a->len);
+    free(a->buf);
+    if (mprotect(code, *size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, *size);
+        return NULL;
+    }
+
+    return code;
+}
+
+static inline void enter_code(uint8_t *code, JitState *state,
+                              uint8_t *target) {
+    // object to function pointer conversions go through a union to stay
+    // within ISO C
+    union {
+        uint8_t *code;
+        void (*enter)(JitState *, uint8_t *);
+    } prologue = {.code = code};
+
+    prologue.enter(state, target);
+}
+
+#endif
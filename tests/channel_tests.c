@@ -0,0 +1,53 @@
+#include "ctest.h"
+#include "executor.h"
+#include "fixtures.h"
+
+// messages come out in the order they went in, as copies
+CTEST(channel, round_trip) {
+    ASSERT_EQUAL(INTERPRET_OK,
+                 runScript("var c = channel();\n"
+                           "send(c, 1); send(c, \"two\");\n"
+                           "send(c, nil); send(c, false);\n"
+                           "if (receive(c) != 1) nil + 1;\n"
+                           "if (receive(c) != \"two\") nil + 1;\n"
+                           "if (receive(c) != nil) nil + 1;\n"
+                           "if (receive(c) != false) nil + 1;\n"));
+}
+
+// channels can be sent, and stay the same channel
+CTEST(channel, send_channel) {
+    ASSERT_EQUAL(INTERPRET_OK,
+                 runScript("var a = channel(); var b = channel();\n"
+                           "send(a, b);\n"
+                           "send(receive(a), 5);\n"
+                           "if (receive(b) != 5) nil + 1;\n"));
+}
+
+// objects of a heap never leave it
+CTEST(channel, rejects_objects) {
+    ASSERT_EQUAL(INTERPRET_RUNTIME_ERR,
+                 runScript("class A {} send(channel(), A());"));
+}
+
+// three VMs feed one through a named channel
+CTEST(channel, pipeline) {
+    const char *producer = "var c = channel(\"test pipeline\");\n"
+                           "for (var i = 0; i < 1000; i = i + 1) send(c, i);\n";
+    const char *consumer = "var c = channel(\"test pipeline\");\n"
+                           "var sum = 0;\n"
+                           "for (var i = 0; i < 3000; i = i + 1)\n"
+                           "  sum = sum + receive(c);\n"
+                           "if (sum != 1498500) nil + 1;\n";
+
+    InterpretResult results[4];
+    Executor *ex = executorNew(4, NULL);
+    executorSubmit(ex, consumer, storeResult, &results[0]);
+    for (int i = 1; i < 4; i++) {
+        executorSubmit(ex, producer, storeResult, &results[i]);
+    }
+    executorFree(ex);
+
+    for (int i = 0; i < 4; i++) {
+        ASSERT_EQUAL(INTERPRET_OK, results[i]);
+    }
+}
@@ -0,0 +1,50 @@
+#include <stdatomic.h>
+
+#include "ctest.h"
+#include "executor.h"
+#include "fixtures.h"
+
+static const char *script =
+    "fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }\n"
+    "var total = 0;\n"
+    "for (var i = 0; i < 20; i = i + 1) total = total + fib(i);\n"
+    "if (total != 10945) nil + 1;\n";
+
+static atomic_int finished;
+
+static void count_ok(void *arg, InterpretResult result) {
+    (void)arg;
+    if (result == INTERPRET_OK) {
+        atomic_fetch_add(&finished, 1);
+    }
+}
+
+// every job runs once, whichever worker ends up with it
+CTEST(executor, runs_all_jobs) {
+    atomic_store(&finished, 0);
+    Executor *ex = executorNew(4, NULL);
+    for (int i = 0; i < 64; i++) {
+        executorSubmit(ex, script, count_ok, NULL);
+    }
+    executorWait(ex);
+    ASSERT_EQUAL(64, atomic_load(&finished));
+
+    // the workers stay around for more
+    executorSubmit(ex, script, count_ok, NULL);
+    executorFree(ex);
+    ASSERT_EQUAL(65, atomic_load(&finished));
+}
+
+// jobs get a VM each, so globals do not leak from one into the next
+CTEST(executor, isolated_jobs) {
+    InterpretResult first, second;
+    VMOptions options = vmDefaultOptions();
+    options.registerOps = true;
+    Executor *ex = executorNew(1, &options);
+    executorSubmit(ex, "var seen = true;", storeResult, &first);
+    executorSubmit(ex, "seen;", storeResult, &second);
+    executorFree(ex);
+
+    ASSERT_EQUAL(INTERPRET_OK, first);
+    ASSERT_EQUAL(INTERPRET_RUNTIME_ERR, second);
+}
@@ -0,0 +1,41 @@
+#include "fixtures.h"
+#include "chunk.h"
+
+const uint8_t countLoop[] = {
+    OP_GET_LOCAL, 1, OP_CONSTANT, 0, OP_LESS,
+    OP_POP_JUMP_IF_FALSE, 0, 10,
+    OP_GET_LOCAL, 1, OP_CONSTANT, 1, OP_ADD, OP_SET_LOCAL_POP, 1,
+    OP_LOOP, 0, 18,
+    OP_NIL, OP_RETURN,
+};
+const int countLoopLen = sizeof(countLoop);
+
+static VM *test_vm;
+
+ObjFunction *newTestFunction(const uint8_t *code, int len) {
+    test_vm = vmNew();
+    ObjFunction *func = newFunction();
+    push(OBJ_VAL(func));
+    writeValueArray(&func->chunk.constants, NUMBER_VAL(10));
+    writeValueArray(&func->chunk.constants, NUMBER_VAL(1));
+    for (int i = 0; i < len; i++) {
+        writeChunk(&func->chunk, code[i], 1);
+    }
+    return func;
+}
+
+void freeTestFunction() {
+    pop();
+    vmFree(test_vm);
+}
+
+InterpretResult runScript(const char *src) {
+    VM *machine = vmNew();
+    InterpretResult result = vmInterpret(machine, src);
+    vmFree(machine);
+    return result;
+}
+
+void storeResult(void *arg, InterpretResult result) {
+    *(InterpretResult *)arg = result;
+}
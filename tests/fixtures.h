@@ -0,0 +1,24 @@
+#ifndef CLOX_TESTS_FIXTURES_H
+#define CLOX_TESTS_FIXTURES_H
+
+#include "object.h"
+#include "vm.h"
+
+// `while (i < 10) i = i + 1;` with `i` in slot 1 and the loop header at 0. It
+// uses the constants 10 and 1 that every test function starts out with.
+extern const uint8_t countLoop[];
+extern const int countLoopLen;
+
+// Tests that build bytecode by hand get a VM of their own, with the function
+// on its stack to keep it from the collector, until freeTestFunction().
+ObjFunction *newTestFunction(const uint8_t *code, int len);
+void freeTestFunction();
+
+// Runs `src` in a VM of its own. The scripts check their own results and
+// fail with a runtime error.
+InterpretResult runScript(const char *src);
+
+// a JobDone that stores the result in the InterpretResult `arg` points to
+void storeResult(void *arg, InterpretResult result);
+
+#endif
@@ -0,0 +1,74 @@
+#include "ctest.h"
+#include "fixtures.h"
+#include "jit.h"
+#include "trace.h"
+#include "vm.h"
+
+#ifdef JIT
+
+static ObjFunction *compile_code(const uint8_t *code, int len) {
+    ObjFunction *func = newTestFunction(code, len);
+    ASSERT_TRUE(jitCompile(func));
+    return func;
+}
+
+// native code runs up to the first instruction it leaves to the interpreter
+CTEST(jit, exits_at_return) {
+    const uint8_t code[] = {
+        OP_GET_LOCAL, 1, OP_GET_LOCAL, 2, OP_ADD, OP_RETURN,
+    };
+    ObjFunction *func = compile_code(code, sizeof(code));
+
+    Value stack[8] = {NIL_VAL, NUMBER_VAL(2), NUMBER_VAL(3)};
+    JitState state = {stack, stack + 3, func->chunk.constants.values, 0};
+    jitRun(func->jit, &state);
+
+    ASSERT_EQUAL(5, state.offset);
+    ASSERT_TRUE(state.sp == stack + 4);
+    ASSERT_DBL_NEAR(5.0, AS_NUMBER(stack[3]));
+    freeTestFunction();
+}
+
+// a failed type guard leaves at the start of the instruction, untouched
+CTEST(jit, guard_exit) {
+    const uint8_t code[] = {
+        OP_GET_LOCAL, 1, OP_GET_LOCAL, 2, OP_ADD, OP_RETURN,
+    };
+    ObjFunction *func = compile_code(code, sizeof(code));
+
+    Value stack[8] = {NIL_VAL, NUMBER_VAL(2), NIL_VAL};
+    JitState state = {stack, stack + 3, func->chunk.constants.values, 0};
+    jitRun(func->jit, &state);
+
+    ASSERT_EQUAL(4, state.offset);
+    ASSERT_TRUE(state.sp == stack + 5);
+    ASSERT_TRUE(IS_NIL(stack[4]));
+    freeTestFunction();
+}
+
+// `while (i < 10) i = i + 1;` entered in the middle of the body
+CTEST(jit, loop) {
+    ObjFunction *func = compile_code(countLoop, countLoopLen);
+    // not due for tracing
+    traceLoop(func, 0)->hits = INT32_MAX;
+
+    Value stack[8] = {NIL_VAL, NUMBER_VAL(0)};
+    JitState state = {stack, stack + 2, func->chunk.constants.values, 8};
+    jitRun(func->jit, &state);
+
+    ASSERT_EQUAL(19, state.offset);
+    ASSERT_TRUE(state.sp == stack + 3);
+    ASSERT_DBL_NEAR(10.0, AS_NUMBER(stack[1]));
+
+    // once the loop is due, its back edge leaves for run() to trace it
+    traceLoop(func, 0)->hits = 3;
+    stack[1] = NUMBER_VAL(0);
+    state = (JitState){stack, stack + 2, func->chunk.constants.values, 8};
+    jitRun(func->jit, &state);
+
+    ASSERT_EQUAL(15, state.offset);
+    ASSERT_DBL_NEAR(3.0, AS_NUMBER(stack[1]));
+    freeTestFunction();
+}
+
+#endif
@@ -0,0 +1,118 @@
+#include <string.h>
+
+#include "chunk.h"
+#include "ctest.h"
+#include "optimizer.h"
+
+static void write_code(Chunk *chunk, const uint8_t *code, int len) {
+    for (int i = 0; i < len; i++) {
+        writeChunk(chunk, code[i], i + 1);
+    }
+}
+
+CTEST(optimizer, push_pop) {
+    Chunk chunk;
+    initChunk(&chunk);
+
+    const uint8_t code[] = {OP_GET_LOCAL, 1, OP_POP, OP_NIL, OP_RETURN};
+    write_code(&chunk, code, sizeof(code));
+    optimizeChunk(&chunk, false);
+
+    const uint8_t expected[] = {OP_NIL, OP_RETURN};
+    ASSERT_DATA(expected, sizeof(expected), chunk.code, chunk.len);
+    ASSERT_EQUAL(4, chunk.lines[0]);
+    ASSERT_EQUAL(5, chunk.lines[1]);
+
+    freeChunk(&chunk);
+}
+
+CTEST(optimizer, dead_code) {
+    Chunk chunk;
+    initChunk(&chunk);
+
+    const uint8_t code[] = {OP_NIL, OP_RETURN, OP_TRUE, OP_RETURN};
+    write_code(&chunk, code, sizeof(code));
+    optimizeChunk(&chunk, false);
+
+    const uint8_t expected[] = {OP_NIL, OP_RETURN};
+    ASSERT_DATA(expected, sizeof(expected), chunk.code, chunk.len);
+
+    freeChunk(&chunk);
+}
+
+// if (true) {} with its condition POPs fused into the jump
+CTEST(optimizer, condition_pops) {
+    Chunk chunk;
+    initChunk(&chunk);
+
+    const uint8_t code[] = {
+        OP_TRUE,
+        OP_JUMP_IF_FALSE, 0, 4,
+        OP_POP,
+        OP_JUMP, 0, 1,
+        OP_POP,
+        OP_NIL,
+        OP_RETURN,
+    };
+    write_code(&chunk, code, sizeof(code));
+    optimizeChunk(&chunk, false);
+
+    const uint8_t expected[] = {
+        OP_TRUE, OP_POP_JUMP_IF_FALSE, 0, 0, OP_NIL, OP_RETURN,
+    };
+    ASSERT_DATA(expected, sizeof(expected), chunk.code, chunk.len);
+
+    freeChunk(&chunk);
+}
+
+CTEST(optimizer, superinstructions) {
+    Chunk chunk;
+    initChunk(&chunk);
+
+    const uint8_t code[] = {
+        OP_GET_LOCAL, 1, OP_GET_LOCAL, 2, OP_ADD, OP_SET_LOCAL, 1, OP_POP,
+        OP_NIL, OP_RETURN,
+    };
+    write_code(&chunk, code, sizeof(code));
+    optimizeChunk(&chunk, false);
+
+    const uint8_t expected[] = {
+        OP_GET_LOCAL_GET_LOCAL, 1, 2, OP_ADD, OP_SET_LOCAL_POP, 1,
+        OP_NIL, OP_RETURN,
+    };
+    ASSERT_DATA(expected, sizeof(expected), chunk.code, chunk.len);
+    // operands keep the line of the instruction they came from
+    ASSERT_EQUAL(1, chunk.lines[0]);
+    ASSERT_EQUAL(2, chunk.lines[1]);
+    ASSERT_EQUAL(4, chunk.lines[2]);
+
+    freeChunk(&chunk);
+}
+
+CTEST(optimizer, register_ops) {
+    Chunk chunk;
+    initChunk(&chunk);
+
+    // a = b + c; while (a < c) {}
+    const uint8_t code[] = {
+        OP_GET_LOCAL, 2, OP_GET_LOCAL, 3, OP_ADD, OP_SET_LOCAL, 1, OP_POP,
+        OP_GET_LOCAL, 1, OP_GET_LOCAL, 3, OP_LESS,
+        OP_POP_JUMP_IF_FALSE, 0, 3,
+        OP_LOOP, 0, 11,
+        OP_NIL, OP_RETURN,
+    };
+    write_code(&chunk, code, sizeof(code));
+    optimizeChunk(&chunk, true);
+
+    const uint8_t expected[] = {
+        OP_ADD_RR, 1, 2, 3,
+        OP_LESS_RR_JUMP, 1, 3, 0, 3,
+        OP_LOOP, 0, 8,
+        OP_NIL, OP_RETURN,
+    };
+    ASSERT_DATA(expected, sizeof(expected), chunk.code, chunk.len);
+    ASSERT_EQUAL(5, chunk.lines[0]);
+    ASSERT_EQUAL(13, chunk.lines[4]);
+
+    freeChunk(&chunk);
+}
@@ -3,11 +3,11 @@
 #include "ctest.h"
 #include "scanner.h"
 
-void check_tokens(const Token *expected, size_t len) {
+void check_tokens(Scanner *scanner, const Token *expected, size_t len) {
     Token token;
 
     for (size_t i = 0; i < len; i++) {
-        token = scanToken();
+        token = scanToken(scanner);
         ASSERT_EQUAL(expected[i].type, token.type);
         ASSERT_EQUAL(expected[i].line, token.line);
         ASSERT_EQUAL(expected[i].len, token.len);
@@ -16,7 +16,8 @@ void check_tokens(const Token *expected, size_t len) {
 }
 
 CTEST(scanner, keywords) {
-    initScanner("and class else false for fun if \n \
+    Scanner scanner;
+    initScanner(&scanner, "and class else false for fun if \n \
     nil or return super this true var while");
 
     const Token expected[] = {
@@ -30,11 +31,12 @@ CTEST(scanner, keywords) {
         {TKN_While, "while", 5, 2}, {TKN_EOF, "", 0, 2},
     };
 
-    check_tokens(expected, sizeof(expected) / sizeof(expected[0]));
+    check_tokens(&scanner, expected, sizeof(expected) / sizeof(expected[0]));
 }
 
 CTEST(scanner, symbols) {
-    initScanner("(){};,+-*!===<=>=!/=.");
+    Scanner scanner;
+    initScanner(&scanner, "(){};,+-*!===<=>=!/=.");
 
     const Token expected[] = {
         {TKN_LParen, "(", 1, 1},     {TKN_RParen, ")", 1, 1},
@@ -48,11 +50,12 @@ CTEST(scanner, symbols) {
         {TKN_Dot, ".", 1, 1},        {TKN_EOF, "", 0, 1},
     };
 
-    check_tokens(expected, sizeof(expected) / sizeof(expected[0]));
+    check_tokens(&scanner, expected, sizeof(expected) / sizeof(expected[0]));
 }
 
 CTEST(scanner, whitespace) {
-    initScanner("space    tabs\t\t\t\tnewlines\n \
+    Scanner scanner;
+    initScanner(&scanner, "space    tabs\t\t\t\tnewlines\n \
     \n \
     // Should be ignored properly\n \
     \n \
@@ -64,11 +67,12 @@ CTEST(scanner, whitespace) {
         {TKN_EOF, "", 0, 5},
     };
 
-    check_tokens(expected, sizeof(expected) / sizeof(expected[0]));
+    check_tokens(&scanner, expected, sizeof(expected) / sizeof(expected[0]));
 }
 
 CTEST(scanner, strings) {
-    initScanner("\"\"\n \
+    Scanner scanner;
+    initScanner(&scanner, "\"\"\n \
     \"string\" \n \
     ");
 
@@ -78,5 +82,5 @@ CTEST(scanner, strings) {
         {TKN_EOF, "", 0, 3},
     };
 
-    check_tokens(expected, sizeof(expected) / sizeof(expected[0]));
+    check_tokens(&scanner, expected, sizeof(expected) / sizeof(expected[0]));
 }
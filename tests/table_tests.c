@@ -21,7 +21,7 @@ CTEST(table, insert_multiple_entries) {
     Table table;
     initTable(&table);
 
-    Obj obj = {.type = OBJ_STRING, .marked = false, .next = NULL};
+    Obj obj = {.type = OBJ_STRING, .remembered = false};
 
     const int SIZE = 100;
 
@@ -39,23 +39,15 @@ CTEST(table, insert_multiple_entries) {
     }
 
     for (int i = 0; i < SIZE; i++) {
-        Value val = {
-            .type = VAL_NUM,
-            .as =
-                {
-                    .number = (double)i,
-                },
-        };
-
-        tableSet(&table, &strings[i], val);
+        tableSet(&table, &strings[i], NUMBER_VAL((double)i));
     }
 
     Value ret;
     for (int i = 0; i < SIZE; i++) {
         ASSERT_TRUE(tableGet(&table, &strings[i], &ret));
-        ASSERT_EQUAL(VAL_NUM, ret.type);
+        ASSERT_TRUE(IS_NUMBER(ret));
 
-        ASSERT_EQUAL((double)i, ret.as.number);
+        ASSERT_EQUAL((double)i, AS_NUMBER(ret));
     }
 }
 
@@ -63,7 +55,7 @@ CTEST(table, erase) {
     Table table;
     initTable(&table);
 
-    Obj obj = {.type = OBJ_STRING, .marked = false, .next = NULL};
+    Obj obj = {.type = OBJ_STRING, .remembered = false};
 
     const int SIZE = 100;
 
@@ -81,15 +73,7 @@ CTEST(table, erase) {
     }
 
     for (int i = 0; i < SIZE; i++) {
-        Value val = {
-            .type = VAL_NUM,
-            .as =
-                {
-                    .number = (double)i,
-                },
-        };
-
-        tableSet(&table, &strings[i], val);
+        tableSet(&table, &strings[i], NUMBER_VAL((double)i));
     }
 
     for (int i = 0; i < SIZE; i += 2) {
@@ -99,9 +83,9 @@ CTEST(table, erase) {
     Value ret;
     for (int i = 1; i < SIZE; i += 2) {
         ASSERT_TRUE(tableGet(&table, &strings[i], &ret));
-        ASSERT_EQUAL(VAL_NUM, ret.type);
+        ASSERT_TRUE(IS_NUMBER(ret));
 
-        ASSERT_EQUAL((double)i, ret.as.number);
+        ASSERT_EQUAL((double)i, AS_NUMBER(ret));
     }
 }
 
@@ -109,7 +93,7 @@ CTEST(table, copy_table) {
     Table table;
     initTable(&table);
 
-    Obj obj = {.type = OBJ_STRING, .marked = false, .next = NULL};
+    Obj obj = {.type = OBJ_STRING, .remembered = false};
 
     const int SIZE = 100;
 
@@ -127,15 +111,7 @@ CTEST(table, copy_table) {
     }
 
     for (int i = 0; i < SIZE; i++) {
-        Value val = {
-            .type = VAL_NUM,
-            .as =
-                {
-                    .number = (double)i,
-                },
-        };
-
-        tableSet(&table, &strings[i], val);
+        tableSet(&table, &strings[i], NUMBER_VAL((double)i));
     }
 
     for (int i = 0; i < SIZE; i += 2) {
@@ -150,7 +126,7 @@ CTEST(table, copy_table) {
         Value ret;
 
         tableGet(&dest, &strings[i], &ret);
-        ASSERT_EQUAL(VAL_NUM, ret.type);
-        ASSERT_EQUAL((double)i, ret.as.number);
+        ASSERT_TRUE(IS_NUMBER(ret));
+        ASSERT_EQUAL((double)i, AS_NUMBER(ret));
     }
 }
@@ -0,0 +1,67 @@
+#include "ctest.h"
+#include "fixtures.h"
+#include "trace.h"
+#include "vm.h"
+
+#ifdef JIT
+
+// back edges until the loop is recorded and its trace runs
+static bool run_hot(ObjFunction *func, JitState *state) {
+    for (int i = 0; i < TRACE_THRESHOLD; i++) {
+        if (traceEnter(func, state))
+            return true;
+    }
+    return false;
+}
+
+// the trace runs the loop to the end and leaves at its exit condition
+CTEST(trace, runs_loop) {
+    ObjFunction *func = newTestFunction(countLoop, countLoopLen);
+
+    Value stack[8] = {NIL_VAL, NUMBER_VAL(0)};
+    JitState state = {stack, stack + 2, func->chunk.constants.values, 0};
+    ASSERT_TRUE(run_hot(func, &state));
+
+    ASSERT_EQUAL(5, state.offset);
+    ASSERT_TRUE(state.sp == stack + 3);
+    ASSERT_TRUE(IS_BOOL(stack[2]) && !AS_BOOL(stack[2]));
+    ASSERT_DBL_NEAR(10.0, AS_NUMBER(stack[1]));
+    freeTestFunction();
+}
+
+// a variable of another type fails the entry guard before anything happens
+CTEST(trace, entry_guard) {
+    ObjFunction *func = newTestFunction(countLoop, countLoopLen);
+
+    Value stack[8] = {NIL_VAL, NUMBER_VAL(0)};
+    JitState state = {stack, stack + 2, func->chunk.constants.values, 0};
+    ASSERT_TRUE(run_hot(func, &state));
+
+    stack[1] = NIL_VAL;
+    state = (JitState){stack, stack + 2, func->chunk.constants.values, 0};
+    ASSERT_TRUE(traceEnter(func, &state));
+    ASSERT_EQUAL(0, state.offset);
+    ASSERT_TRUE(state.sp == stack + 2);
+    ASSERT_TRUE(IS_NIL(stack[1]));
+    freeTestFunction();
+}
+
+// `while (true) print 1;` cannot be traced, so the loop backs off
+CTEST(trace, aborts) {
+    const uint8_t code[] = {
+        OP_CONSTANT, 1, OP_PRINT, OP_LOOP, 0, 6, OP_NIL, OP_RETURN,
+    };
+    ObjFunction *func = newTestFunction(code, sizeof(code));
+
+    Value stack[8] = {NIL_VAL};
+    JitState state = {stack, stack + 1, func->chunk.constants.values, 0};
+    ASSERT_FALSE(run_hot(func, &state));
+
+    Trace *trace = traceLoop(func, 0);
+    ASSERT_EQUAL(1, trace->aborts);
+    ASSERT_TRUE(trace->code == NULL);
+    ASSERT_TRUE(trace->hits > TRACE_THRESHOLD);
+    freeTestFunction();
+}
+
+#endif
@@ -31,7 +31,7 @@ CTEST(value, tagged_uinon) {
     }
 
     {
-        Obj obj = {.type = OBJ_STRING, .marked = false, .next = NULL};
+        Obj obj = {.type = OBJ_STRING, .remembered = false};
         ObjString hello = {.obj = obj, .chars = "hello", .len = 5, .hash = 5};
 
         Value val = OBJ_VAL(&hello);
@@ -53,3 +53,14 @@ CTEST(value, falsey) {
     ASSERT_FALSE(is_falsey(NUMBER_VAL(5.0)));
     ASSERT_FALSE(is_falsey(OBJ_VAL(NULL)));
 }
+
+CTEST(value, nan_not_equal) {
+    Value val = NUMBER_VAL(0.0 / 0.0);
+    ASSERT_TRUE(IS_NUMBER(val));
+    ASSERT_FALSE(IS_OBJ(val));
+    ASSERT_FALSE(values_equal(val, val));
+
+    ASSERT_TRUE(values_equal(NIL_VAL, NIL_VAL));
+    ASSERT_FALSE(values_equal(NIL_VAL, BOOL_VAL(false)));
+    ASSERT_FALSE(values_equal(NUMBER_VAL(0), BOOL_VAL(false)));
+}
@@ -0,0 +1,390 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ctest.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// The scripts check their own results and fail with a runtime error.
+static const char *sum_script =
+    "class Acc { init() { this.total = 0; } add(n) { this.total = this.total "
+    "+ n; } }\n"
+    "fun run(n) {\n"
+    "  var acc = Acc();\n"
+    "  var name = \"\";\n"
+    "  for (var i = 1; i <= n; i = i + 1) {\n"
+    "    acc.add(i);\n"
+    "    name = name + \"x\";\n"
+    "  }\n"
+    "  return acc.total;\n"
+    "}\n"
+    "if (run(2000) != 2001000) nil + 1;\n";
+
+// every VM has globals of its own
+CTEST(vm, isolated_globals) {
+    VM *a = vmNew();
+    VM *b = vmNew();
+
+    ASSERT_EQUAL(INTERPRET_OK, vmInterpret(a, "var x = 1;"));
+    ASSERT_EQUAL(INTERPRET_OK, vmInterpret(b, "var x = 2;"));
+    ASSERT_EQUAL(INTERPRET_OK, vmInterpret(a, "if (x != 1) nil + 1;"));
+    ASSERT_EQUAL(INTERPRET_OK, vmInterpret(b, "if (x != 2) nil + 1;"));
+
+    vmFree(a);
+    ASSERT_EQUAL(INTERPRET_OK, vmInterpret(b, sum_script));
+    vmFree(b);
+}
+
+static void *run_vm(void *result) {
+    VM *machine = vmNew();
+    *(InterpretResult *)result = vmInterpret(machine, sum_script);
+    vmFree(machine);
+    return NULL;
+}
+
+// VMs on different threads run side by side
+CTEST(vm, threads) {
+    enum { THREADS = 4 };
+    pthread_t threads[THREADS];
+    InterpretResult results[THREADS];
+
+    for (int i = 0; i < THREADS; i++) {
+        ASSERT_EQUAL(0, pthread_create(&threads[i], NULL, run_vm, &results[i]));
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        ASSERT_EQUAL(INTERPRET_OK, results[i]);
+    }
+}
+
+// an error in a fiber ends it and leaves the VM on its main fiber
+CTEST(vm, fiber_error) {
+    VM *machine = vmNew();
+
+    ASSERT_EQUAL(INTERPRET_OK,
+                 vmInterpret(machine, "fun body(n) { yield(n); nil + 1; }\n"
+                                      "var f = fiber(body);\n"
+                                      "if (resume(f, 1) != 1) nil + 1;\n"));
+    ASSERT_EQUAL(INTERPRET_RUNTIME_ERR, vmInterpret(machine, "resume(f);"));
+    ASSERT_EQUAL(INTERPRET_OK,
+                 vmInterpret(machine, "if (!isDone(f)) nil + 1;\n"
+                                      "var g = fiber(body);\n"
+                                      "if (resume(g, 2) != 2) nil + 1;\n"));
+    ASSERT_NULL(machine->fiber);
+
+    vmFree(machine);
+}
+
+// a closure keeps the stack of the fiber it yielded from, which its open
+// upvalues point into
+CTEST(vm, fiber_upvalue) {
+    VM *machine = vmNew();
+
+    ASSERT_EQUAL(INTERPRET_OK,
+                 vmInterpret(machine, "fun body() {\n"
+                                      "  var x = \"captured\";\n"
+                                      "  fun get() { return x; }\n"
+                                      "  yield(get);\n"
+                                      "}\n"
+                                      "var f = fiber(body);\n"
+                                      "var g = resume(f);\n"
+                                      "f = nil;\n"));
+    collectGarbage();
+    ASSERT_EQUAL(INTERPRET_OK,
+                 vmInterpret(machine, "var s = \"\";\n"
+                                      "for (var i = 0; i < 100; i = i + 1) {\n"
+                                      "  s = s + \"x\";\n"
+                                      "}\n"
+                                      "if (g() != \"captured\") nil + 1;\n"));
+
+    vmFree(machine);
+}
+
+// a young value stored through an open upvalue into the stack of an old,
+// suspended fiber lives as long as the fiber does
+CTEST(vm, fiber_upvalue_store) {
+    VM *machine = vmNew();
+
+    ASSERT_EQUAL(INTERPRET_OK,
+                 vmInterpret(machine, "fun body() {\n"
+                                      "  var x = nil;\n"
+                                      "  fun set(v) { x = v; }\n"
+                                      "  yield(set);\n"
+                                      "  return x;\n"
+                                      "}\n"
+                                      "var f = fiber(body);\n"
+                                      "var s = resume(f);\n"));
+    collectGarbage();
+    ASSERT_EQUAL(INTERPRET_OK, vmInterpret(machine, "var a = \"abc\";\n"
+                                                    "s(a + \"def\");\n"));
+    collectYoung();
+    ASSERT_EQUAL(INTERPRET_OK,
+                 vmInterpret(machine, "var t = \"\";\n"
+                                      "for (var i = 0; i < 100; i = i + 1) {\n"
+                                      "  t = t + \"x\";\n"
+                                      "}\n"
+                                      "if (resume(f) != a + \"def\") nil + 1;\n"));
+
+    vmFree(machine);
+}
+
+// only a closure over a local past the first 256 slots takes the long form,
+// with two-byte upvalue indices
+CTEST(vm, wide_upvalues) {
+    VM *machine = vmNew();
+
+    char src[8192] = "fun outer() {\n";
+    for (int i = 0; i < 300; i++) {
+        char local[32];
+        snprintf(local, sizeof(local), "var l%d;\n", i);
+        strcat(src, local);
+    }
+    // the function constants come before the 256th
+    strcat(src, "  l1 = 1; l2 = 1; l299 = 1;\n"
+                "  fun near() { return l1; }\n"
+                "  fun far() { return l299 + l1 + l2; }\n"
+                "  return near() + far();\n"
+                "}\n"
+                "if (outer() != 4) nil + 1;\n");
+    ASSERT_EQUAL(INTERPRET_OK, vmInterpret(machine, src));
+
+    vmFree(machine);
+}
+
+// whether the function in global `name` has `op` in its code
+static bool has_op(VM *machine, const char *name, Opcode op) {
+    int slot = globalSlot(copyString(name, (int)strlen(name)));
+    Chunk *chunk = &AS_CLOSURE(machine->globals.values[slot])->func->chunk;
+    for (size_t offset = 0; offset < chunk->len;
+         offset += instructionLen(chunk, offset)) {
+        if (chunk->code[offset] == op)
+            return true;
+    }
+    return false;
+}
+
+// a site that sees numbers and strings by turns stays generic after its
+// first miss instead of rewriting itself on every run
+CTEST(vm, polymorphic_add) {
+    VM *machine = vmNew();
+
+    ASSERT_EQUAL(INTERPRET_OK,
+                 vmInterpret(machine, "fun add(a, b) { return a + b; }\n"
+                                      "if (add(1, 2) != 3) nil + 1;\n"));
+    ASSERT_TRUE(has_op(machine, "add", OP_ADD_NUM));
+    ASSERT_EQUAL(INTERPRET_OK,
+                 vmInterpret(machine, "for (var i = 0; i < 10; i = i + 1) {\n"
+                                      "  if (add(\"a\", \"b\") != \"ab\") "
+                                      "nil + 1;\n"
+                                      "  if (add(i, 1) != i + 1) nil + 1;\n"
+                                      "}\n"));
+    ASSERT_TRUE(has_op(machine, "add", OP_ADD_ANY));
+    ASSERT_EQUAL(INTERPRET_RUNTIME_ERR, vmInterpret(machine, "add(1, nil);"));
+
+    vmFree(machine);
+}
+
+// Stress builds collect on every allocation, which leaves no generations to
+// look at.
+#ifdef DEBUG_STRESS_GC
+#define GC_CTEST CTEST_SKIP
+#else
+#define GC_CTEST CTEST
+#endif
+
+// survivors of a collection get old, and the write barrier records old
+// objects given a reference to a young one
+GC_CTEST(vm, generations) {
+    VM *machine = vmNew();
+
+    ObjUpvalue *upvalue = newUpvalue(NULL);
+    push(OBJ_VAL(upvalue));
+    collectYoung();
+    ASSERT_TRUE(isMarked(&upvalue->obj));
+    ASSERT_EQUAL(0, machine->youngBytes);
+
+    ObjString *str = copyString("young", 5);
+    ASSERT_FALSE(isMarked(&str->obj));
+    upvalue->closed = OBJ_VAL(str);
+    writeBarrier(&upvalue->obj, upvalue->closed);
+    ASSERT_EQUAL(1, machine->rememberedCount);
+
+    collectYoung();
+    ASSERT_TRUE(isMarked(&str->obj));
+    ASSERT_EQUAL(0, machine->rememberedCount);
+    ASSERT_FALSE(upvalue->obj.remembered);
+
+    pop();
+    vmFree(machine);
+}
+
+// the cell of a dead object goes to the next object of its size
+GC_CTEST(vm, pages) {
+    VM *machine = vmNew();
+
+    Obj *dead = &copyString("dead", 4)->obj;
+    collectGarbage();
+    ASSERT_EQUAL(GC_IDLE, machine->gcPhase);
+
+    ObjString *str = copyString("live", 4);
+    ASSERT_TRUE(&str->obj == dead);
+    ASSERT_FALSE(isMarked(&str->obj));
+
+    vmFree(machine);
+}
+
+#ifdef DEBUG_GC_STATS
+// objects too big for a size class get a page each, which goes away with
+// them, whichever collection finds them dead
+GC_CTEST(vm, large_pages) {
+    VM *machine = vmNew();
+
+    ObjClass *klass = newClass(copyString("Big", 3));
+    push(OBJ_VAL(klass));
+    klass->fieldHint = 64;
+    collectGarbage();
+    size_t small = machine->gcStats.pageBytes;
+
+    push(OBJ_VAL(newInstance(klass)));
+    size_t page = machine->gcStats.pageBytes - small;
+    ASSERT_TRUE(page >= GC_PAGE_SIZE);
+    newInstance(klass);
+    ASSERT_EQUAL(small + 2 * page, machine->gcStats.pageBytes);
+
+    // the dead one's page goes in a minor collection, the other one gets old
+    collectYoung();
+    ASSERT_EQUAL(small + page, machine->gcStats.pageBytes);
+    pop();
+    collectYoung();
+    ASSERT_EQUAL(small + page, machine->gcStats.pageBytes);
+    collectGarbage();
+    ASSERT_EQUAL(small, machine->gcStats.pageBytes);
+
+    pop();
+    vmFree(machine);
+}
+#endif
+
+// a major collection goes in increments of a few objects, and the script
+// relinks the objects it is marking and gives them new ones in between
+GC_CTEST(vm, incremental) {
+    VM *machine = vmNew();
+    machine->gcBudget = 8;
+
+    ASSERT_EQUAL(INTERPRET_OK,
+                 vmInterpret(machine,
+                             "class Node { init(v, next) { this.v = v; "
+                             "this.next = next; } }\n"
+                             "var list = nil;\n"
+                             "for (var i = 0; i < 20000; i = i + 1) "
+                             "list = Node(i, list);\n"));
+    machine->nextGC = machine->bytesAllocated;
+    ASSERT_EQUAL(INTERPRET_OK, vmInterpret(machine, "var prev = nil;\n"));
+    // still marking once the script is done
+    ASSERT_EQUAL(GC_MARK, machine->gcPhase);
+
+    ASSERT_EQUAL(INTERPRET_OK,
+                 vmInterpret(machine, "while (list != nil) {\n"
+                                      "  var next = list.next;\n"
+                                      "  list.next = prev;\n"
+                                      "  list.tag = Node(list.v, nil);\n"
+                                      "  prev = list;\n"
+                                      "  list = next;\n"
+                                      "}\n"
+                                      "list = prev;\n"));
+    collectGarbage();
+    ASSERT_EQUAL(GC_IDLE, machine->gcPhase);
+    ASSERT_EQUAL(INTERPRET_OK,
+                 vmInterpret(machine, "var sum = 0;\n"
+                                      "for (var n = list; n != nil; n = n.next) "
+                                      "sum = sum + n.tag.v;\n"
+                                      "if (sum != 199990000) nil + 1;\n"));
+
+    vmFree(machine);
+}
+
+// marking only runs concurrently with NaN boxing, see gcStore()
+#ifdef NAN_BOXING
+#define CONCURRENT_CTEST CTEST
+#else
+#define CONCURRENT_CTEST CTEST_SKIP
+#endif
+
+// marking on the background thread while the script relinks the old objects
+// the marker is tracing
+CONCURRENT_CTEST(vm, concurrent) {
+    VM *machine = vmNew();
+    machine->gcConcurrent = true;
+    machine->nextGC = 64 * 1024;
+
+    ASSERT_EQUAL(INTERPRET_OK,
+                 vmInterpret(machine,
+                             "class Node { init(v, next) { this.v = v; "
+                             "this.next = next; } }\n"
+                             "var list = nil;\n"
+                             "for (var i = 0; i < 20000; i = i + 1) "
+                             "list = Node(i, list);\n"
+                             "for (var r = 0; r < 10; r = r + 1) {\n"
+                             "  var prev = nil;\n"
+                             "  while (list != nil) {\n"
+                             "    var next = list.next;\n"
+                             "    list.next = prev;\n"
+                             "    list.tag = \"t\" + \"ag\";\n"
+                             "    prev = list;\n"
+                             "    list = next;\n"
+                             "  }\n"
+                             "  list = prev;\n"
+                             "}\n"
+                             "var sum = 0;\n"
+                             "for (var n = list; n != nil; n = n.next) "
+                             "sum = sum + n.v;\n"
+                             "if (sum != 199990000) nil + 1;\n"));
+#ifdef DEBUG_GC_STATS
+    ASSERT_TRUE(machine->gcStats.markerRaces > 0);
+#endif
+    collectGarbage();
+    ASSERT_EQUAL(GC_IDLE, machine->gcPhase);
+    ASSERT_FALSE(machine->markingConcurrently);
+
+    vmFree(machine);
+}
+
+// a tree wide enough for every thread tracing to get some of it
+CTEST(vm, parallel) {
+    VM *machine = vmNew();
+    machine->gcThreads = 4;
+    machine->nextGC = 64 * 1024;
+
+    ASSERT_EQUAL(INTERPRET_OK,
+                 vmInterpret(machine,
+                             "class Tree { init(l, r) { this.l = l; "
+                             "this.r = r; } }\n"
+                             "fun tree(depth) {\n"
+                             "  if (depth == 0) return nil;\n"
+                             "  var d = depth - 1;\n"
+                             "  return Tree(tree(d), tree(d));\n"
+                             "}\n"
+                             "fun count(t) {\n"
+                             "  if (t == nil) return 0;\n"
+                             "  return 1 + count(t.l) + count(t.r);\n"
+                             "}\n"
+                             "var keep = tree(14);\n"
+                             "for (var i = 0; i < 20; i = i + 1) tree(10);\n"
+                             "if (count(keep) != 16383) nil + 1;\n"));
+    // the tree hangs off a single root, which one thread gets: the others
+    // only get to trace any of it by stealing
+#ifdef DEBUG_GC_STATS
+    machine->gcStats.grayStolen = 0;
+#endif
+    collectGarbage();
+    ASSERT_EQUAL(GC_IDLE, machine->gcPhase);
+#ifdef DEBUG_GC_STATS
+    ASSERT_TRUE(machine->gcStats.grayStolen > 0);
+#endif
+    ASSERT_EQUAL(INTERPRET_OK,
+                 vmInterpret(machine, "if (count(keep) != 16383) nil + 1;\n"));
+
+    vmFree(machine);
+}